@@ -1,11 +1,16 @@
 #pragma once
 
 #define USB_ENTRIES_MAX 128
+#define USB_SWEEP_BUDGET 8
+#define BIN_SWEEP_BUDGET 8
 #define TCA_ENTRIES_MAX 64
 #define TCA_BIN_SIZE 7
 
 #define NBINS 128
 #define NFASTBINS 10
+#define MIN_LARGE_SIZE 1024
+#define MAX_ARENAS 256
+#define HEAP_MAX_SIZE (64UL * 1024 * 1024)
 #define BINMAPSHIFT 5
 #define BITSPERMAP (1U << BINMAPSHIFT)
 #define BINMAPSIZE (NBINS / BITSPERMAP)
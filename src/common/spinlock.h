@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <sched.h>
+
+/// A minimal test-and-test-and-set lock.
+///
+/// Unlike std::mutex this never calls into the allocator,
+/// so it is safe to use from within the malloc hooks.
+/// Critical sections guarded by it must be short;
+/// waiters only enter the kernel to yield once spinning didn't help.
+class SpinLock {
+    static constexpr unsigned SPINS_BEFORE_YIELD = 128;
+
+    std::atomic<bool> locked{ false };
+
+public:
+    SpinLock() = default;
+    SpinLock(SpinLock const&) = delete;
+
+    void lock() noexcept {
+        while (true) {
+            if (!locked.exchange(true, std::memory_order_acquire)) return;
+
+            // spin on a plain load so that waiting threads
+            // don't bounce the cache line between cores,
+            // but give up the time slice if the owner was preempted
+            for (unsigned spins = 0; locked.load(std::memory_order_relaxed); spins++) {
+                if (spins < SPINS_BEFORE_YIELD)
+                    __builtin_ia32_pause();
+                else
+                    sched_yield();
+            }
+        }
+    }
+
+    bool try_lock() noexcept {
+        return !locked.load(std::memory_order_relaxed) &&
+               !locked.exchange(true, std::memory_order_acquire);
+    }
+
+    void unlock() noexcept {
+        locked.store(false, std::memory_order_release);
+    }
+};
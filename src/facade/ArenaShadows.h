@@ -0,0 +1,155 @@
+#pragma once
+
+#include "../common/common.h"
+#include "../common/malloc_meta.h"
+#include "../common/spinlock.h"
+#include "../facade/ShadowHeapData.h"
+#include "../leak/leak.h"
+#include "../store/MmapAllocator.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+/// The arenas of the process, each with a ShadowHeapData that holds the snapshots of its heap.
+///
+/// The main arena is leaked at startup.
+/// The other arenas are found via the `next` ring that links all arenas,
+/// once a chunk of an arena that isn't known yet shows up.
+/// Each arena has a metadata store of its own, which is guarded by the lock of the arena,
+/// unless the store is thread-safe and shared by all arenas.
+///
+/// Arenas are only ever added, under a lock, and published by incrementing the count.
+/// So they can be looked up without a lock.
+class ArenaShadows {
+public:
+    struct Arena {
+        ARENA_INFO* info = nullptr;
+        ShadowHeapData* data = nullptr;
+    };
+
+private:
+    MmapAllocator<ARENA_INFO> infoAllocator;
+    MmapAllocator<ShadowHeapData> dataAllocator;
+    MmapAllocator<ConcreteMetaStore> storeAllocator;
+    Arena arenas[MAX_ARENAS];
+    std::atomic<size_t> count{ 0 };
+    /// serializes adding arenas
+    SpinLock tableLock;
+
+    Arena* find(AR_MAIN* arena) noexcept {
+        size_t known = count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < known; i++)
+            if (arenas[i].info->arena == arena) return &arenas[i];
+        return nullptr;
+    }
+
+    /// Add `arena`, the table lock MUST be held.
+    Arena* add(AR_MAIN* arena) {
+        size_t index = count.load(std::memory_order_relaxed);
+        if (UNLIKELY(index == MAX_ARENAS)) return nullptr;
+        auto arena_info = infoAllocator.allocate(1);
+        new (arena_info) ARENA_INFO(*arenas[0].info, arena);
+        auto data = dataAllocator.allocate(1);
+        new (data) ShadowHeapData();
+#ifdef FBN_CHECK
+        data->fastbins.use_safe_linking(arenas[0].data->fastbins.uses_safe_linking());
+#endif
+#ifdef PTR_CHECK
+        // the main arena reserved SHADOWHEAP_SIZE_INITIAL, the others start small
+        if (!ConcreteMetaStore::is_thread_safe) {
+            data->store = new (storeAllocator.allocate(1)) ConcreteMetaStore{};
+            select_store_like(*data->store, *arenas[0].data->store);
+        }
+#endif
+        info("ARENA   (NEW ) Found arena %p\n", arena);
+        arenas[index] = Arena{ arena_info, data };
+        count.store(index + 1, std::memory_order_release);
+        return &arenas[index];
+    }
+
+    /// Walk the ring of arenas from the main arena, and add the arenas that aren't known yet.
+    void discover() {
+        std::lock_guard<SpinLock> guard{ tableLock };
+        auto main_arena = arenas[0].info->arena;
+        auto arena = *arenas[0].info->next;
+        // the ring is only followed as far as there can be arenas, in case it was overwritten
+        for (size_t steps = 0; arena && arena != main_arena && steps < MAX_ARENAS; steps++) {
+            auto known = find(arena);
+            if (!known) known = add(arena);
+            if (!known) return;
+            arena = *known->info->next;
+        }
+    }
+
+public:
+    ArenaShadows() {
+    }
+
+    ArenaShadows(ArenaShadows const&) = delete;
+
+    void ensure_initialized(ARENA_INFO* main_info, ShadowHeapData* main_data) {
+        if (count.load(std::memory_order_acquire)) return;
+        arenas[0] = Arena{ main_info, main_data };
+        count.store(1, std::memory_order_release);
+    }
+
+    Arena* main_arena() noexcept {
+        return &arenas[0];
+    }
+
+    /// The arena `arena`, or nullptr if it can't be found or there are more than MAX_ARENAS.
+    Arena* for_arena(AR_MAIN* arena) {
+        if (LIKELY(arena == arenas[0].info->arena)) return &arenas[0];
+        if (auto known = find(arena)) return known;
+        discover();
+        return find(arena);
+    }
+
+    /// The arena that owns a chunk that isn't mmapped, like glibc's arena_for_chunk():
+    /// the chunks of the other arenas lie in heaps of HEAP_MAX_SIZE bytes,
+    /// which start with a pointer to their arena.
+    Arena* for_chunk(CHUNK_HEADER* chunk) {
+        if (LIKELY(chunk->is_main_arena())) return &arenas[0];
+        return for_arena(*(AR_MAIN**)((uintptr_t)chunk & ~(HEAP_MAX_SIZE - 1)));
+    }
+
+    /// The arena at `index` in the table, which MUST be below size().
+    Arena* at(size_t index) noexcept {
+        return &arenas[index];
+    }
+
+    /// The number of arenas found so far.
+    size_t size() const noexcept {
+        return count.load(std::memory_order_acquire);
+    }
+
+    /// Lock the arenas from index `first` on, in the order of the table, and return the number of arenas
+    /// that are locked then. Locks of several arenas are always taken in this order, so they can't deadlock.
+    size_t lock_all(size_t first = 0) noexcept {
+        size_t known = size();
+        for (size_t i = first; i < known; i++)
+            arenas[i].data->lock.lock();
+        return known;
+    }
+
+    /// Unlock the first `locked` arenas, see lock_all().
+    void unlock_all(size_t locked) noexcept {
+        for (size_t i = 0; i < locked; i++)
+            arenas[i].data->lock.unlock();
+    }
+
+    /// Lock all arenas and the table, so that no arena is added until unlock_table_and_all().
+    /// A thread adds an arena while it holds the lock of another, so the table is locked after those.
+    size_t lock_table_and_all() noexcept {
+        size_t locked = lock_all();
+        tableLock.lock();
+        return lock_all(locked);
+    }
+
+    void unlock_table_and_all(size_t locked) noexcept {
+        tableLock.unlock();
+        unlock_all(locked);
+    }
+};
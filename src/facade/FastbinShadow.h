@@ -0,0 +1,161 @@
+#pragma once
+
+#include "../common/common.h"
+#include "../leak/leak.h"
+#include "../store/MmapAllocator.h"
+
+#include <cstddef>
+#include <cstdint>
+
+/// A shadow copy of the fastbins of an arena, as one stack of chunks per fastbin.
+///
+/// A fastbin is a singly linked stack: free() pushes a chunk, malloc() pops the head
+/// and follows its fd, and then follows the fds of up to TCA_BIN_SIZE more chunks
+/// that it moves into the tcache. So the check before an operation compares the heads of all fastbins,
+/// and the fds of the top MAX_POPS chunks of the operation's own fastbin, which are the links
+/// that one malloc() can follow. A chunk that was corrupted while deeper in the stack is found
+/// once it comes within reach.
+///
+/// After an operation, the heads are matched against the expected transitions:
+/// a push of the freed chunk, or a pop of the head (plus the chunks that malloc() moves into
+/// the tcache along with it). Any other change of the operation's own fastbin is reported.
+/// The other fastbins only change if malloc_consolidate() emptied them,
+/// or in an operation on several fastbins like realloc(), so they are emptied or walked again.
+///
+/// Since glibc 2.32 the fd of a chunk in a fastbin is mangled with its own address (safe-linking),
+/// see use_safe_linking().
+class FastbinShadow {
+    /// The most chunks that one malloc() takes from a fastbin: the one it returns,
+    /// and those that fill up the tcache bin of that size.
+    static constexpr size_t MAX_POPS = 1 + TCA_BIN_SIZE;
+
+    struct Stack {
+        /// the chunks from the bottom to the head of the fastbin
+        CHUNKPTR** chunks = nullptr;
+        size_t size = 0;
+        size_t capacity = 0;
+
+        CHUNKPTR* head() const noexcept {
+            return size ? chunks[size - 1] : nullptr;
+        }
+    };
+
+    MmapAllocator<CHUNKPTR*> allocator;
+    Stack bins[NFASTBINS];
+    bool valid = false;
+    bool safe_linking = false;
+
+    /// The fd of a chunk in a fastbin, like glibc's REVEAL_PTR().
+    CHUNKPTR* next(CHUNKPTR* chunk) const noexcept {
+        if (!safe_linking) return chunk->fd;
+        return (CHUNKPTR*)(((uintptr_t)&chunk->fd >> 12) ^ (uintptr_t)chunk->fd);
+    }
+
+    void reserve(Stack& stack, size_t request) {
+        if (LIKELY(request <= stack.capacity)) return;
+        // at least a page, so that the stack is mapped and not taken from the heap that it describes
+        auto capacity = stack.capacity ? stack.capacity : 4096 / sizeof(CHUNKPTR*);
+        while (capacity < request)
+            capacity *= 2;
+        if (stack.chunks)
+            stack.chunks = allocator.reallocate(stack.chunks, stack.capacity, capacity);
+        else
+            stack.chunks = allocator.allocate(capacity);
+        stack.capacity = capacity;
+    }
+
+    /// Walk the fastbin starting at `head` again.
+    /// Returns a chunk that is linked twice, i.e. a corrupted fastbin, or nullptr.
+    CHUNKPTR* rebuild(Stack& stack, CHUNKPTR* head) {
+        // Brent's cycle detection, so that a cycle doesn't run forever
+        size_t length = 0;
+        CHUNKPTR* saved = head;
+        for (auto chunk = head; chunk; chunk = next(chunk)) {
+            length++;
+            if (next(chunk) == saved) return saved;
+            if ((length & (length - 1)) == 0) saved = chunk;
+        }
+
+        reserve(stack, length);
+        stack.size = length;
+        for (auto chunk = head; chunk; chunk = next(chunk))
+            stack.chunks[--length] = chunk;
+        return nullptr;
+    }
+
+public:
+    FastbinShadow() {
+    }
+
+    FastbinShadow(FastbinShadow const&) = delete;
+
+    /// Whether the fd pointers are mangled, i.e. whether glibc is 2.32 or later.
+    void use_safe_linking(bool enabled) noexcept {
+        safe_linking = enabled;
+    }
+
+    bool uses_safe_linking() const noexcept {
+        return safe_linking;
+    }
+
+    ~FastbinShadow() {
+        for (auto& stack : bins)
+            if (stack.chunks) allocator.deallocate(stack.chunks, stack.capacity);
+    }
+
+    /// Check the heads of all fastbins, and the links that the pops from fastbin `fidx` follow.
+    /// Returns the corrupted fastbin, or NFASTBINS.
+    size_t verify(CHUNKPTR* const* fastbins, size_t fidx) const noexcept {
+        if (UNLIKELY(!valid)) return NFASTBINS;
+        for (size_t i = 0; i < NFASTBINS; i++)
+            if (UNLIKELY(fastbins[i] != bins[i].head())) return i;
+        if (fidx >= NFASTBINS) return NFASTBINS;
+        auto& stack = bins[fidx];
+        for (size_t k = 0; k < MAX_POPS && k < stack.size; k++) {
+            auto below = k + 1 < stack.size ? stack.chunks[stack.size - 2 - k] : nullptr;
+            if (UNLIKELY(next(stack.chunks[stack.size - 1 - k]) != below)) return fidx;
+        }
+        return NFASTBINS;
+    }
+
+    /// Follow the fastbins after an operation on fastbin `fidx`, which freed the chunk `freed`
+    /// (or nullptr for an allocation). Returns a chunk that is linked twice,
+    /// or the head of fastbin `fidx` if neither a push nor pops explain it, or nullptr.
+    CHUNKPTR* update(CHUNKPTR* const* fastbins, size_t fidx, CHUNKPTR* freed) {
+        for (size_t i = 0; i < NFASTBINS; i++) {
+            auto& stack = bins[i];
+            auto head = fastbins[i];
+            if (LIKELY(valid && head == stack.head())) continue;
+            if (head == nullptr) {
+                stack.size = 0;
+                continue;
+            }
+
+            if (LIKELY(valid && i == fidx)) {
+                if (head == freed && next(head) == stack.head()) {
+                    reserve(stack, stack.size + 1);
+                    stack.chunks[stack.size++] = head;
+                    continue;
+                }
+                bool popped = false;
+                for (size_t pops = 1; pops <= MAX_POPS && pops < stack.size; pops++) {
+                    if (stack.chunks[stack.size - 1 - pops] != head) continue;
+                    stack.size -= pops;
+                    popped = true;
+                    break;
+                }
+                if (popped) continue;
+                return head;
+            }
+
+            if (auto chunk = rebuild(stack, head)) return chunk;
+        }
+        valid = true;
+        return nullptr;
+    }
+
+    /// The number of chunks in fastbin `fidx`.
+    size_t size(size_t fidx) const noexcept {
+        return bins[fidx].size;
+    }
+};
@@ -2,15 +2,34 @@
 
 #include "../common/common.h"
 #include "../common/malloc_meta.h"
+#include "../common/spinlock.h"
+#include "../facade/FastbinShadow.h"
+#include "../facade/SortedBinShadow.h"
+#include "../facade/UnsortedBinModel.h"
 #include "../leak/leak.h"
+#include "../store/AdaptiveMetaStore.h"
 #include "../store/CachedMetaStore.h"
+#include "../store/CompactMetaStore.h"
 #include "../store/HashMetaStore.h"
 #include "../store/InternalAllocator.h"
 #include "../store/MapMetaStore.h"
+#include "../store/MmapAllocator.h"
+#include "../store/PoolAllocator.h"
+#include "../store/RuntimeMetaStore.h"
+#include "../store/ShadowMetaStore.h"
+#include "../store/ShardedMetaStore.h"
+#include "../store/SwissMetaStore.h"
+#include "../store/ThreadLocalMetaStore.h"
 #include "../store/UnorderedMapMetaStore.h"
 #include "../store/VectorMetaStore.h"
 #include "../store/metastore.h"
 
+#include <cstdint>
+#include <cstring>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #ifndef META_STORE
 #define META_STORE CachedMetaStore<>
 #endif
@@ -19,7 +38,103 @@
 #define META_STORE_US VectorMetaStore<>::with_allocator<InternalAllocator>
 #endif
 
-using ConcreteMetaStore = META_STORE::with_allocator<InternalAllocator>;
+#ifndef META_STORE_ALLOCATOR
+#define META_STORE_ALLOCATOR InternalAllocator
+#endif
+
+using ConcreteMetaStore = META_STORE::with_allocator<META_STORE_ALLOCATOR>;
+
+#define META_STORE_STRINGIFY(...) #__VA_ARGS__
+#define META_STORE_EXPAND_NAME(...) META_STORE_STRINGIFY(__VA_ARGS__)
+/// The configured store, for reporting.
+#define META_STORE_NAME META_STORE_EXPAND_NAME(META_STORE)
+
+/// Apply SHADOWHEAP_STORE, which only a RuntimeMetaStore can honour.
+template <class Store>
+inline void select_store(Store&, const char* name) {
+    if (name) warn("ShadowHeap: SHADOWHEAP_STORE=%s ignored, store is %s\n", name, META_STORE_NAME);
+}
+
+template <class Allocator>
+inline void select_store(RuntimeMetaStore<Allocator>& store, const char* name) {
+    if (!name || store.select(name)) return;
+    warn("ShadowHeap: ERROR: variable SHADOWHEAP_STORE: unknown store '%s', available: %s\n", name,
+         store.available_stores());
+    std::exit(1);
+}
+
+/// Select the same store as `like`, for the stores that are created after the first one.
+template <class Store>
+inline void select_store_like(Store&, Store&) {
+}
+
+template <class Allocator>
+inline void select_store_like(RuntimeMetaStore<Allocator>& store, RuntimeMetaStore<Allocator>& like) {
+    store.select(like.selected_store());
+}
+
+/// The fields of the arena and the tcache that the checks compare first, in two cache lines:
+/// the size of the top chunk, the ends of the unsorted bin, and the counts of the tcache bins.
+/// Fields of disabled mitigations stay zero.
+struct alignas(64) HeapFingerprint {
+    size_t topchunksize = 0;
+    void* unsorted_head = nullptr;
+    void* unsorted_tail = nullptr;
+    size_t reserved = 0;
+    /// Counts above 255 (only possible with a tuned tcache in 2.30+) are saturated.
+    uint8_t tcache_counts[TCACHE_ENTRIES] = {};
+
+    /// the bytes before the padding
+    static constexpr size_t USED_SIZE = 4 * sizeof(size_t) + TCACHE_ENTRIES;
+
+    static void narrow_counts(uint8_t* to, char const* from) noexcept {
+        std::memcpy(to, from, TCACHE_ENTRIES);
+    }
+
+    static void narrow_counts(uint8_t* to, uint16_t const* from) noexcept {
+        for (int i = 0; i < TCACHE_ENTRIES; i++)
+            to[i] = from[i] > 255 ? 255 : from[i];
+    }
+
+    template <class TcacheLayout>
+    void set_tcache_counts(TcacheLayout const& tcache) noexcept {
+        narrow_counts(tcache_counts, tcache.counts);
+    }
+
+    /// Compare both cache lines at once.
+    bool operator==(HeapFingerprint const& other) const noexcept {
+        auto a = reinterpret_cast<const char*>(this);
+        auto b = reinterpret_cast<const char*>(&other);
+#ifdef __AVX2__
+        auto diff = _mm256_xor_si256(
+            _mm256_load_si256(reinterpret_cast<const __m256i*>(a)),
+            _mm256_load_si256(reinterpret_cast<const __m256i*>(b)));
+        for (size_t i = 32; i < USED_SIZE; i += 32)
+            diff = _mm256_or_si256(
+                diff, _mm256_xor_si256(
+                          _mm256_load_si256(reinterpret_cast<const __m256i*>(a + i)),
+                          _mm256_load_si256(reinterpret_cast<const __m256i*>(b + i))));
+        return _mm256_testz_si256(diff, diff);
+#else
+        uint64_t diff = 0;
+        for (size_t i = 0; i < USED_SIZE; i += sizeof(uint64_t)) {
+            uint64_t x, y;
+            std::memcpy(&x, a + i, sizeof(x));
+            std::memcpy(&y, b + i, sizeof(y));
+            diff |= x ^ y;
+        }
+        return diff == 0;
+#endif
+    }
+
+    bool operator!=(HeapFingerprint const& other) const noexcept {
+        return !(*this == other);
+    }
+
+};
+static_assert(sizeof(HeapFingerprint) == 128, "the fingerprint should fill two cache lines");
+
+class ShadowHeapData;
 
 struct TcacheMetaEntry {
     void* orig_ptr;
@@ -27,10 +142,68 @@ struct TcacheMetaEntry {
     void* next;
 };
 
+/// The snapshots of the calling thread: its tcache, which only the thread itself uses,
+/// and the fingerprint of its last operation. Kept in thread-local storage,
+/// so that no thread reads or writes the snapshots of another.
+/// All members are constant-initialized, so each thread starts with a zeroed copy.
+struct ThreadShadowData {
+    /// The fingerprint, which is read on every call, comes first.
+    HeapFingerprint fingerprint;
+    /// the snapshots of the arena that the fingerprint was stored for, nullptr if it is outdated
+    ShadowHeapData* fingerprinted = nullptr;
+
+    /// The tcache of the thread, nullptr if it has none or it can't be leaked.
+    /// Take care to cast the layout in 2.30+!
+    tcache_perthread_struct* perthread = nullptr;
+    /// glibc's `thread_arena` of the thread, nullptr if it wasn't found, see malloc_leak::leak_thread_arena()
+    AR_MAIN** glibc_arena = nullptr;
+    /// whether the arena and the tcache of the thread were looked for yet
+    bool discovered = false;
+    /// whether the tcache was stored after the last operation of the thread, see SHADOWHEAP_SAMPLE_RATE
+    bool sampled = true;
+    /// the state of the random schedule of the samples, 0 until it is seeded
+    uint64_t sampler = 0;
+
+    /// The counts and heads of the tcache bins when they were last stored, see tcache_dirty_bins().
+    union {
+        tcache_perthread_struct layout;
+        tcache_perthread_struct_2_30 layout_2_30;
+    } tcacheHeads = {};
+    bool tcacheHasData = false;
+    /// whether tcacheHeads holds all bins, i.e. all bins have been stored once
+    bool tcacheHeadsValid = false;
+
+#ifdef TCA_CHECK
+    alignas(64) TcacheMetaEntry tcache[TCACHE_ENTRIES][TCA_BIN_SIZE] = {};
+#else
+    TcacheMetaEntry** tcache = nullptr;
+#endif
+
+    tcache_perthread_struct& tcache_heads_for(tcache_perthread_struct*) noexcept {
+        return tcacheHeads.layout;
+    }
+
+    tcache_perthread_struct_2_30& tcache_heads_for(tcache_perthread_struct_2_30*) noexcept {
+        return tcacheHeads.layout_2_30;
+    }
+};
+
+/// The snapshots of the heap metadata of an arena.
+/// The copies of the lists, which are only read when the lists are walked, come last.
 class ShadowHeapData {
     bool isInitialized = false;
 
 public:
+    /// Held from the check before an operation on the arena until the store after it,
+    /// so that the snapshots only see whole operations. See ShadowHeapFacade::lock_arenas().
+    SpinLock lock;
+
+    /// Whether the top chunk and the unsorted bin were stored after the last operation on the arena,
+    /// so that they can be checked before the next one, see SHADOWHEAP_SAMPLE_RATE.
+    bool sampled = true;
+
+    /// The metadata of the chunks of the arena, guarded by its lock.
+    /// nullptr if the store is thread-safe, see ShadowHeapFacade::store_of().
     //#ifdef PTR_CHECK
     ConcreteMetaStore* store = nullptr;
     //#endif
@@ -39,19 +212,22 @@ public:
     size_t topchunksize = 0;
     //#endif
 
-#ifdef USB_CHECK
-    LINKED_LIST_META unsorted[USB_ENTRIES_MAX];
-#else
-    LINKED_LIST_META* unsorted = nullptr;
-#endif
     int unsorted_size = -1;
+#if defined(USB_CHECK) && defined(USB_INCREMENTAL)
+    UnsortedBinModel unsortedModel;
+#endif
+#ifdef FBN_CHECK
+    FastbinShadow fastbins;
+#endif
+#ifdef BIN_CHECK
+    SortedBinShadow sortedBins;
+#endif
 
-#ifdef TCA_CHECK
-    TcacheMetaEntry tcache[TCACHE_ENTRIES][TCA_BIN_SIZE];
+#ifdef USB_CHECK
+    alignas(64) LINKED_LIST_META unsorted[USB_ENTRIES_MAX];
 #else
-    TcacheMetaEntry** tcache = nullptr;
+    LINKED_LIST_META* unsorted = nullptr;
 #endif
-    bool tcacheHasData = false;
 
     ShadowHeapData() {
     }
@@ -59,10 +235,11 @@ public:
     ~ShadowHeapData() {
     }
 
-    void ensure_initialized(size_t capacity = 0) {
+    void ensure_initialized(size_t capacity = 0, const char* store_name = nullptr) {
         if (LIKELY(isInitialized)) return;
 #ifdef PTR_CHECK
         store = new ConcreteMetaStore{};
+        select_store(*store, store_name);
         if (capacity) store->reserve(capacity);
 #endif
         this->isInitialized = true;
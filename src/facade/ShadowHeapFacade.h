@@ -1,11 +1,17 @@
 #pragma once
 
+#include <atomic>
 #include <cstdlib>
+#include <mutex>
+#include <pthread.h>
 #include <signal.h>
+#include <type_traits>
 
 #include "../common/common.h"
 #include "../common/malloc_meta.h"
+#include "../common/spinlock.h"
 #include "../common/version.h"
+#include "../facade/ArenaShadows.h"
 #include "../facade/ShadowHeapData.h"
 #include "../leak/leak.h"
 #include "../tools/ModeReader.h"
@@ -15,21 +21,199 @@
     if (NOT_YET_INITIALIZED) return;
 
 // Prevent calls during facade initialization
-#define NOT_YET_INITIALIZED UNLIKELY(!this->isInitialized)
+#define NOT_YET_INITIALIZED UNLIKELY(!this->isInitialized.load(std::memory_order_acquire))
 
 // Static reference to facade for callbackHandler
 // void handlerCallback(int from, int to, void* ptr);
 
+/// The hooks look up the enabled mitigations in the modes on every call.
+struct RuntimeMitigations {
+    static bool ptr(ModeReader const& modes) noexcept {
+        return modes.ptrMode;
+    }
+    static bool top(ModeReader const& modes) noexcept {
+        return modes.topMode;
+    }
+    static bool usb(ModeReader const& modes) noexcept {
+        return modes.usbMode;
+    }
+    static bool tca(ModeReader const& modes) noexcept {
+        return modes.tcaMode;
+    }
+    static bool fbn(ModeReader const& modes) noexcept {
+        return modes.fbnMode;
+    }
+    static bool bin(ModeReader const& modes) noexcept {
+        return modes.binMode;
+    }
+    static bool tcache_2_30(bool running_under_2_30_or_later) noexcept {
+        return running_under_2_30_or_later;
+    }
+};
+
+/// The mitigations and the tcache layout are fixed at compile time,
+/// so that the hooks contain no checks of the modes at all.
+/// Mitigations that are not compiled in stay disabled.
+template <unsigned Mitigations, class TcacheLayout>
+struct StaticMitigations {
+    static_assert(is_valid_tcache_layout<TcacheLayout>(), "TcacheLayout must be valid tcache_perthread_struct");
 
+    static constexpr bool ptr(ModeReader const&) noexcept {
+        return use_ptr_check && (Mitigations & MITIGATION_PTR);
+    }
+    static constexpr bool top(ModeReader const&) noexcept {
+        return use_top_check && (Mitigations & MITIGATION_TOP);
+    }
+    static constexpr bool usb(ModeReader const&) noexcept {
+        return use_usb_check && (Mitigations & MITIGATION_USB);
+    }
+    static constexpr bool tca(ModeReader const&) noexcept {
+        return use_tca_check && (Mitigations & MITIGATION_TCA);
+    }
+    static constexpr bool fbn(ModeReader const&) noexcept {
+        return use_fbn_check && (Mitigations & MITIGATION_FBN);
+    }
+    static constexpr bool bin(ModeReader const&) noexcept {
+        return use_bin_check && (Mitigations & MITIGATION_BIN);
+    }
+    static constexpr bool tcache_2_30(bool) noexcept {
+        return std::is_same<TcacheLayout, tcache_perthread_struct_2_30>::value;
+    }
+};
+
+/// The specializations are numbered by the mitigations that the hooks use,
+/// plus a bit for the tcache layout of glibc 2.30 and later.
+/// The leak isn't part of it, because the hooks don't check it, so its bit is taken by the layout.
+static constexpr unsigned SPECIALIZATION_MITIGATIONS =
+    MITIGATION_PTR | MITIGATION_TOP | MITIGATION_USB | MITIGATION_TCA | MITIGATION_FBN | MITIGATION_BIN;
+static constexpr unsigned SPECIALIZATION_TCACHE_2_30 = MITIGATION_LEAK;
+static constexpr unsigned SPECIALIZATIONS = (SPECIALIZATION_MITIGATIONS | SPECIALIZATION_TCACHE_2_30) + 1;
+
+/// The mitigations that are compiled in, the others are the same as disabled.
+static constexpr unsigned COMPILED_MITIGATIONS = (use_ptr_check ? MITIGATION_PTR : 0) |
+    (use_top_check ? MITIGATION_TOP : 0) | (use_usb_check ? MITIGATION_USB : 0) |
+    (use_tca_check ? MITIGATION_TCA : 0) | (use_fbn_check ? MITIGATION_FBN : 0) |
+    (use_bin_check ? MITIGATION_BIN : 0);
+
+/// Map a specialization to the one with the same behaviour,
+/// so that e.g. the tcache layout only makes a difference with the tcache checks.
+constexpr unsigned canonical_specialization(unsigned index) {
+    return (index & COMPILED_MITIGATIONS & MITIGATION_TCA)
+               ? (index & (COMPILED_MITIGATIONS | SPECIALIZATION_TCACHE_2_30))
+               : (index & COMPILED_MITIGATIONS);
+}
+
+template <unsigned Index>
+using SpecializedMitigations = StaticMitigations<
+    Index & SPECIALIZATION_MITIGATIONS,
+    typename std::conditional<
+        (Index & SPECIALIZATION_TCACHE_2_30) != 0, tcache_perthread_struct_2_30,
+        tcache_perthread_struct>::type>;
+
+
+/// The state of the operation of a thread, from its pre hook to its post hook.
+/// Each thread has its own, see ShadowHeapFacade::operation().
+struct ThreadOperation {
+    /// The arena of the operation and the snapshots of its heap, see select_arena_of().
+    /// nullptr if the arena isn't known, then only the tcache and the pointers are checked.
+    ArenaShadows::Arena* current = nullptr;
+    /// The arenas whose locks the thread holds, in the order of the arena table,
+    /// see ShadowHeapFacade::lock_arenas(). realloc() frees into the arena of the chunk
+    /// and allocates from the arena of the thread, or from a third one if that was guessed wrong.
+    static constexpr size_t MAX_LOCKED = 3;
+    ArenaShadows::Arena* locked[MAX_LOCKED] = { nullptr, nullptr, nullptr };
+    /// The number of arenas at the start of the table whose locks the thread holds as well,
+    /// while glibc picks an arena for it, see ShadowHeapFacade::lock_all_arenas().
+    size_t all_locked = 0;
+    /// The tcache bin of the chunk in free_pre(), for free_post(),
+    /// because the chunk header can't be read anymore after the free.
+    size_t freed_tcache_bin = TCACHE_ENTRIES;
+    /// The fastbin of the chunk in free_pre(), for free_post().
+    size_t freed_fastbin = NFASTBINS;
+    /// internal_heap_operations in the pre hook, see store_tcache_bin().
+    unsigned long heap_operations = 0;
+    /// Whether the top chunk and unsorted bin, and the tcache, are checked before the operation,
+    /// see ShadowHeapFacade::begin_sample().
+    bool arena_sampled = true;
+    bool tcache_sampled = true;
+#if defined(USB_CHECK) && defined(USB_INCREMENTAL)
+    /// What the operation may do to the unsorted bin, for store_unsorted() after it.
+    UnsortedBinChanges unsorted_changes;
+#endif
+#ifdef BIN_CHECK
+    /// What the operation may do to the smallbins and largebins, for store_sorted_bins().
+    SortedBinChanges sorted_changes;
+#endif
+};
+
+/// The facade is shared by all threads. The snapshots of an arena are guarded by its lock,
+/// which a thread holds from the checks before an operation on the arena until the stores after it,
+/// like glibc holds the mutex of the arena during the operation itself.
+/// Threads on different arenas don't contend. Each arena has a metadata store of its own,
+/// which its lock guards too. The mmapped chunks share a store, which has a lock of its own.
+/// A thread-safe store is shared by all chunks instead and needs no lock.
+/// The tcache snapshots are thread-local.
 class ShadowHeapFacade {
-    bool isInitialized = false;
+    std::atomic<bool> isInitialized{ false };
+    /// the once-flag of ensure_initialized()
+    SpinLock initLock;
     bool running_under_2_30_or_later = false;
+    /// The metadata of the chunks that don't belong to a known arena,
+    /// or of all chunks if the store is thread-safe, see store_of().
+    ConcreteMetaStore* sharedStore = nullptr;
+    /// serializes the accesses to the shared store, unless it is thread-safe, see lock_store()
+    SpinLock storeLock;
+    /// the number of arenas that prepare_fork() locked
+    size_t forkLocked = 0;
+    /// the node pools that prepare_fork() locked, see details::lock_pools()
+    details::PoolLock* forkPools = nullptr;
+    /// The offset of glibc's `thread_arena` from the thread pointer, the same in every thread,
+    /// see malloc_leak::leak_thread_arena(). Only valid if threadArenaLeaked.
+    ptrdiff_t threadArenaOffset = 0;
+    bool threadArenaLeaked = false;
+
+    /// The facade whose locks are held across fork(), see prepare_fork().
+    static ShadowHeapFacade*& forking() noexcept {
+        static ShadowHeapFacade* facade = nullptr;
+        return facade;
+    }
+
+    /// Hold all locks of the facade across fork(), like glibc holds the mutexes of its arenas.
+    /// Otherwise the child inherits the locks that other threads held in the middle of an operation,
+    /// and its first operation on such an arena or the store spins forever.
+    /// The stores take their own locks and those of the node pools during their operations,
+    /// so they are locked last.
+    static void prepare_fork() noexcept {
+        auto facade = forking();
+        facade->forkLocked = facade->arenas.lock_table_and_all();
+        facade->storeLock.lock();
+        facade->for_each_locked_store([](ConcreteMetaStore& store) { store.lock_all(); });
+        facade->forkPools = details::lock_pools();
+    }
+
+    /// Release the locks of prepare_fork(), in the parent and in the child.
+    static void release_after_fork() noexcept {
+        auto facade = forking();
+        details::unlock_pools(facade->forkPools);
+        facade->for_each_locked_store([](ConcreteMetaStore& store) { store.unlock_all(); });
+        facade->storeLock.unlock();
+        facade->arenas.unlock_table_and_all(facade->forkLocked);
+    }
+
+    /// Call `fn` with the shared store and the store of each arena that prepare_fork() locked.
+    template <class F>
+    void for_each_locked_store(F&& fn) {
+        if (sharedStore) fn(*sharedStore);
+        for (size_t i = 0; i < forkLocked; i++)
+            if (auto store = arenas.at(i)->data->store) fn(*store);
+    }
 
 public:
     struct HookInfo info;
     struct ArenaLeak leak;
     ModeReader modes;
     ShadowHeapData data;
+    ArenaShadows arenas;
 
     ShadowHeapFacade() {
     }
@@ -37,16 +221,33 @@ public:
     ~ShadowHeapFacade() {
     }
 
+    /// The specialization for the modes in the environment `envp` and the running glibc,
+    /// see SpecializedMitigations. This doesn't need an initialized facade.
+    /// Returns SPECIALIZATIONS for an invalid environment, which ensure_initialized() reports.
+    static unsigned select_specialization(char const* const* envp) {
+        ModeReader modes;
+        const char* variable;
+        if (modes.read_environment(envp, variable)) return SPECIALIZATIONS;
+        unsigned index = modes.mitigations() & SPECIALIZATION_MITIGATIONS;
+        if (strncmp(gnu_get_libc_version(), "2.30", 4) >= 0) index |= SPECIALIZATION_TCACHE_2_30;
+        return canonical_specialization(index);
+    }
+
     void ensure_initialized() {
-        // only perform initialization once
-        if (LIKELY(isInitialized)) return;
+        // only perform initialization once, even if several threads get here at the same time
+        if (LIKELY(isInitialized.load(std::memory_order_acquire))) return;
+        std::lock_guard<SpinLock> once{ initLock };
+        if (isInitialized.load(std::memory_order_relaxed)) return;
 
         modes.ensure_initialized();
-        data.ensure_initialized(this->modes.initialStoreSize);
+        initialize_stores();
         leak.ensure_initialized();
-
-        running_under_2_30_or_later =
-            (strncmp(leak.info->version.version, "2.30", 4) >= 0);
+        initialize_arenas(leak.info);
+        if (auto glibc_arena = malloc_leak::leak_thread_arena(leak.info ? leak.info->arena : nullptr)) {
+            threadArenaOffset = (char*)glibc_arena - malloc_leak::thread_pointer();
+            threadArenaLeaked = true;
+            thread_data().glibc_arena = glibc_arena;
+        }
 
         // Read lib mode
         if (modes.leakMode) {
@@ -74,176 +275,901 @@ public:
         info("TOP Mode     : %d\n", this->modes.topMode);
         info("USB Mode     : %d\n", this->modes.usbMode);
         info("TCA Mode     : %d\n", this->modes.tcaMode);
+        info("FBN Mode     : %d\n", this->modes.fbnMode);
+        info("BIN Mode     : %d\n", this->modes.binMode);
         info("LEAK Mode    : %d\n", this->modes.leakMode);
         leak.print_arenainfo();
         info("----------------------------------\n");
-        isInitialized = true;
+        forking() = this;
+        pthread_atfork(prepare_fork, release_after_fork, release_after_fork);
+        isInitialized.store(true, std::memory_order_release);
+    }
+
+    /// Initialize the facade for the main arena `main_info`, which is known already,
+    /// e.g. a fake arena of the tests. Nothing is leaked and the locks aren't held across fork().
+    void initialize_with_arena(ARENA_INFO* main_info) {
+        std::lock_guard<SpinLock> once{ initLock };
+        if (isInitialized.load(std::memory_order_relaxed)) return;
+        modes.ensure_initialized();
+        initialize_stores();
+        initialize_arenas(main_info);
+        isInitialized.store(true, std::memory_order_release);
+    }
+
+private:
+    void initialize_stores() {
+        data.ensure_initialized(this->modes.initialStoreSize, this->modes.storeName);
+#ifdef PTR_CHECK
+        if (ConcreteMetaStore::is_thread_safe) {
+            // the arenas have no stores of their own, see store_of()
+            sharedStore = data.store;
+            data.store = nullptr;
+            return;
+        }
+        sharedStore = new ConcreteMetaStore{};
+        select_store_like(*sharedStore, *data.store);
+#endif
+    }
+
+    void initialize_arenas(ARENA_INFO* main_info) {
+        arenas.ensure_initialized(main_info, &data);
+        // the tcache of this thread was found by the leak and it uses the main arena,
+        // the other threads look for their arenas and tcaches on their first call
+        thread_data().perthread = main_info->tcache;
+        thread_data().discovered = true;
+
+        running_under_2_30_or_later =
+            (strncmp(main_info->version.version, "2.30", 4) >= 0);
+#ifdef FBN_CHECK
+        data.fastbins.use_safe_linking(strncmp(main_info->version.version, "2.32", 4) >= 0);
+#endif
+    }
+
+public:
+    /// The snapshots of the calling thread, see ThreadShadowData.
+    static ThreadShadowData& thread_data() noexcept {
+        static thread_local ThreadShadowData thread;
+        return thread;
+    }
+
+    /// Find the arena of the calling thread on its first call, and its tcache with TCA,
+    /// see malloc_leak::leak_tcache(). Until then, glibc may serve the thread from any arena:
+    /// its own, a reused one, or the main arena. So the first operation must not guess it.
+    /// The probe allocates and frees chunks in the arena of the thread,
+    /// so the snapshots of that arena are stored again afterwards.
+    template <class Policy>
+    __attribute__((noinline, cold)) void discover_thread() {
+        auto& thread = thread_data();
+        thread.discovered = true;
+        // the arena of the thread isn't known yet, so no other thread may be in the middle of an operation
+        size_t locked = arenas.lock_all();
+        if (Policy::tca(this->modes)) {
+            thread.perthread = malloc_leak::leak_tcache(leak.info->version, info);
+            info("TCA     (NEW ) Thread tcache at %p\n", thread.perthread);
+        }
+
+        // a chunk of the leak's size comes from the arena of the thread, or the tcache the leak filled
+        auto& op = operation();
+        auto checked = op.current;
+        if (auto probe = info.call_malloc_raw(TEST_SIZE_TCACHEMALLOC)) {
+            op.current = arenas.for_chunk(CHUNK_HEADER::from_memory(probe));
+            locked = arenas.lock_all(locked);
+            thread_arena() = op.current;
+            // glibc's thread_arena is only trusted if it points to the arena of the probe
+            auto glibc_arena = (AR_MAIN**)(malloc_leak::thread_pointer() + threadArenaOffset);
+            if (threadArenaLeaked && op.current && *glibc_arena == op.current->info->arena)
+                thread.glibc_arena = glibc_arena;
+            info.call_free_raw(probe);
+            expect_unsorted_anything();
+            expect_sorted_anything();
+            store_fastbins<Policy>(NFASTBINS, nullptr);
+            store_unsorted<Policy>();
+            store_sorted_bins<Policy>();
+            store_topchunk<Policy>();
+        }
+        op.current = checked;
+        arenas.unlock_all(locked);
+    }
+
+    /// Find the arena and tcache of the calling thread, if this is its first call.
+    template <class Policy>
+    void ensure_thread_discovered() {
+        if (UNLIKELY(!thread_data().discovered)) discover_thread<Policy>();
+    }
+
+    /// The arena that the calling thread allocated from last.
+    static ArenaShadows::Arena*& thread_arena() noexcept {
+        static thread_local ArenaShadows::Arena* arena = nullptr;
+        return arena;
+    }
+
+    /// The state of the operation of the calling thread, see ThreadOperation.
+    static ThreadOperation& operation() noexcept {
+        static thread_local ThreadOperation op;
+        return op;
+    }
+
+    /// The arena that the calling thread allocates from, as far as it is known:
+    /// glibc's `thread_arena` if it was found, otherwise the arena of its last allocation.
+    ArenaShadows::Arena* guess_thread_arena() noexcept {
+        auto glibc_arena = thread_data().glibc_arena;
+        if (LIKELY(glibc_arena && *glibc_arena))
+            if (auto arena = arenas.for_arena(*glibc_arena)) return arena;
+        auto arena = thread_arena();
+        return arena ? arena : arenas.main_arena();
+    }
+
+    /// Whether glibc picks an arena for the next allocation of the calling thread:
+    /// glibc's `thread_arena` is nullptr after the thread released its arena on exit.
+    bool thread_arena_unknown() noexcept {
+        auto glibc_arena = thread_data().glibc_arena;
+        return glibc_arena && UNLIKELY(*glibc_arena == nullptr);
+    }
+
+    /// Select the arena of the calling thread, for an allocation.
+    void select_thread_arena() noexcept {
+        auto& op = operation();
+        op.current = guess_thread_arena();
+        if (UNLIKELY(thread_arena_unknown())) return lock_all_arenas();
+        lock_arenas(op.current);
+    }
+
+    /// Hold the locks of all arenas until end_operation(), for an allocation from an arena
+    /// that glibc only picks during the call. Like in discover_thread(),
+    /// no other thread may be in the middle of an operation then. The locks the thread holds
+    /// are released first, so this MUST be called before the operation calls glibc.
+    void lock_all_arenas() noexcept {
+        unlock_arenas();
+        operation().all_locked = arenas.lock_all();
+    }
+
+    /// Select the arena that owns the chunk at `ptr`.
+    /// mmapped chunks don't belong to an arena, then the arena of the calling thread is selected.
+    void select_arena_of(void* ptr) {
+        auto chunk = CHUNK_HEADER::from_memory(ptr);
+        if (UNLIKELY(chunk->is_mmapped())) return select_thread_arena();
+        auto& op = operation();
+        op.current = arenas.for_chunk(chunk);
+        lock_arenas(op.current);
+    }
+
+    /// Select the arena of a chunk that was just allocated, and remember it for the calling thread.
+    /// If that is another arena than the one that was checked before, its changes are unknown.
+    /// Returns whether the arena stayed the same.
+    ///
+    /// The arena of the thread is known before the call from glibc's `thread_arena`,
+    /// and all arenas are locked while glibc picks one, see select_thread_arena().
+    /// glibc only allocates from another arena after the allocation from that one failed,
+    /// when the system is out of memory, and without a leaked `thread_arena`
+    /// after it moved the thread. Then the lock of the other arena is only taken here.
+    bool select_arena_of_allocation(void* ret) {
+        auto chunk = CHUNK_HEADER::from_memory(ret);
+        if (UNLIKELY(chunk->is_mmapped())) return true;
+        auto& op = operation();
+        auto checked = op.current;
+        op.current = arenas.for_chunk(chunk);
+        thread_arena() = op.current;
+        if (LIKELY(op.current == checked)) return true;
+        lock_arenas(op.current);
+        op.current->data->sampled = thread_data().sampled;
+        expect_unsorted_anything();
+        expect_sorted_anything();
+        return false;
+    }
+
+    /// Hold the locks of `first` and `second` (either may be nullptr) too, until end_operation().
+    /// The locks the thread holds already are kept, so no other thread sees the snapshots
+    /// of an arena between the changes of glibc and the stores after them.
+    /// Locks are taken in the order of the arena table, like ArenaShadows::lock_all() does,
+    /// so threads can't deadlock, see lock_arena().
+    void lock_arenas(ArenaShadows::Arena* first, ArenaShadows::Arena* second = nullptr) noexcept {
+        if (second && second < first) std::swap(first, second);
+        lock_arena(first);
+        lock_arena(second);
+    }
+
+    /// Hold the lock of `arena` too. If it comes before a lock the thread holds
+    /// and another thread holds it, the locks after it are released and taken again in order.
+    /// Those MUST only guard snapshots that are stored already, or that the operation didn't change:
+    /// the lock of a wrongly guessed arena, or any lock before the operation called glibc.
+    void lock_arena(ArenaShadows::Arena* arena) noexcept {
+        if (!arena) return;
+        auto& op = operation();
+        if (arena < arenas.at(0) + op.all_locked) return;
+        size_t held = 0, after = ThreadOperation::MAX_LOCKED;
+        for (; held < ThreadOperation::MAX_LOCKED && op.locked[held]; held++) {
+            if (op.locked[held] == arena) return;
+            if (op.locked[held] > arena && after == ThreadOperation::MAX_LOCKED) after = held;
+        }
+        if (UNLIKELY(held == ThreadOperation::MAX_LOCKED)) {
+            warn("ShadowHeap: an operation locks more than %zu arenas\n", held);
+            fflush(stderr);
+            abort();
+        }
+        if (LIKELY(after == ThreadOperation::MAX_LOCKED)) {
+            arena->data->lock.lock();
+            op.locked[held] = arena;
+            return;
+        }
+        if (!arena->data->lock.try_lock()) {
+            for (size_t i = after; i < held; i++)
+                op.locked[i]->data->lock.unlock();
+            arena->data->lock.lock();
+            for (size_t i = after; i < held; i++)
+                op.locked[i]->data->lock.lock();
+        }
+        for (size_t i = held; i > after; i--)
+            op.locked[i] = op.locked[i - 1];
+        op.locked[after] = arena;
+    }
+
+    void unlock_arenas() noexcept {
+        auto& op = operation();
+        for (auto& arena : op.locked) {
+            if (arena) arena->data->lock.unlock();
+            arena = nullptr;
+        }
+        arenas.unlock_all(op.all_locked);
+        op.all_locked = 0;
+    }
+
+    /// Whether the next operation of the calling thread is checked, see SHADOWHEAP_SAMPLE_RATE.
+    /// Each thread draws from a xorshift generator of its own, so the samples need no lock.
+    bool sample_next() noexcept {
+        auto rate = modes.sampleRate;
+        if (LIKELY(rate <= 1)) return true;
+        auto& state = thread_data().sampler;
+        if (UNLIKELY(state == 0)) state = ((uintptr_t)&state * 0x9E3779B97F4A7C15ull) | 1;
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state % rate == 0;
+    }
+
+    /// Decide before an operation which snapshots are checked:
+    /// only those that were stored after the last operation on them.
+    void begin_sample() noexcept {
+        auto& op = operation();
+        op.arena_sampled = op.current == nullptr || op.current->data->sampled;
+        op.tcache_sampled = thread_data().sampled;
+    }
+
+    /// Decide after an operation whether its snapshots are stored, before the stores.
+    /// They are only stored if the next operation checks them, so skipped operations cost no stores.
+    /// After a skipped operation, the changes to the unsorted bin are unknown.
+    void end_sample() {
+        bool next = sample_next();
+        auto& op = operation();
+        if (op.current) {
+            if (!op.arena_sampled) expect_unsorted_anything();
+            op.current->data->sampled = next;
+        }
+        thread_data().sampled = next;
+    }
+
+    /// End the operation of the calling thread, after its post hook: release the locks of its arenas.
+    void end_operation() noexcept {
+        unlock_arenas();
+    }
+
+    /// Lock the shared metadata store, unless it is thread-safe itself.
+    std::unique_lock<SpinLock> lock_store() noexcept {
+        if (ConcreteMetaStore::is_thread_safe) return std::unique_lock<SpinLock>{};
+        return std::unique_lock<SpinLock>{ storeLock };
+    }
+
+    /// The metadata store of `chunk`: the store of its arena, whose lock the operation holds already
+    /// or takes here, see lock_arena(). mmapped chunks, and the chunks of the arenas beyond MAX_ARENAS,
+    /// are in the shared store, which `guard` locks then. A thread-safe store is shared by all chunks,
+    /// since locking it by arena would only serialize the threads that its own locks keep apart.
+    ConcreteMetaStore* store_of(CHUNK_HEADER* chunk, std::unique_lock<SpinLock>& guard) {
+        if (!ConcreteMetaStore::is_thread_safe && LIKELY(!chunk->is_mmapped())) {
+            if (auto arena = arenas.for_chunk(chunk)) {
+                lock_arena(arena);
+                return arena->data->store;
+            }
+        }
+        guard = lock_store();
+        return sharedStore;
+    }
+
+    /// Call `fn` with the tcache of the calling thread, in the layout of the running glibc.
+    template <class Policy, class F>
+    void with_tcache(F&& fn) {
+        auto tcache = thread_data().perthread;
+        if (LIKELY(!Policy::tcache_2_30(running_under_2_30_or_later)))
+            fn(tcache);
+        else
+            fn((tcache_perthread_struct_2_30*)tcache);
+    }
+
+    /// The fingerprint of the current heap, for the enabled mitigations. See HeapFingerprint.
+    template <class Policy>
+    HeapFingerprint current_fingerprint() {
+        HeapFingerprint fingerprint;
+        auto current = operation().current;
+        if (Policy::top(this->modes)) fingerprint.topchunksize = (*current->info->topchunk)->size;
+        if (Policy::usb(this->modes)) {
+            auto bin = (CHUNKPTR*)CHUNK_HEADER::from_memory(current->info->unsorted_bin);
+            fingerprint.unsorted_head = bin->fd;
+            fingerprint.unsorted_tail = bin->bk;
+        }
+        if (Policy::tca(this->modes) && thread_data().perthread != nullptr)
+            with_tcache<Policy>([&](auto* tcache) { fingerprint.set_tcache_counts(*tcache); });
+        return fingerprint;
+    }
+
+    /// Store the fingerprint after an operation, once all snapshots are stored.
+    template <class Policy = RuntimeMitigations>
+    void store_fingerprint() {
+#ifdef FINGERPRINT
+        if (UNLIKELY(!isInitialized)) return;
+        auto current = operation().current;
+        if (UNLIKELY(current == nullptr)) return;
+        auto& thread = thread_data();
+        if (UNLIKELY(!thread.sampled || !current->data->sampled)) {
+            thread.fingerprinted = nullptr;
+            return;
+        }
+        thread.fingerprint = current_fingerprint<Policy>();
+        thread.fingerprinted = current->data;
+#endif
+    }
+
+    /// Check the heap before an operation on chunks of the given tcache bin.
+    ///
+    /// With FINGERPRINT, the fingerprint is compared first. If it is unchanged,
+    /// the top chunk and the counts of all tcache bins are known to be intact,
+    /// and only the tcache bin of the operation is walked, like with TCA_INCREMENTAL.
+    /// Otherwise all checks run, and report what was corrupted.
+    template <class Policy = RuntimeMitigations>
+    void check_heap(size_t tidx) {
+#ifdef FINGERPRINT
+        auto& thread = thread_data();
+        auto current = operation().current;
+        auto snapshots = current ? current->data : nullptr;
+        bool sampled = operation().arena_sampled && operation().tcache_sampled;
+        if (LIKELY(snapshots == thread.fingerprinted) && LIKELY(snapshots != nullptr) && LIKELY(sampled) &&
+            LIKELY(current_fingerprint<Policy>() == thread.fingerprint)) {
+            thread.fingerprinted = nullptr;
+            check_unsorted<Policy>();
+#ifdef TCA_CHECK
+            with_tcache<Policy>([this, tidx](auto* tcache) { _check_tcache_bin_impl<Policy>(tcache, tidx); });
+#endif
+            return;
+        }
+        thread.fingerprinted = nullptr;
+#endif
+        check_topchunk<Policy>();
+        check_unsorted<Policy>();
+        check_tcache_bin<Policy>(tidx);
+    }
+
+    /// Check the fastbins before an operation on fastbin `fidx`, see FastbinShadow::verify().
+    /// This costs the same however many chunks the fastbins hold.
+    template <class Policy = RuntimeMitigations>
+    void check_fastbins(size_t fidx) {
+#ifdef FBN_CHECK
+        if (UNLIKELY(!isInitialized)) return;
+        auto current = operation().current;
+        if (UNLIKELY(current == nullptr)) return;
+        if (!Policy::fbn(this->modes)) return;
+
+        auto fastbins = current->info->fastbins;
+        auto corrupted = current->data->fastbins.verify(fastbins, fidx);
+        if (UNLIKELY(corrupted != NFASTBINS)) fastbin_corrupted(fastbins[corrupted], "head or fd changed");
+#endif
+    }
+
+    /// Store the fastbins after an operation on fastbin `fidx`, which freed the chunk `freed`.
+    /// Only a push or pop of that fastbin is followed, anything else walks the changed fastbins.
+    template <class Policy = RuntimeMitigations>
+    void store_fastbins(size_t fidx, CHUNKPTR* freed) {
+#ifdef FBN_CHECK
+        if (UNLIKELY(!isInitialized)) return;
+        auto current = operation().current;
+        if (UNLIKELY(current == nullptr)) return;
+        if (!Policy::fbn(this->modes)) return;
+
+        if (auto chunk = current->data->fastbins.update(current->info->fastbins, fidx, freed))
+            fastbin_corrupted(chunk, "chunk is linked twice or wasn't pushed or popped");
+        info("FBIN    (STR ) Stored fastbin %zu\n", fidx);
+#endif
+    }
+
+    void fastbin_corrupted(CHUNKPTR* chunk, const char* reason) __attribute__((noinline, cold)) {
+        warn("FBIN    (CHK ) Chunk %p: %s\n", chunk, reason);
+        warn("fastbin corrupted: (%p) failed\n", chunk);
+        fflush(stderr);
+        raise(SIGILL);
     }
 
+    template <class Policy = RuntimeMitigations>
     void store_tcache() {
 #ifdef TCA_CHECK
-        if (LIKELY(!running_under_2_30_or_later))
-            _store_tcache_impl(leak.info->tcache);
-        else
-            _store_tcache_impl((tcache_perthread_struct_2_30*)leak.info->tcache);
+        if (UNLIKELY(!thread_data().sampled)) return;
+        with_tcache<Policy>([this](auto* tcache) { _store_tcache_impl<Policy>(tcache); });
 #endif
     }
 
-    template <class TcacheLayout>
+    /// Store the tcache after an operation on chunks of the given size.
+    /// With TCA_INCREMENTAL only the bin of that size is stored, otherwise all bins.
+    /// The metadata store may allocate during the operation, which can change any bin,
+    /// then the changed bins are stored, see _store_tcache_impl().
+    template <class Policy = RuntimeMitigations>
+    void store_tcache_bin(size_t tidx) {
+#if defined(TCA_CHECK) && defined(TCA_INCREMENTAL)
+        if (UNLIKELY(!thread_data().sampled)) return;
+        // the other bins weren't stored after a skipped operation either
+        if (UNLIKELY(!operation().tcache_sampled)) return store_tcache<Policy>();
+        if (UNLIKELY(internal_heap_operations != operation().heap_operations)) return store_tcache<Policy>();
+        with_tcache<Policy>([this, tidx](auto* tcache) { _store_tcache_bin_impl<Policy>(tcache, tidx); });
+#else
+        store_tcache<Policy>();
+#endif
+    }
+
+    template <class Policy, class TcacheLayout>
     void _store_tcache_impl(TcacheLayout* tcache) {
         static_assert(is_valid_tcache_layout<TcacheLayout>(), "TcacheLayout must be valid tcache_perthread_struct");
         if (UNLIKELY(!isInitialized)) return;
-        if (LIKELY(!this->modes.tcaMode)) return;
+        if (LIKELY(!Policy::tca(this->modes))) return;
 
         // Use leaked bin
         if (UNLIKELY(tcache == nullptr)) return;
+        auto& thread = thread_data();
 
-        // Iterate entries in tcache struct
-        for (int i = 0; i < TCACHE_ENTRIES; i++) {
-            struct tcache_entry* entry = tcache->entries[i];
-            if (UNLIKELY(entry == nullptr)) continue;
-            if (UNLIKELY(tcache->counts[i] <= 0)) continue;
+        // The tcache only pushes and pops at the head of a bin,
+        // so only the bins whose count or head changed need to be walked again.
+        uint64_t dirty = ~uint64_t(0);
+        if (LIKELY(thread.tcacheHeadsValid)) dirty = tcache_dirty_bins(*tcache, thread.tcache_heads_for(tcache));
 
-            // Iterate elements in bin
-            info("TCA     (STR ) %p (%d) => %d element(s): ", tcache, i, tcache->counts[i]);
-            for (int b = 0; b < TCA_BIN_SIZE; b++) {
+        for (; dirty; dirty &= dirty - 1)
+            _store_tcache_bin(tcache, __builtin_ctzll(dirty));
 
-                // Store metadata from hdr into bucket
-                // Store related ptr in bucket->bk field which is unused at that time
-                CHUNK_HEADER* hdr = CHUNK_HEADER::from_memory(entry);
-                TcacheMetaEntry* bucket = &data.tcache[i][b];
+        // the skipped bins still hold the data of their last store
+        thread.tcacheHasData = true;
+        thread.tcacheHeadsValid = true;
+    }
 
-                // Copy the data but skip prev_size field because it might be not valid
-                bucket->orig_ptr = entry;
-                bucket->size = hdr->chunksize();
-                bucket->next = hdr->fd;
+    template <class Policy, class TcacheLayout>
+    void _store_tcache_bin_impl(TcacheLayout* tcache, size_t tidx) {
+        static_assert(is_valid_tcache_layout<TcacheLayout>(), "TcacheLayout must be valid tcache_perthread_struct");
+        if (UNLIKELY(!isInitialized)) return;
+        if (LIKELY(!Policy::tca(this->modes))) return;
+        if (UNLIKELY(tcache == nullptr)) return;
+        auto& thread = thread_data();
+
+        // The other bins keep their snapshot, since only this bin could have changed.
+        // But the bins that were filled before the first snapshot must be stored once.
+        if (UNLIKELY(!thread.tcacheHasData)) {
+            _store_tcache_impl<Policy>(tcache);
+            thread.tcacheHasData = true;
+            return;
+        }
 
-                data.tcacheHasData = true;
-                info("%p", entry);
+        if (tidx >= TCACHE_ENTRIES) return;
+        _store_tcache_bin(tcache, tidx);
+    }
 
-                if (LIKELY(entry->next != nullptr)) {
-                    entry = entry->next;
-                    info(", ");
-                } else {
-                    info("\n");
-                    break;
-                }
+    template <class TcacheLayout>
+    void _store_tcache_bin(TcacheLayout* tcache, int i) {
+        auto& thread = thread_data();
+        auto& heads = thread.tcache_heads_for(tcache);
+        heads.counts[i] = tcache->counts[i];
+        heads.entries[i] = tcache->entries[i];
+
+        struct tcache_entry* entry = tcache->entries[i];
+        if (UNLIKELY(entry == nullptr)) return;
+        if (UNLIKELY(tcache->counts[i] <= 0)) return;
+
+        // Iterate elements in bin
+        info("TCA     (STR ) %p (%d) => %d element(s): ", tcache, i, tcache->counts[i]);
+        for (int b = 0; b < TCA_BIN_SIZE; b++) {
+
+            // Store metadata from hdr into bucket
+            // Store related ptr in bucket->bk field which is unused at that time
+            CHUNK_HEADER* hdr = CHUNK_HEADER::from_memory(entry);
+            TcacheMetaEntry* bucket = &thread.tcache[i][b];
+
+            // Copy the data but skip prev_size field because it might be not valid
+            bucket->orig_ptr = entry;
+            bucket->size = hdr->chunksize();
+            bucket->next = hdr->fd;
+
+            thread.tcacheHasData = true;
+            info("%p", entry);
+
+            if (LIKELY(entry->next != nullptr)) {
+                entry = entry->next;
+                info(", ");
+            } else {
+                info("\n");
+                break;
             }
         }
     }
 
+    template <class Policy = RuntimeMitigations>
     void check_tcache() {
 #ifdef TCA_CHECK
-        if (LIKELY(!running_under_2_30_or_later))
-            _check_tcache_impl(leak.info->tcache);
-        else
-            _check_tcache_impl((tcache_perthread_struct_2_30*)leak.info->tcache);
+        if (UNLIKELY(!operation().tcache_sampled)) return;
+        with_tcache<Policy>([this](auto* tcache) { _check_tcache_impl<Policy>(tcache); });
 #endif
     }
 
-    template <class TcacheLayout>
+    /// Check the tcache before an operation on chunks of the given size.
+    /// With TCA_INCREMENTAL only the bin of that size is checked, otherwise all bins.
+    template <class Policy = RuntimeMitigations>
+    void check_tcache_bin(size_t tidx) {
+#if defined(TCA_CHECK) && defined(TCA_INCREMENTAL)
+        if (UNLIKELY(!operation().tcache_sampled)) return;
+        with_tcache<Policy>([this, tidx](auto* tcache) { _check_tcache_bin_impl<Policy>(tcache, tidx); });
+#else
+        check_tcache<Policy>();
+#endif
+    }
+
+    template <class Policy, class TcacheLayout>
     void _check_tcache_impl(TcacheLayout* tcache) {
         static_assert(is_valid_tcache_layout<TcacheLayout>(), "TcacheLayout must be valid tcache_perthread_struct");
 
         if (UNLIKELY(!isInitialized)) return;
-        if (LIKELY(!this->modes.tcaMode)) return;
-        if (UNLIKELY(!data.tcacheHasData)) return;
+        if (LIKELY(!Policy::tca(this->modes))) return;
+        auto& thread = thread_data();
+        if (UNLIKELY(!thread.tcacheHasData)) return;
 
         // Use leaked bin
         if (UNLIKELY(tcache == nullptr)) return;
 
-        // Iterate entries in tcache struct
-        for (int i = 0; i < TCACHE_ENTRIES; i++) {
-            struct tcache_entry* entryList = tcache->entries[i];
-            // TODO: Reconsider usage of tcache->counts because it might be manipulated
-            if (UNLIKELY(entryList == nullptr)) continue;
-            if (UNLIKELY(tcache->counts[i] <= 0)) continue;
-
-            // Iterate elements in bin
-            info(
-                "TCA     (CHK ) %p (%d) => %d element(s): \n", tcache, i,
-                tcache->counts[i]);
-            for (int b = 0; b < TCA_BIN_SIZE; b++) {
-
-                // Validate metadata in hdr by using data from bucket
-                // Individual checks for each field
-                // If validation fails abort
-                CHUNK_HEADER* hdr = CHUNK_HEADER::from_memory(entryList);
-                TcacheMetaEntry* bucket = &data.tcache[i][b];
-
-                // the prevsize belongs to the previous chunk and can therefore not be checked here
-                // bool psizeValid = (bucket->prev_size == hdr->prev_size) ? true : false;
-                if (UNLIKELY(bucket->next != hdr->fd)) {
-                    warn("TCA     (CHK ) tcache_bin corrupted: (%p) fd-field not valid\n", entryList);
-                    fflush(stderr);
-                    raise(SIGILL);
-                }
-                if (UNLIKELY(bucket->orig_ptr != (void*)entryList)) {
-                    warn("TCA     (CHK ) tcache_bin corrupted: (%p) bk-field not valid\n", entryList);
-                    fflush(stderr);
-                    raise(SIGILL);
-                }
-                if (UNLIKELY(bucket->size != hdr->chunksize())) {
-                    warn("TCA     (CHK ) tcache_bin corrupted: (%p) size-field not valid\n", entryList);
-                    fflush(stderr);
-                    raise(SIGILL);
-                }
-
-                /*
-                  info("TCA     (CHK ) Successfully checked %p\n", entryList);
-                */
-
-                if (LIKELY(entryList->next != nullptr)) {
-                    entryList = entryList->next;
-                } else {
-                    break;
-                }
-            }
+        // The tcache doesn't change between the store after one call and the check before the next,
+        // so a changed count or head means that the tcache_perthread_struct was overwritten.
+        if (LIKELY(thread.tcacheHeadsValid)) {
+            if (auto dirty = tcache_dirty_bins(*tcache, thread.tcache_heads_for(tcache)))
+                tcache_heads_corrupted(__builtin_ctzll(dirty));
         }
 
+        // But equal heads say nothing about the rest of a bin:
+        // the next pointer of a chunk in the tcache can be overwritten after the chunk was freed.
+        // So the bins are still walked.
+        for (int i = 0; i < TCACHE_ENTRIES; i++)
+            _check_tcache_bin(tcache, i);
+
         // TODO: Check if necessary that memory is zeroed out
         //  CHUNK_HEADER tcache[TCA_ENTRIES_MAX][TCA_BIN_SIZE]
         // int storageSize = sizeof(CHUNK_HEADER) * TCA_ENTRIES_MAX *
-        // TCA_BIN_SIZE; memset(data.tcache, '\0', storageSize );
-        data.tcacheHasData = false;
+        // TCA_BIN_SIZE; memset(thread.tcache, '\0', storageSize );
+        thread.tcacheHasData = false;
     }
 
+    template <class Policy, class TcacheLayout>
+    void _check_tcache_bin_impl(TcacheLayout* tcache, size_t tidx) {
+        static_assert(is_valid_tcache_layout<TcacheLayout>(), "TcacheLayout must be valid tcache_perthread_struct");
+
+        if (UNLIKELY(!isInitialized)) return;
+        if (LIKELY(!Policy::tca(this->modes))) return;
+        auto& thread = thread_data();
+        if (UNLIKELY(!thread.tcacheHasData)) return;
+        if (UNLIKELY(tcache == nullptr)) return;
+
+        // Sizes above the tcache maximum don't touch the tcache at all.
+        // The snapshot stays valid, unlike after a check of all bins.
+        if (tidx >= TCACHE_ENTRIES) return;
+
+        auto& heads = thread.tcache_heads_for(tcache);
+        if (UNLIKELY(heads.counts[tidx] != tcache->counts[tidx] || heads.entries[tidx] != tcache->entries[tidx]))
+            tcache_heads_corrupted(tidx);
+        _check_tcache_bin(tcache, tidx);
+    }
+
+    void tcache_heads_corrupted(int i) __attribute__((noinline, cold)) {
+        warn("TCA     (CHK ) tcache corrupted: count or head of bin %d changed\n", i);
+        fflush(stderr);
+        raise(SIGILL);
+    }
+
+    template <class TcacheLayout>
+    void _check_tcache_bin(TcacheLayout* tcache, int i) {
+        auto& thread = thread_data();
+        struct tcache_entry* entryList = tcache->entries[i];
+        // TODO: Reconsider usage of tcache->counts because it might be manipulated
+        if (UNLIKELY(entryList == nullptr)) return;
+        if (UNLIKELY(tcache->counts[i] <= 0)) return;
+
+        // Iterate elements in bin
+        info(
+            "TCA     (CHK ) %p (%d) => %d element(s): \n", tcache, i,
+            tcache->counts[i]);
+        for (int b = 0; b < TCA_BIN_SIZE; b++) {
+
+            // Validate metadata in hdr by using data from bucket
+            // Individual checks for each field
+            // If validation fails abort
+            CHUNK_HEADER* hdr = CHUNK_HEADER::from_memory(entryList);
+            TcacheMetaEntry* bucket = &thread.tcache[i][b];
+
+            // the prevsize belongs to the previous chunk and can therefore not be checked here
+            // bool psizeValid = (bucket->prev_size == hdr->prev_size) ? true : false;
+            if (UNLIKELY(bucket->next != hdr->fd)) {
+                warn("TCA     (CHK ) tcache_bin corrupted: (%p) fd-field not valid\n", entryList);
+                fflush(stderr);
+                raise(SIGILL);
+            }
+            if (UNLIKELY(bucket->orig_ptr != (void*)entryList)) {
+                warn("TCA     (CHK ) tcache_bin corrupted: (%p) bk-field not valid\n", entryList);
+                fflush(stderr);
+                raise(SIGILL);
+            }
+            if (UNLIKELY(bucket->size != hdr->chunksize())) {
+                warn("TCA     (CHK ) tcache_bin corrupted: (%p) size-field not valid\n", entryList);
+                fflush(stderr);
+                raise(SIGILL);
+            }
+
+            /*
+              info("TCA     (CHK ) Successfully checked %p\n", entryList);
+            */
+
+            if (LIKELY(entryList->next != nullptr)) {
+                entryList = entryList->next;
+            } else {
+                break;
+            }
+        }
+    }
+
+    template <class Policy = RuntimeMitigations>
     void store_unsorted() {
 #ifdef USB_CHECK
-        _store_unsorted_impl();
+        auto current = operation().current;
+        if (UNLIKELY(current && !current->data->sampled)) return;
+#endif
+#if defined(USB_CHECK) && defined(USB_INCREMENTAL)
+        _store_unsorted_model<Policy>();
+#elif defined(USB_CHECK)
+        _store_unsorted_impl<Policy>();
 #endif
     }
 
+    /// The header of the unsorted bin in the arena, whose fd and bk are the head and tail of the list.
+    CHUNK_HEADER* unsorted_bin_header() {
+        auto current = operation().current;
+        return CHUNK_HEADER::from_memory(current->info->unsorted_bin);
+    }
+
+    /// Note that the next operation is a malloc() or calloc() of `len` bytes,
+    /// which only touches the fastbin of its size. See UnsortedBinModel.
+    template <class Policy = RuntimeMitigations>
+    void expect_unsorted_request(size_t len) {
+#if defined(USB_CHECK) && defined(USB_INCREMENTAL)
+        if (!Policy::usb(this->modes)) return;
+        auto& unsorted_changes = operation().unsorted_changes;
+        unsorted_changes = UnsortedBinChanges{};
+        unsorted_changes.known = true;
+        unsorted_changes.fastbin = csize2fidx(request2size(len));
+#endif
+    }
+
+    /// Note that the next operation frees `ptr`,
+    /// which consolidates the chunk with its free neighbours in the selected arena.
+    template <class Policy = RuntimeMitigations>
+    void expect_unsorted_free(void* ptr) {
+#if defined(USB_CHECK) && defined(USB_INCREMENTAL)
+        if (!Policy::usb(this->modes)) return;
+        auto chunk = CHUNK_HEADER::from_memory(ptr);
+        auto& unsorted_changes = operation().unsorted_changes;
+        unsorted_changes = UnsortedBinChanges{};
+        unsorted_changes.known = true;
+        unsorted_changes.fastbin = csize2fidx(chunk->chunksize());
+        // mmapped chunks have no neighbours
+        if (chunk->is_mmapped() || operation().current == nullptr) return;
+
+        unsorted_changes.freed = chunk;
+        unsorted_changes.freed_size = chunk->chunksize();
+        free_neighbours(chunk, unsorted_changes.prev, unsorted_changes.next);
+        if (unsorted_changes.prev) unsorted_changes.prev_size = unsorted_changes.prev->chunksize();
+        if (unsorted_changes.next) unsorted_changes.next_size = unsorted_changes.next->chunksize();
+#endif
+    }
+
+    /// The free neighbours of a chunk in the selected arena, which free() consolidates with it,
+    /// or nullptr. The top chunk isn't in any bin, so it doesn't count.
+    void free_neighbours(CHUNK_HEADER* chunk, CHUNK_HEADER*& prev, CHUNK_HEADER*& next) {
+        prev = chunk->is_prev_inuse() ? nullptr : chunk->prev_chunk();
+        next = chunk->next_chunk();
+        auto current = operation().current;
+        if ((CHUNKPTR*)next == *current->info->topchunk || next->next_chunk()->is_prev_inuse())
+            next = nullptr;
+    }
+
+    /// Note that the next operation may change the unsorted bin in any way.
+    void expect_unsorted_anything() {
+#if defined(USB_CHECK) && defined(USB_INCREMENTAL)
+        auto& unsorted_changes = operation().unsorted_changes;
+        unsorted_changes = UnsortedBinChanges{};
+#endif
+    }
+
+    /// Note that the next operation is a malloc() or calloc() of `len` bytes,
+    /// which may take a best fit out of the middle of a largebin. See SortedBinShadow.
+    template <class Policy = RuntimeMitigations>
+    void expect_sorted_request(size_t len) {
+#ifdef BIN_CHECK
+        if (!Policy::bin(this->modes)) return;
+        auto chunksize = request2size(len);
+        auto& sorted_changes = operation().sorted_changes;
+        sorted_changes = SortedBinChanges{};
+        sorted_changes.known = true;
+        sorted_changes.fastbin = csize2fidx(chunksize);
+        if (chunksize >= MIN_LARGE_SIZE) sorted_changes.best_fit = csize2bidx(chunksize);
+#endif
+    }
+
+    /// Note that the next operation frees `ptr`, which unlinks its free neighbours from their bins.
+    template <class Policy = RuntimeMitigations>
+    void expect_sorted_free(void* ptr) {
+#ifdef BIN_CHECK
+        if (!Policy::bin(this->modes)) return;
+        auto chunk = CHUNK_HEADER::from_memory(ptr);
+        auto& sorted_changes = operation().sorted_changes;
+        sorted_changes = SortedBinChanges{};
+        sorted_changes.known = true;
+        sorted_changes.fastbin = csize2fidx(chunk->chunksize());
+        if (chunk->is_mmapped() || operation().current == nullptr) return;
+
+        CHUNK_HEADER* prev;
+        CHUNK_HEADER* next;
+        free_neighbours(chunk, prev, next);
+        if (prev) sorted_changes.neighbours[0] = csize2bidx(prev->chunksize());
+        if (next) sorted_changes.neighbours[1] = csize2bidx(next->chunksize());
+#endif
+    }
+
+    /// Note that the next operation may change the smallbins and largebins in any way.
+    void expect_sorted_anything() {
+#ifdef BIN_CHECK
+        auto& sorted_changes = operation().sorted_changes;
+        sorted_changes = SortedBinChanges{};
+#endif
+    }
+
+    /// Store the ends of the smallbins and largebins that the operation changed.
+    template <class Policy = RuntimeMitigations>
+    void store_sorted_bins() {
+#ifdef BIN_CHECK
+        if (UNLIKELY(!isInitialized)) return;
+        auto current = operation().current;
+        if (UNLIKELY(current == nullptr)) return;
+        if (!Policy::bin(this->modes)) return;
+
+        auto& sorted_changes = operation().sorted_changes;
+        auto changes = sorted_changes;
+        sorted_changes = SortedBinChanges{};
+        current->data->sortedBins.update(
+            current->info->bins, current->info->binmap, current->info->fastbins,
+            internal_heap_operations, changes);
+        info("BINS    (STR ) Stored the smallbins and largebins\n");
+#endif
+    }
+
+    /// Check the binmap, the ends of the bins that changed and of bin `bidx`,
+    /// and a few more chunks of a sweep over the bins. See SortedBinShadow::verify().
+    template <class Policy = RuntimeMitigations>
+    void check_sorted_bins(size_t bidx) {
+#ifdef BIN_CHECK
+        if (UNLIKELY(!isInitialized)) return;
+        auto current = operation().current;
+        if (UNLIKELY(current == nullptr)) return;
+        if (!Policy::bin(this->modes)) return;
+
+        auto& bins = current->data->sortedBins;
+        if (auto chunk = bins.verify(current->info->bins, current->info->binmap, bidx, BIN_SWEEP_BUDGET))
+            sorted_bin_corrupted(chunk);
+#endif
+    }
+
+    void sorted_bin_corrupted(CHUNK_HEADER* chunk) __attribute__((noinline, cold)) {
+        warn("BINS    (CHK ) Chunk %p: invalid metadata\n", chunk);
+        warn("BINS    (CHK ) actual.fd=%p actual.bk=%p\n", chunk->fd, chunk->bk);
+        warn("smallbin or largebin corrupted: (%p) failed\n", chunk);
+        fflush(stderr);
+        raise(SIGILL);
+    }
+
+    template <class Policy>
+    void _store_unsorted_model() {
+#if defined(USB_CHECK) && defined(USB_INCREMENTAL)
+        if (UNLIKELY(!isInitialized)) return;
+        auto current = operation().current;
+        if (UNLIKELY(current == nullptr)) return;
+        if (!Policy::usb(this->modes)) return;
+
+        auto bin = unsorted_bin_header();
+        auto& model = current->data->unsortedModel;
+        auto& unsorted_changes = operation().unsorted_changes;
+        auto changes = unsorted_changes;
+        unsorted_changes = UnsortedBinChanges{};
+        if (LIKELY(model.update(bin, current->info->fastbins, internal_heap_operations, changes))) {
+            info("USRT    (STR ) Updated the unsorted_bin model (%zu chunks)\n", model.size());
+            return;
+        }
+        if (auto chunk = model.rebuild(bin, current->info->fastbins, internal_heap_operations))
+            unsorted_model_corrupted(chunk, "chunk is linked twice");
+        info("USRT    (STR ) Stored the unsorted_bin model (%zu chunks)\n", model.size());
+#endif
+    }
+
+    template <class Policy>
     void _store_unsorted_impl() {
         if (UNLIKELY(!isInitialized)) return;
-        if (!this->modes.usbMode) return;
+        auto current = operation().current;
+        if (UNLIKELY(current == nullptr)) return;
+        if (!Policy::usb(this->modes)) return;
 
-        data.unsorted_size = 0;
-        auto unsorted_start = (CHUNK_HEADER*)*this->leak.info->unsorted_bin;
+        current->data->unsorted_size = 0;
+        auto unsorted_start = (CHUNK_HEADER*)*current->info->unsorted_bin;
         auto single = unsorted_start;
         while (true) {
-            data.unsorted[data.unsorted_size++] =
+            current->data->unsorted[current->data->unsorted_size++] =
                 LINKED_LIST_META::from_chunk_header(*single);
-            info("USRT    (STR ) Stored unsorted_bin[%d] (%p)\n", data.unsorted_size - 1, single);
+            info("USRT    (STR ) Stored unsorted_bin[%d] (%p)\n", current->data->unsorted_size - 1, single);
             if (UNLIKELY(single->fd == unsorted_start)) break;
-            if (UNLIKELY(data.unsorted_size >= USB_ENTRIES_MAX)) break;
+            if (UNLIKELY(current->data->unsorted_size >= USB_ENTRIES_MAX)) break;
             single = single->fd;
         }
     }
 
+    template <class Policy = RuntimeMitigations>
     void check_unsorted() {
 #ifdef USB_CHECK
-        _check_unsorted_impl();
+        if (UNLIKELY(!operation().arena_sampled)) return;
+#endif
+#if defined(USB_CHECK) && defined(USB_INCREMENTAL)
+        _check_unsorted_model<Policy>();
+#elif defined(USB_CHECK)
+        _check_unsorted_impl<Policy>();
+#endif
+    }
+
+    /// Check the head and tail of the unsorted bin, and a few more chunks of a sweep over the list,
+    /// so that the cost doesn't depend on the length of the list. See UnsortedBinModel::verify().
+    template <class Policy>
+    void _check_unsorted_model() {
+#if defined(USB_CHECK) && defined(USB_INCREMENTAL)
+        if (UNLIKELY(!isInitialized)) return;
+        auto current = operation().current;
+        if (UNLIKELY(current == nullptr)) return;
+        if (!Policy::usb(this->modes)) return;
+
+        if (auto chunk = current->data->unsortedModel.verify(unsorted_bin_header(), USB_SWEEP_BUDGET))
+            unsorted_model_corrupted(chunk, "invalid metadata");
 #endif
     }
 
+    void unsorted_model_corrupted(CHUNK_HEADER* chunk, const char* reason) __attribute__((noinline, cold)) {
+#if defined(USB_CHECK) && defined(USB_INCREMENTAL)
+        auto current = operation().current;
+        auto stored = current->data->unsortedModel.get(chunk);
+        warn("USRT    (CHK ) Chunk %p: %s\n", chunk, reason);
+        warn("USRT    (CHK ) stored.size=%p actual.size=%p\n", stored.chunksize, chunk->chunksize());
+        warn("USRT    (CHK ) stored.fd=%p   actual.fd=%p\n", stored.fd, chunk->fd);
+        warn("USRT    (CHK ) stored.bk=%p   actual.bk=%p\n", stored.bk, chunk->bk);
+        warn("unsorted_bin corrupted: (%p) failed\n", chunk);
+        fflush(stderr);
+        raise(SIGILL);
+#endif
+    }
+
+    template <class Policy>
     void _check_unsorted_impl() {
         if (UNLIKELY(!isInitialized)) return;
-        if (!this->modes.usbMode) return;
+        auto current = operation().current;
+        if (UNLIKELY(current == nullptr)) return;
+        if (!Policy::usb(this->modes)) return;
 
-        auto single = (CHUNK_HEADER*)*this->leak.info->unsorted_bin;
-        for (int i = 0; i < data.unsorted_size; i++) {
-            auto stored = data.unsorted[i];
+        auto single = (CHUNK_HEADER*)*current->info->unsorted_bin;
+        for (int i = 0; i < current->data->unsorted_size; i++) {
+            auto stored = current->data->unsorted[i];
             auto actual = LINKED_LIST_META::from_chunk_header(*single);
             if (UNLIKELY(actual != stored)) {
                 warn("USRT    (CHK ) Element %d has invalid metadata %p\n", i, single);
@@ -262,56 +1188,74 @@ public:
         }
     }
 
+    template <class Policy = RuntimeMitigations>
     void store_topchunk() {
 #ifdef TOP_CHECK
-        _store_topchunk_impl();
+        auto current = operation().current;
+        if (UNLIKELY(current && !current->data->sampled)) return;
+        _store_topchunk_impl<Policy>();
 #endif
     }
 
+    template <class Policy>
     void _store_topchunk_impl() {
         if (UNLIKELY(!isInitialized)) return;
-        if (UNLIKELY(!this->modes.topMode)) return;
-        data.topchunksize = (*this->leak.info->topchunk)->size;
-        info("TOPC    (STR ) Stored topchunksize (%p)\n", data.topchunksize);
+        auto current = operation().current;
+        if (UNLIKELY(current == nullptr)) return;
+        if (UNLIKELY(!Policy::top(this->modes))) return;
+        current->data->topchunksize = (*current->info->topchunk)->size;
+        info("TOPC    (STR ) Stored topchunksize (%p)\n", current->data->topchunksize);
     }
 
+    template <class Policy = RuntimeMitigations>
     void check_topchunk() {
 #ifdef TOP_CHECK
-        _check_topchunk_impl();
+        if (UNLIKELY(!operation().arena_sampled)) return;
+        _check_topchunk_impl<Policy>();
 #endif
     }
 
+    template <class Policy>
     void _check_topchunk_impl() {
         if (UNLIKELY(!isInitialized)) return;
-        if (UNLIKELY(!this->modes.topMode)) return;
-        if (UNLIKELY(data.topchunksize == 0)) return;
-
-        auto expected_topchunk_size = (*this->leak.info->topchunk)->size;
-        if (UNLIKELY(data.topchunksize != expected_topchunk_size)) {
-            warn("topchunk corrupted: old=%p new=%p\n", data.topchunksize, expected_topchunk_size);
+        auto current = operation().current;
+        if (UNLIKELY(current == nullptr)) return;
+        if (UNLIKELY(!Policy::top(this->modes))) return;
+        if (UNLIKELY(current->data->topchunksize == 0)) return;
+
+        auto expected_topchunk_size = (*current->info->topchunk)->size;
+        if (UNLIKELY(current->data->topchunksize != expected_topchunk_size)) {
+            warn("topchunk corrupted: old=%p new=%p\n", current->data->topchunksize, expected_topchunk_size);
             fflush(stderr);
             raise(SIGILL);
         }
     }
 
+    template <class Policy = RuntimeMitigations>
     void store_pointer(size_t len, void* ret) {
 #ifdef PTR_CHECK
-        if (UNLIKELY(!this->modes.ptrMode)) return;
+        if (UNLIKELY(!Policy::ptr(this->modes))) return;
         auto header = CHUNK_HEADER::from_memory(ret);
-        data.store->put(MALLOC_META::from_chunk_header(*header));
+        std::unique_lock<SpinLock> guard;
+        store_of(header, guard)->put(MALLOC_META::from_chunk_header(*header));
 #endif
     }
 
+    template <class Policy = RuntimeMitigations>
     void check_pointer_before_free(void* ptr) {
-        if (UNLIKELY(!this->modes.ptrMode)) return;
+        if (UNLIKELY(!Policy::ptr(this->modes))) return;
         auto header = CHUNK_HEADER::from_memory(ptr);
 
         // the mmap flag needs to be checked before freeing,
         // because accessing freed mmapped chunks segfaults :)
         // bool is_mmapped = header->is_mmapped();
 
+        // Look up and remove the stored metadata with a single probe.
+        // It is only removed if it matches the header.
         MALLOC_META meta = MALLOC_META::from_chunk_header(*header);
-        MALLOC_META stored = data.store->get(ptr);
+        std::unique_lock<SpinLock> guard;
+        auto store = store_of(header, guard);
+        MALLOC_META stored = store->take_if_matches(ptr, meta);
 
         // Checking flags might lead to situations where a previous chunk was freed
         // and the shadowcopy reflects that its still in use
@@ -323,18 +1267,15 @@ public:
 
         if (UNLIKELY(!headerMatchesShadowCopy)) {
             auto prevHeader = header->prev_chunk();
-            MALLOC_META prevMetaStore = data.store->get(prevHeader->to_memory());
+            MALLOC_META prevMetaStore = store->get(prevHeader->to_memory());
             warn(
                 "FREE    (CHK ) Prev was: %16p sz:%16p ptr:%16p\n",
                 prevHeader->to_memory(), prevMetaStore.size, prevMetaStore.ptr);
             warn("FREE    (CHK ) Element has invalid metadata %p\n", ptr);
             warn("FREE    (CHK ) chunkStore.ptr=%p single=%p\n", stored.ptr, ptr);
             warn("FREE    (CHK ) chunkStore.size=%p chunkList.size=%p\n", stored.size, meta.size);
-            goto on_error;
-        }
-
-        if (UNLIKELY(!data.store->remove(meta))) {
-            warn("The pointer (%16p) was not found in Metastore\n", ptr);
+            if (UNLIKELY(!stored.is_some()))
+                warn("The pointer (%16p) was not found in Metastore\n", ptr);
             goto on_error;
         }
 
@@ -365,94 +1306,191 @@ public:
         raise(SIGILL);
     }
 
+    template <class Policy = RuntimeMitigations>
     void free_pre(void* ptr) {
         if (NOT_YET_INITIALIZED) return;
-        check_topchunk();
-        check_unsorted();
-        check_tcache();
+        operation().heap_operations = internal_heap_operations;
+        ensure_thread_discovered<Policy>();
+        select_arena_of(ptr);
+        begin_sample();
+        auto chunksize = CHUNK_HEADER::from_memory(ptr)->chunksize();
+        auto tidx = csize2tidx(chunksize);
+        check_heap<Policy>(tidx);
+        check_fastbins<Policy>(csize2fidx(chunksize));
+        check_sorted_bins<Policy>(NBINS);
         trace("FREE    (PRE ) Ptr: %16p\n", ptr);
-        check_pointer_before_free(ptr);
+        check_pointer_before_free<Policy>(ptr);
+        expect_unsorted_free<Policy>(ptr);
+        expect_sorted_free<Policy>(ptr);
+        // the metastore may have freed memory itself, so this is set last
+        operation().freed_tcache_bin = tidx;
+        operation().freed_fastbin = csize2fidx(chunksize);
     }
 
+    template <class Policy = RuntimeMitigations>
     void free_post(void* ptr) {
         if (NOT_YET_INITIALIZED) return;
         trace("FREE    (POST) Ptr: %16p \n", ptr);
-        store_tcache();
-        store_unsorted();
-        store_topchunk();
+        end_sample();
+        store_tcache_bin<Policy>(operation().freed_tcache_bin);
+        store_fastbins<Policy>(operation().freed_fastbin, (CHUNKPTR*)CHUNK_HEADER::from_memory(ptr));
+        store_unsorted<Policy>();
+        store_sorted_bins<Policy>();
+        store_topchunk<Policy>();
+        store_fingerprint<Policy>();
     }
 
+    template <class Policy = RuntimeMitigations>
     void malloc_pre(size_t len) {
         if (NOT_YET_INITIALIZED) return;
+        operation().heap_operations = internal_heap_operations;
         trace("MALLOC  (PRE ) Len: %16zu\n", len, this->leak.isInitialized);
-        check_topchunk();
-        check_unsorted();
-        check_tcache();
+        ensure_thread_discovered<Policy>();
+        select_thread_arena();
+        begin_sample();
+        check_heap<Policy>(request2tidx(len));
+        check_fastbins<Policy>(csize2fidx(request2size(len)));
+        check_sorted_bins<Policy>(csize2bidx(request2size(len)));
+        expect_unsorted_request<Policy>(len);
+        expect_sorted_request<Policy>(len);
     }
 
+    template <class Policy = RuntimeMitigations>
     void malloc_post(size_t len, void* ret) {
         if (NOT_YET_INITIALIZED) return;
         if (UNLIKELY(ret == nullptr)) return;
         trace("MALLOC  (POST) Len: %16zu Ret: %16p\n", len, ret);
         // auto header = CHUNK_HEADER::from_memory(ret);
         // update_next_chunk_in_storage(header);
-        store_pointer(len, ret);
+        // the pointer goes to the store of the arena it came from, under its lock
+        select_arena_of_allocation(ret);
+        store_pointer<Policy>(len, ret);
 
         // Store pointer can allocate and therefore manipulate state of tcache
+        // (unless META_STORE_ALLOCATOR keeps the store out of the glibc heap)
         // So only start saving other metadata than pointers from here
-        store_tcache();
-        store_unsorted();
-        store_topchunk();
+        end_sample();
+        store_tcache_bin<Policy>(request2tidx(len));
+        store_fastbins<Policy>(csize2fidx(request2size(len)), nullptr);
+        store_unsorted<Policy>();
+        store_sorted_bins<Policy>();
+        store_topchunk<Policy>();
+        store_fingerprint<Policy>();
     }
 
+    template <class Policy = RuntimeMitigations>
     void calloc_pre(size_t cnt, size_t len) {
         if (NOT_YET_INITIALIZED) return;
+        operation().heap_operations = internal_heap_operations;
         trace("CALLOC  (PRE ) Cnt: %16zu Len: %16zu\n", cnt, len);
-        check_topchunk();
-        check_unsorted();
-        check_tcache();
+        ensure_thread_discovered<Policy>();
+        select_thread_arena();
+        begin_sample();
+        // calloc() doesn't take chunks from the tcache, but may refill the bin of its size
+        check_heap<Policy>(request2tidx(cnt * len));
+        check_fastbins<Policy>(csize2fidx(request2size(cnt * len)));
+        check_sorted_bins<Policy>(csize2bidx(request2size(cnt * len)));
+        expect_unsorted_request<Policy>(cnt * len);
+        expect_sorted_request<Policy>(cnt * len);
     }
 
+    template <class Policy = RuntimeMitigations>
     void calloc_post(size_t cnt, size_t len, void* ret) {
         if (NOT_YET_INITIALIZED) return;
         if (UNLIKELY(ret == nullptr)) return;
         trace("CALLOC  (POST) Cnt: %16zu Len: %16zu Ret: %16p\n", cnt, len, ret);
-        store_pointer(len, ret);
-        store_tcache();
-        store_unsorted();
-        store_topchunk();
+        select_arena_of_allocation(ret);
+        store_pointer<Policy>(len, ret);
+        end_sample();
+        store_tcache_bin<Policy>(request2tidx(cnt * len));
+        store_fastbins<Policy>(csize2fidx(request2size(cnt * len)), nullptr);
+        store_unsorted<Policy>();
+        store_sorted_bins<Policy>();
+        store_topchunk<Policy>();
+        store_fingerprint<Policy>();
     }
 
+    template <class Policy = RuntimeMitigations>
     void realloc_pre(void* ptr, size_t len) {
         if (NOT_YET_INITIALIZED) return;
         trace("REALLOC (PRE ) Start Ptr: %16p Len: %16zu\n", ptr, len);
-        check_topchunk();
-        check_unsorted();
-        check_tcache();
+        ensure_thread_discovered<Policy>();
+        if (ptr)
+            select_arena_of(ptr);
+        else
+            select_thread_arena();
+        // the raw malloc() allocates from the arena of the thread
+        if (UNLIKELY(thread_arena_unknown()))
+            lock_all_arenas();
+        else
+            lock_arenas(operation().current, guess_thread_arena());
+        begin_sample();
+        check_topchunk<Policy>();
+        check_unsorted<Policy>();
+        // the raw malloc() and free() of realloc() touch two bins, so all bins are checked
+        check_tcache<Policy>();
+        check_fastbins<Policy>(NFASTBINS);
+        check_sorted_bins<Policy>(NBINS);
+        expect_unsorted_anything();
+        expect_sorted_anything();
     }
 
+    template <class Policy = RuntimeMitigations>
     void realloc_post(void* ptr, size_t len, void* ret) {
         if (NOT_YET_INITIALIZED) return;
         trace("REALLOC (POST) End   Ptr: %16p Len: %16zu Ret: %16p\n", ptr, len, ret);
-        store_tcache();
-        store_unsorted();
-        store_topchunk();
+        end_sample();
+        store_tcache<Policy>();
+        store_fastbins<Policy>(NFASTBINS, nullptr);
+        store_unsorted<Policy>();
+        store_sorted_bins<Policy>();
+        store_topchunk<Policy>();
+        store_fingerprint<Policy>();
+        // realloc() falls back to allocating from the arena of the thread, then both arenas changed
+        if (ret != nullptr && !select_arena_of_allocation(ret)) {
+            store_fastbins<Policy>(NFASTBINS, nullptr);
+            store_unsorted<Policy>();
+            store_sorted_bins<Policy>();
+            store_topchunk<Policy>();
+            store_fingerprint<Policy>();
+        }
     }
 
+    template <class Policy = RuntimeMitigations>
     void realloc_mallochandler(void* ret, size_t len) {
         if (NOT_YET_INITIALIZED) return;
         if (UNLIKELY(ret == nullptr)) return;
         trace("REALLOC (MH  ) Start Ret: %16p Len: %16zu\n", ret, len);
-        store_pointer(len, ret);
+        store_pointer<Policy>(len, ret);
     }
 
+    template <class Policy = RuntimeMitigations>
     void realloc_freehandler(void* ptr) {
         if (NOT_YET_INITIALIZED) return;
         trace("REALLOC (FH  ) Start Ptr: %16p\n", ptr);
-        check_pointer_before_free(ptr);
+        check_pointer_before_free<Policy>(ptr);
         this->info.call_free_raw(ptr);
     }
 
+    /// Print the statistics of the metadata stores to stderr, summed over all arenas.
+    /// Only compiled in with SHADOWHEAP_STORE_STATS, see StoreStats.
+    void dump_store_statistics() {
+#ifdef SHADOWHEAP_STORE_STATS
+        if (NOT_YET_INITIALIZED || !sharedStore) return;
+        StoreStats total;
+        {
+            auto guard = lock_store();
+            total = sharedStore->statistics();
+        }
+        for (size_t i = 0; i < arenas.size(); i++) {
+            auto arena = arenas.at(i);
+            std::lock_guard<SpinLock> guard{ arena->data->lock };
+            if (arena->data->store) total += arena->data->store->statistics();
+        }
+        total.dump(stderr, META_STORE_NAME);
+#endif
+    }
+
     /// Returns true if no update is necessary (e.g. because libcheck is disabled).
     /// Returns true if no next chunk exists (for mmapped chunks).
     /// Returns true if the update to the stored metadata was performed successfully.
@@ -470,7 +1508,8 @@ public:
         if (NOT_YET_INITIALIZED) return true;
         if (LIKELY(!modes.leakMode)) return true;
         if (UNLIKELY(chunk->is_mmapped())) return true;
-        return data.store->update(MALLOC_META::from_chunk_header(*chunk->next_chunk()));
+        std::unique_lock<SpinLock> guard;
+        return store_of(chunk, guard)->update(MALLOC_META::from_chunk_header(*chunk->next_chunk()));
 #endif
     }
 
@@ -0,0 +1,251 @@
+#pragma once
+
+#include "../common/common.h"
+#include "../common/malloc_meta.h"
+#include "../leak/leak.h"
+
+#include <cstdint>
+#include <cstring>
+
+/// What an operation may do to the smallbins and largebins,
+/// besides inserting chunks at the head of a bin and taking them from its tail.
+struct SortedBinChanges {
+    /// If nothing is known, all bins are assumed to have changed.
+    bool known = false;
+    /// The fastbin that the operation may push to or pop from, NFASTBINS for none.
+    size_t fastbin = NFASTBINS;
+    /// The first largebin from which a best fit may be taken out of the middle, NBINS for none.
+    size_t best_fit = NBINS;
+    /// The bins of the free neighbours that free() consolidates with the freed chunk, NBINS for none.
+    size_t neighbours[2] = { NBINS, NBINS };
+};
+
+/// A shadow copy of the ends of the smallbins and largebins of an arena.
+///
+/// glibc marks each bin that it inserts a chunk into in the binmap, and clears the mark
+/// only when it finds the bin empty. So only the bins that are marked in the binmap now or before
+/// can have changed, and only their heads and tails are compared after an operation.
+/// The bins whose ends changed are verified again before the next operation,
+/// together with the bin that the next operation takes chunks from.
+///
+/// The chunks between the ends are covered by a sweep over the marked bins,
+/// a few chunks per operation. A sweep over a bin records the number of chunks and a digest
+/// of their sizes and links. When the bin wasn't touched until the next sweep over it,
+/// that sweep must see the same chunks again. Each swept chunk is also checked on its own.
+/// Chunks can leave the middle of a bin when free() consolidates them,
+/// when malloc() takes a best fit from a largebin, or inserts a chunk into a largebin
+/// in the order of their sizes. These bins are touched, which restarts their sweep.
+/// So the cost per operation depends on the bins that it changes, not on the number of bins.
+class SortedBinShadow {
+    /// the smallbins and largebins start after the unsorted bin
+    static constexpr size_t FIRST_BIN = 2;
+    static constexpr size_t FIRST_LARGE_BIN = 64;
+    static constexpr size_t LAST_BIN = NBINS - 2;
+
+    struct Bin {
+        CHUNK_HEADER* head = nullptr;
+        CHUNK_HEADER* tail = nullptr;
+        LINKED_LIST_META head_record = {};
+        LINKED_LIST_META tail_record = {};
+        /// whether the last sweep over the bin completed without the bin being touched
+        bool settled = false;
+        size_t entries = 0;
+        uint64_t digest = 0;
+    };
+
+    Bin bins[NBINS];
+    unsigned int binmap[BINMAPSIZE] = {};
+    /// the bins that changed or were touched by the last operation
+    unsigned int recent[BINMAPSIZE] = {};
+    /// the bins that were touched since the last store
+    unsigned int touched[BINMAPSIZE] = {};
+
+    bool valid = false;
+    CHUNKPTR* fastbins[NFASTBINS] = {};
+    CHUNK_HEADER* unsorted_head = nullptr;
+    CHUNK_HEADER* unsorted_tail = nullptr;
+    unsigned long heap_operations = 0;
+
+    /// The bin of the sweep, and its next chunk or nullptr to start at the head.
+    size_t cursor_bin = FIRST_BIN;
+    CHUNK_HEADER* cursor = nullptr;
+    size_t swept_entries = 0;
+    uint64_t swept_digest = 0;
+
+    static bool marked(unsigned int const* map, size_t i) noexcept {
+        return map[i >> BINMAPSHIFT] & (1U << (i & (BITSPERMAP - 1)));
+    }
+
+    static void mark(unsigned int* map, size_t i) noexcept {
+        map[i >> BINMAPSHIFT] |= 1U << (i & (BITSPERMAP - 1));
+    }
+
+    /// The header of bin `i`, whose fd and bk are the head and tail of the list, like glibc's bin_at().
+    static CHUNK_HEADER* header(CHUNKPTR* const* arena_bins, size_t i) noexcept {
+        return CHUNK_HEADER::from_memory((void*)&arena_bins[(i - 1) * 2]);
+    }
+
+    static LINKED_LIST_META record_of(CHUNK_HEADER* bin, CHUNK_HEADER* chunk) noexcept {
+        if (chunk == bin) return LINKED_LIST_META{};
+        return LINKED_LIST_META::from_chunk_header(*chunk);
+    }
+
+    static uint64_t digest_of(LINKED_LIST_META const& record) noexcept {
+        uint64_t h = (uintptr_t)record.ptr;
+        h = (h ^ record.chunksize) * 0x9E3779B97F4A7C15ull;
+        h = (h ^ (uintptr_t)record.fd) * 0xC2B2AE3D27D4EB4Full;
+        h = (h ^ (uintptr_t)record.bk) * 0x165667B19E3779F9ull;
+        return h ^ (h >> 29);
+    }
+
+    /// Note that the chunks in the middle of bin `i` may have changed.
+    void touch(size_t i) noexcept {
+        if (i < FIRST_BIN || i > LAST_BIN) return;
+        mark(touched, i);
+    }
+
+    void touch_range(size_t first, size_t last) noexcept {
+        for (size_t i = first; i <= last; i++)
+            touch(i);
+    }
+
+    /// Store the ends of bin `i` again, if they changed or the bin was touched.
+    void refresh(CHUNKPTR* const* arena_bins, size_t i) noexcept {
+        auto bin = header(arena_bins, i);
+        auto& shadow = bins[i];
+        bool changed = bin->fd != shadow.head || bin->bk != shadow.tail;
+        if (LIKELY(!changed && !marked(touched, i))) return;
+
+        shadow.head = bin->fd;
+        shadow.tail = bin->bk;
+        shadow.head_record = record_of(bin, bin->fd);
+        shadow.tail_record = record_of(bin, bin->bk);
+        shadow.settled = false;
+        if (cursor_bin == i) cursor = nullptr;
+        mark(recent, i);
+    }
+
+    /// Compare the ends of bin `i` with the shadow. Returns the chunk that doesn't match, or nullptr.
+    CHUNK_HEADER* verify_ends(CHUNKPTR* const* arena_bins, size_t i) noexcept {
+        auto bin = header(arena_bins, i);
+        auto& shadow = bins[i];
+        if (UNLIKELY(bin->fd != shadow.head || bin->bk != shadow.tail)) return bin;
+        if (shadow.head == bin) return nullptr;
+        auto head_record = record_of(bin, shadow.head);
+        if (UNLIKELY(head_record != shadow.head_record)) return shadow.head;
+        auto tail_record = record_of(bin, shadow.tail);
+        if (UNLIKELY(tail_record != shadow.tail_record)) return shadow.tail;
+        return nullptr;
+    }
+
+    /// Move the sweep to the next bin that is marked in the binmap.
+    /// Returns false if no bin is marked.
+    bool next_sweep_bin() noexcept {
+        for (size_t n = 0; n <= LAST_BIN; n++) {
+            cursor_bin = cursor_bin >= LAST_BIN ? FIRST_BIN : cursor_bin + 1;
+            if (marked(binmap, cursor_bin)) return true;
+        }
+        return false;
+    }
+
+public:
+    SortedBinShadow() {
+    }
+
+    SortedBinShadow(SortedBinShadow const&) = delete;
+
+    /// Bring the shadow up to date after an operation.
+    /// Only the bins that are marked in the binmap before or after the operation are compared,
+    /// and only those that changed or were touched are stored again.
+    void update(
+        CHUNKPTR* const* arena_bins, unsigned int const* binmap_now, CHUNKPTR* const* fastbins_now,
+        unsigned long heap_operations_now, SortedBinChanges const& changes) {
+        auto unsorted = header(arena_bins, 1);
+        bool unknown = !valid || !changes.known || heap_operations != heap_operations_now;
+        // malloc_consolidate() empties all fastbins, and unlinks their neighbours anywhere
+        for (size_t i = 0; i < NFASTBINS && !unknown; i++)
+            unknown = fastbins_now[i] != fastbins[i] && i != changes.fastbin;
+
+        if (UNLIKELY(unknown)) {
+            touch_range(FIRST_BIN, LAST_BIN);
+        } else {
+            touch(changes.neighbours[0]);
+            touch(changes.neighbours[1]);
+            // chunks that were sorted out of the unsorted bin are inserted into the largebins by size
+            if (unsorted->fd != unsorted_head || unsorted->bk != unsorted_tail)
+                touch_range(FIRST_LARGE_BIN, LAST_BIN);
+            else if (changes.best_fit < NBINS)
+                touch_range(changes.best_fit, LAST_BIN);
+        }
+
+        std::memset(recent, 0, sizeof(recent));
+        for (size_t w = 0; w < BINMAPSIZE; w++) {
+            unsigned int scan = binmap_now[w] | binmap[w] | touched[w];
+            for (; scan; scan &= scan - 1) {
+                size_t i = w * BITSPERMAP + __builtin_ctz(scan);
+                if (i >= FIRST_BIN && i <= LAST_BIN) refresh(arena_bins, i);
+            }
+        }
+        std::memset(touched, 0, sizeof(touched));
+
+        std::memcpy(binmap, binmap_now, sizeof(binmap));
+        std::memcpy(fastbins, fastbins_now, sizeof(fastbins));
+        unsorted_head = unsorted->fd;
+        unsorted_tail = unsorted->bk;
+        heap_operations = heap_operations_now;
+        valid = true;
+    }
+
+    /// Verify the binmap, the ends of the bins that the last operation changed and of bin `bidx`,
+    /// and the next `budget` chunks of the sweep. Returns the first chunk that doesn't match, or nullptr.
+    CHUNK_HEADER* verify(
+        CHUNKPTR* const* arena_bins, unsigned int const* binmap_now, size_t bidx, size_t budget) {
+        if (UNLIKELY(!valid)) return nullptr;
+        for (size_t w = 0; w < BINMAPSIZE; w++)
+            if (UNLIKELY(binmap_now[w] != binmap[w]))
+                return header(arena_bins, w * BITSPERMAP + __builtin_ctz(binmap_now[w] ^ binmap[w]));
+
+        for (size_t w = 0; w < BINMAPSIZE; w++) {
+            for (unsigned int scan = recent[w]; scan; scan &= scan - 1)
+                if (auto chunk = verify_ends(arena_bins, w * BITSPERMAP + __builtin_ctz(scan))) return chunk;
+        }
+        if (bidx >= FIRST_BIN && bidx <= LAST_BIN)
+            if (auto chunk = verify_ends(arena_bins, bidx)) return chunk;
+
+        for (; budget; budget--) {
+            if (cursor == nullptr) {
+                if (!marked(binmap, cursor_bin) && !next_sweep_bin()) return nullptr;
+                cursor = bins[cursor_bin].head;
+                swept_entries = 0;
+                swept_digest = 0;
+            }
+
+            auto bin = header(arena_bins, cursor_bin);
+            auto& shadow = bins[cursor_bin];
+            if (cursor == bin) {
+                bool same = swept_entries == shadow.entries && swept_digest == shadow.digest;
+                if (UNLIKELY(shadow.settled && !same)) return bin;
+                shadow.settled = true;
+                shadow.entries = swept_entries;
+                shadow.digest = swept_digest;
+                cursor = nullptr;
+                if (!next_sweep_bin()) return nullptr;
+                continue;
+            }
+
+            // A chunk that was corrupted before the first sweep over its bin is recorded in the digest,
+            // so each chunk is also checked on its own: its size must belong to the bin,
+            // the next chunk must repeat it as prev_size, and the links between neighbours must agree,
+            // like glibc's unlink_chunk() checks them.
+            auto chunksize = cursor->chunksize();
+            if (UNLIKELY(csize2bidx(chunksize) != cursor_bin)) return cursor;
+            if (UNLIKELY(cursor->next_chunk()->prev_size != chunksize)) return cursor;
+            if (UNLIKELY(cursor->fd->bk != cursor || cursor->bk->fd != cursor)) return cursor;
+            swept_entries++;
+            swept_digest += digest_of(record_of(bin, cursor));
+            if (UNLIKELY(shadow.settled && swept_entries > shadow.entries)) return cursor;
+            cursor = cursor->fd;
+        }
+        return nullptr;
+    }
+};
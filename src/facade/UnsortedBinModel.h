@@ -0,0 +1,315 @@
+#pragma once
+
+#include "../common/common.h"
+#include "../common/malloc_meta.h"
+#include "../leak/leak.h"
+#include "../store/MmapAllocator.h"
+
+#include <cstdint>
+#include <cstring>
+
+/// What an operation may do to the unsorted bin,
+/// besides inserting chunks at the head and sorting chunks out at the tail.
+struct UnsortedBinChanges {
+    /// If nothing is known, the model is recorded again after the operation.
+    bool known = false;
+    /// The fastbin that the operation may push to or pop from, NFASTBINS for none.
+    size_t fastbin = NFASTBINS;
+    /// A freed chunk, and its free neighbours that free() consolidates with it,
+    /// with their sizes before the free.
+    CHUNK_HEADER* freed = nullptr;
+    size_t freed_size = 0;
+    CHUNK_HEADER* prev = nullptr;
+    size_t prev_size = 0;
+    CHUNK_HEADER* next = nullptr;
+    size_t next_size = 0;
+};
+
+/// A shadow copy of the unsorted bin that is updated incrementally.
+///
+/// glibc inserts chunks into the unsorted bin only at its head, and sorts them out only at its tail.
+/// Chunks leave the middle of the list only when free() consolidates them with the freed chunk,
+/// or when malloc_consolidate() empties the fastbins. So after an operation, only the chunks
+/// at both ends and the neighbours of the consolidated chunks are read, however long the list is.
+/// Anything else, e.g. other fastbins that changed, records the whole list again.
+///
+/// The records are kept in an open-addressing table keyed by the chunk,
+/// together with their number and an order-independent digest of all records.
+/// The table is mmapped, so that growing it doesn't change the heap that it describes.
+class UnsortedBinModel {
+    static constexpr size_t MIN_CAPACITY = 1024;
+
+    MmapAllocator<LINKED_LIST_META> allocator;
+    LINKED_LIST_META* records = nullptr;
+    size_t capacity = 0;
+    size_t entries = 0;
+    uint64_t digest = 0;
+
+    bool valid = false;
+    CHUNK_HEADER* head = nullptr;
+    CHUNK_HEADER* tail = nullptr;
+    CHUNKPTR* fastbins[NFASTBINS] = {};
+    unsigned long heap_operations = 0;
+
+    /// The next chunk of the sweep over the list, see verify().
+    CHUNK_HEADER* cursor = nullptr;
+    size_t swept_entries = 0;
+    uint64_t swept_digest = 0;
+    /// whether no record changed since the sweep started at the head
+    bool sweep_unchanged = false;
+
+    static LINKED_LIST_META record_of(CHUNK_HEADER* chunk) noexcept {
+        return LINKED_LIST_META::from_chunk_header(*chunk);
+    }
+
+    static uint64_t digest_of(LINKED_LIST_META const& record) noexcept {
+        uint64_t h = (uintptr_t)record.ptr;
+        h = (h ^ record.chunksize) * 0x9E3779B97F4A7C15ull;
+        h = (h ^ (uintptr_t)record.fd) * 0xC2B2AE3D27D4EB4Full;
+        h = (h ^ (uintptr_t)record.bk) * 0x165667B19E3779F9ull;
+        return h ^ (h >> 29);
+    }
+
+    size_t index_of(void* key) const noexcept {
+        uint64_t h = ((uintptr_t)key >> 4) * 0x9E3779B97F4A7C15ull;
+        return (h ^ (h >> 32)) & (capacity - 1);
+    }
+
+    size_t next_index(size_t i) const noexcept {
+        return (i + 1) & (capacity - 1);
+    }
+
+    LINKED_LIST_META* find(CHUNK_HEADER* chunk) noexcept {
+        if (UNLIKELY(records == nullptr)) return nullptr;
+        void* key = chunk->to_memory();
+        for (size_t i = index_of(key);; i = next_index(i)) {
+            if (records[i].ptr == key) return &records[i];
+            if (records[i].ptr == nullptr) return nullptr;
+        }
+    }
+
+    void replace(LINKED_LIST_META& slot, LINKED_LIST_META record) noexcept {
+        if (record == slot) return;
+        digest += digest_of(record) - digest_of(slot);
+        slot = record;
+        sweep_unchanged = false;
+    }
+
+    /// Insert or replace the record of a chunk.
+    void put(LINKED_LIST_META const& record) {
+        if (UNLIKELY((entries + 1) * 2 > capacity)) grow();
+        for (size_t i = index_of(record.ptr);; i = next_index(i)) {
+            auto& slot = records[i];
+            if (slot.ptr == record.ptr) return replace(slot, record);
+            if (slot.ptr == nullptr) {
+                slot = record;
+                entries++;
+                digest += digest_of(record);
+                sweep_unchanged = false;
+                return;
+            }
+        }
+    }
+
+    /// Remove a record, and move the records after it back into the gap (backward shift).
+    void erase(LINKED_LIST_META* slot) noexcept {
+        digest -= digest_of(*slot);
+        entries--;
+        sweep_unchanged = false;
+        if (cursor && cursor->to_memory() == slot->ptr) cursor = nullptr;
+
+        size_t gap = slot - records;
+        for (size_t i = next_index(gap); records[i].ptr != nullptr; i = next_index(i)) {
+            size_t home = index_of(records[i].ptr);
+            if (((i - home) & (capacity - 1)) >= ((i - gap) & (capacity - 1))) {
+                records[gap] = records[i];
+                gap = i;
+            }
+        }
+        records[gap] = LINKED_LIST_META{};
+    }
+
+    void grow() __attribute__((noinline)) {
+        auto old_records = records;
+        auto old_capacity = capacity;
+
+        capacity = capacity ? 2 * capacity : MIN_CAPACITY;
+        records = allocator.allocate(capacity);
+        std::memset(static_cast<void*>(records), 0, capacity * sizeof(LINKED_LIST_META));
+        entries = 0;
+        digest = 0;
+
+        for (size_t i = 0; i < old_capacity; i++)
+            if (old_records[i].ptr) put(old_records[i]);
+        if (old_records) allocator.deallocate(old_records, old_capacity);
+    }
+
+    void clear() noexcept {
+        if (records) std::memset(static_cast<void*>(records), 0, capacity * sizeof(LINKED_LIST_META));
+        entries = 0;
+        digest = 0;
+        cursor = nullptr;
+    }
+
+    /// Remove a chunk from the middle of the list, like glibc's unlink_chunk(),
+    /// and remember its neighbours, whose records are read again.
+    void unlink(CHUNK_HEADER* chunk, CHUNK_HEADER** neighbours, size_t& count) {
+        auto slot = find(chunk);
+        if (slot == nullptr) return;  // e.g. in a smallbin
+        auto record = *slot;
+        erase(slot);
+
+        if (head == chunk) head = record.fd;
+        if (tail == chunk) tail = record.bk;
+        if (auto fd = find(record.fd)) {
+            auto relinked = *fd;
+            relinked.bk = record.bk;
+            replace(*fd, relinked);
+        }
+        if (auto bk = find(record.bk)) {
+            auto relinked = *bk;
+            relinked.fd = record.fd;
+            replace(*bk, relinked);
+        }
+        neighbours[count++] = record.fd;
+        neighbours[count++] = record.bk;
+    }
+
+    /// Read the record of a chunk that is in the list and in the model again.
+    void refresh(CHUNK_HEADER* bin, CHUNK_HEADER* chunk) {
+        if (chunk == bin) return;
+        if (auto slot = find(chunk)) replace(*slot, record_of(chunk));
+    }
+
+    void snapshot(CHUNK_HEADER* bin, CHUNKPTR* const* fastbins_now, unsigned long heap_operations_now) {
+        head = bin->fd;
+        tail = bin->bk;
+        std::memcpy(fastbins, fastbins_now, sizeof(fastbins));
+        heap_operations = heap_operations_now;
+        valid = true;
+    }
+
+public:
+    UnsortedBinModel() {
+    }
+
+    UnsortedBinModel(UnsortedBinModel const&) = delete;
+
+    ~UnsortedBinModel() {
+        if (records) allocator.deallocate(records, capacity);
+    }
+
+    /// The number of chunks in the list.
+    size_t size() const noexcept {
+        return entries;
+    }
+
+    /// Record the whole list `bin` again.
+    /// Returns the first chunk that shows up twice, i.e. a corrupted list, or nullptr.
+    CHUNK_HEADER* rebuild(CHUNK_HEADER* bin, CHUNKPTR* const* fastbins_now, unsigned long heap_operations_now) {
+        clear();
+        valid = false;
+        for (auto chunk = bin->fd; chunk != bin; chunk = chunk->fd) {
+            if (UNLIKELY(find(chunk) != nullptr)) return chunk;
+            put(record_of(chunk));
+        }
+        snapshot(bin, fastbins_now, heap_operations_now);
+        return nullptr;
+    }
+
+    /// Bring the model up to date after an operation, only reading the chunks that it changed.
+    /// Returns false if the changes can't be explained, then the list has to be rebuilt.
+    bool update(
+        CHUNK_HEADER* bin, CHUNKPTR* const* fastbins_now, unsigned long heap_operations_now,
+        UnsortedBinChanges const& changes) {
+        if (UNLIKELY(!valid || !changes.known)) return false;
+        // the facade itself allocated from the heap since the last snapshot
+        if (UNLIKELY(heap_operations != heap_operations_now)) return false;
+        // malloc_consolidate() empties all fastbins, and unlinks their neighbours anywhere
+        for (size_t i = 0; i < NFASTBINS; i++)
+            if (UNLIKELY(fastbins_now[i] != fastbins[i] && i != changes.fastbin)) return false;
+
+        // Consolidated neighbours of a freed chunk were unlinked. The previous chunk has grown,
+        // and the next chunk is part of the chunk that starts with the freed or previous chunk.
+        CHUNK_HEADER* neighbours[4];
+        size_t count = 0;
+        bool prev_consolidated = changes.prev && changes.prev->chunksize() != changes.prev_size;
+        if (prev_consolidated) unlink(changes.prev, neighbours, count);
+        if (changes.next) {
+            auto start = prev_consolidated ? changes.prev : changes.freed;
+            auto consolidated_size = (prev_consolidated ? changes.prev_size : 0) + changes.freed_size + changes.next_size;
+            if (start->chunksize() == consolidated_size) unlink(changes.next, neighbours, count);
+        }
+
+        // chunks that were sorted out at the tail
+        for (auto chunk = tail; chunk != bin && chunk != bin->bk;) {
+            auto slot = find(chunk);
+            if (UNLIKELY(slot == nullptr)) return false;
+            if (head == chunk) head = bin;
+            chunk = slot->bk;
+            erase(slot);
+            tail = chunk;
+        }
+
+        // chunks that were inserted at the head, up to the old head
+        auto chunk = bin->fd;
+        for (; chunk != bin && find(chunk) == nullptr; chunk = chunk->fd)
+            put(record_of(chunk));
+        if (UNLIKELY(chunk != head)) return false;
+
+        // the links of the old head, the new tail, and the neighbours have changed
+        refresh(bin, chunk);
+        refresh(bin, bin->bk);
+        for (size_t i = 0; i < count; i++)
+            refresh(bin, neighbours[i]);
+
+        snapshot(bin, fastbins_now, heap_operations_now);
+        return true;
+    }
+
+    /// Verify the ends of the list `bin`, and the next `budget` chunks of a sweep over the list.
+    /// When a sweep completes while no record changed, it must have seen each record once.
+    /// Returns the first chunk that doesn't match the model, or nullptr.
+    CHUNK_HEADER* verify(CHUNK_HEADER* bin, size_t budget) {
+        if (UNLIKELY(!valid)) return nullptr;
+        if (UNLIKELY(bin->fd != head || bin->bk != tail)) return bin;
+        if (head == bin) return nullptr;
+        if (UNLIKELY(!matches(head))) return head;
+        if (UNLIKELY(!matches(tail))) return tail;
+
+        for (; budget; budget--) {
+            if (cursor == nullptr) {
+                cursor = head;
+                swept_entries = 0;
+                swept_digest = 0;
+                sweep_unchanged = true;
+            }
+            if (cursor == bin) {
+                cursor = nullptr;
+                if (UNLIKELY(sweep_unchanged && (swept_entries != entries || swept_digest != digest))) return bin;
+                break;
+            }
+
+            auto slot = find(cursor);
+            if (UNLIKELY(slot == nullptr || !matches(cursor))) return cursor;
+            swept_entries++;
+            swept_digest += digest_of(*slot);
+            if (UNLIKELY(sweep_unchanged && swept_entries > entries)) return cursor;
+            cursor = slot->fd;
+        }
+        return nullptr;
+    }
+
+    bool matches(CHUNK_HEADER* chunk) {
+        auto slot = find(chunk);
+        if (UNLIKELY(slot == nullptr)) return false;
+        auto actual = record_of(chunk);
+        return actual == *slot;
+    }
+
+    /// The record of a chunk, or an empty record.
+    LINKED_LIST_META get(CHUNK_HEADER* chunk) {
+        auto slot = find(chunk);
+        return slot ? *slot : LINKED_LIST_META{};
+    }
+};
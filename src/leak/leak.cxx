@@ -1,12 +1,37 @@
 #include "leak.h"
 #include "../common/common.h"
 
+#include <link.h>
+
 namespace {
 template <class T>
 T* plus_offset(T* original, std::size_t offset) {
     auto address = (char*)original;
     return (T*)(address + offset);
 }
+
+struct ThreadArenaSearch {
+    AR_MAIN* arena;
+    AR_MAIN** found;
+    size_t matches;
+};
+
+/// Look for the words that hold `search->arena` in the TLS block of libc, see dl_iterate_phdr().
+int search_libc_tls(struct dl_phdr_info* module, size_t, void* data) {
+    auto search = static_cast<ThreadArenaSearch*>(data);
+    if (!module->dlpi_tls_data || !strstr(module->dlpi_name, "libc.so.")) return 0;
+    for (size_t i = 0; i < module->dlpi_phnum; i++) {
+        auto& segment = module->dlpi_phdr[i];
+        if (segment.p_type != PT_TLS) continue;
+        auto words = (AR_MAIN**)module->dlpi_tls_data;
+        for (size_t w = 0; w < segment.p_memsz / sizeof(AR_MAIN*); w++) {
+            if (words[w] != search->arena) continue;
+            search->found = &words[w];
+            search->matches++;
+        }
+    }
+    return 1;
+}
 }  // namespace
 
 GLIBC_INFO::GLIBC_INFO(HookInfo& hook) {
@@ -116,6 +141,46 @@ void* test_tcache(HookInfo& hook) {
     return might_be_tcache;  // all buffer entries matched, so tcache is present
 }
 
+/// The tcache that test_tcache() found, or nullptr if it isn't known.
+struct tcache_perthread_struct* tcache_of(void* tcache_present) {
+    // if the tcache check returned a value that is trueish and not == 1,
+    // then it is a valid pointer
+    if ((uintptr_t)tcache_present > 1) {
+        return (struct tcache_perthread_struct*)tcache_present;
+    }
+#ifdef LEAK_CHECK
+    // otherwise, if tcache check return a trueish value,
+    // a tcache is present but has to be leaked via the patched libc.
+    else if ((uintptr_t)tcache_present == 1) {
+        unsigned int retTcacheLower = mallopt(-11, 0);
+        unsigned int retTcacheUpper = mallopt(-12, 0);
+        if (retTcacheLower != 1 && retTcacheUpper != 1) {
+            unsigned long tcacheAdr = retTcacheUpper;
+            tcacheAdr = tcacheAdr << 32 >> 32;
+            tcacheAdr = tcacheAdr << 32;
+            tcacheAdr = tcacheAdr + retTcacheLower;
+            return (struct tcache_perthread_struct*)tcacheAdr;
+        } else {
+            // tcache tested and present, but rva still not known!
+            // patched libc required but possibly not found!
+            // Most likely using system default libc version
+            // TODO: Assign appropriate handling!
+            // Common usecase: Malloc-Shadow build with LEAK_CHECK but was run with system defaults
+            // What should we do then? Print error? Silently ignore tcache? Abort?
+        }
+    }
+#endif
+    return nullptr;
+}
+
+/// Find the tcache of the calling thread, like GLIBC_INFO does for the thread that starts the process.
+/// The tcache of a thread is only created by its first allocation, which test_tcache() makes.
+/// Returns nullptr if this glibc has no tcache, or it can't be leaked.
+struct tcache_perthread_struct* leak_tcache(GLIBC_INFO const& libc_info, HookInfo& hook) {
+    if (!libc_info.valid || !libc_info.tcache_present) return nullptr;
+    return tcache_of(test_tcache(hook));
+}
+
 AR_MAIN* leak_arena(GLIBC_INFO& libc_info, HookInfo& hook) {
     if (!libc_info.valid) return nullptr;
 
@@ -174,46 +239,47 @@ ARENA_INFO* get_arenainfo(HookInfo& hook) {
     return new ARENA_INFO(hook, arena);
 }
 
+/// Find glibc's `thread_arena` of the calling thread, which points to the arena it allocates from.
+/// It is the only word in the TLS block of libc that holds `arena`, the arena of the thread,
+/// e.g. the main arena for the first thread. Returns nullptr if there is no such word, or several.
+AR_MAIN** leak_thread_arena(AR_MAIN* arena) {
+    if (!arena) return nullptr;
+    ThreadArenaSearch search{ arena, nullptr, 0 };
+    dl_iterate_phdr(search_libc_tls, &search);
+    return search.matches == 1 ? search.found : nullptr;
+}
+
 }  // namespace malloc_leak
 
+ARENA_INFO::ARENA_INFO(ARENA_INFO const& main_arena, AR_MAIN* arena)
+    : arena(arena),
+      next(plus_offset(&arena->next, main_arena.version.offset_adjust_references)),
+      fastbins(plus_offset(&arena->fastbinsY[0], main_arena.version.offset_adjust_references)),
+      topchunk(plus_offset(&arena->top, main_arena.version.offset_adjust_references)),
+      last_remainder(plus_offset(&arena->last_remainder, main_arena.version.offset_adjust_references)),
+      unsorted_bin(plus_offset(&arena->bins[0], main_arena.version.offset_adjust_references)),
+      bins(plus_offset(&arena->bins[0], main_arena.version.offset_adjust_references)),
+      binmap(plus_offset(&arena->binmap[0], main_arena.version.offset_adjust_references)),
+      tcache(main_arena.tcache),
+      valid(main_arena.valid),
+      version(main_arena.version) {
+}
+
 ARENA_INFO::ARENA_INFO(GLIBC_INFO libc_info, AR_MAIN* arena)
     // Adjust pointers by versionized offset (0 bytes up and including 2.25, 8 bytes since 2.26)
     : arena(arena),
       next(plus_offset(&arena->next, libc_info.offset_adjust_references)),
+      fastbins(plus_offset(&arena->fastbinsY[0], libc_info.offset_adjust_references)),
       topchunk(plus_offset(&arena->top, libc_info.offset_adjust_references)),
       last_remainder(plus_offset(&arena->last_remainder, libc_info.offset_adjust_references)),
       unsorted_bin(plus_offset(&arena->bins[0], libc_info.offset_adjust_references)),
+      bins(plus_offset(&arena->bins[0], libc_info.offset_adjust_references)),
+      binmap(plus_offset(&arena->binmap[0], libc_info.offset_adjust_references)),
       tcache(nullptr),
       valid(false),
       version(libc_info) {
 
-    // if the tcache check returned a value that is trueish and not == 1,
-    // then it is a valid pointer
-    if ((uintptr_t)libc_info.tcache_present > 1) {
-        tcache = (struct tcache_perthread_struct*)libc_info.tcache_present;
-    }
-#ifdef LEAK_CHECK
-    // otherwise, if tcache check return a trueish value,
-    // a tcache is present but has to be leaked via the patched libc.
-    else if ((uintptr_t)libc_info.tcache_present == 1) {
-        unsigned int retTcacheLower = mallopt(-11, 0);
-        unsigned int retTcacheUpper = mallopt(-12, 0);
-        if (retTcacheLower != 1 && retTcacheUpper != 1) {
-            unsigned long tcacheAdr = retTcacheUpper;
-            tcacheAdr = tcacheAdr << 32 >> 32;
-            tcacheAdr = tcacheAdr << 32;
-            tcacheAdr = tcacheAdr + retTcacheLower;
-            tcache = (struct tcache_perthread_struct*)tcacheAdr;
-        } else {
-            // tcache tested and present, but rva still not known!
-            // patched libc required but possibly not found!
-            // Most likely using system default libc version
-            // TODO: Assign appropriate handling!
-            // Common usecase: Malloc-Shadow build with LEAK_CHECK but was run with system defaults
-            // What should we do then? Print error? Silently ignore tcache? Abort?
-        }
-    }
-#endif
+    tcache = malloc_leak::tcache_of(libc_info.tcache_present);
 
     // check for plausibility
     int checkVal = reinterpret_cast<std::uintptr_t>(this->arena) + libc_info.offset_sb0_to_main_arena;
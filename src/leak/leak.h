@@ -15,6 +15,10 @@
 #include <string.h>
 #include <type_traits>  // needed for static assert
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 extern char* __progname;
 
 typedef int __libc_lock_t;
@@ -53,6 +57,118 @@ constexpr inline bool is_valid_tcache_layout() {
            std::is_same<TcacheLayout, tcache_perthread_struct_2_30>::value;
 }
 
+namespace details {
+static_assert(TCACHE_ENTRIES == 64, "the bins of a tcache are tracked in a 64 bit mask");
+
+/// Bit i is set if the counts of bin i are equal.
+inline uint64_t tcache_equal_counts(char const* a, char const* b) noexcept {
+#ifdef __AVX2__
+    uint64_t equal = 0;
+    for (int i = 0; i < TCACHE_ENTRIES; i += 32) {
+        auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        auto y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        equal |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)))) << i;
+    }
+    return equal;
+#else
+    uint64_t equal = 0;
+    for (int i = 0; i < TCACHE_ENTRIES; i++)
+        equal |= uint64_t(a[i] == b[i]) << i;
+    return equal;
+#endif
+}
+
+inline uint64_t tcache_equal_counts(uint16_t const* a, uint16_t const* b) noexcept {
+#ifdef __AVX2__
+    uint64_t equal = 0;
+    for (int i = 0; i < TCACHE_ENTRIES; i += 32) {
+        auto lo = _mm256_cmpeq_epi16(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+        auto hi = _mm256_cmpeq_epi16(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i + 16)),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i + 16)));
+        // packing interleaves the 128 bit lanes, the permutation restores the order of the bins
+        auto packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xd8);
+        equal |= uint64_t(uint32_t(_mm256_movemask_epi8(packed))) << i;
+    }
+    return equal;
+#else
+    uint64_t equal = 0;
+    for (int i = 0; i < TCACHE_ENTRIES; i++)
+        equal |= uint64_t(a[i] == b[i]) << i;
+    return equal;
+#endif
+}
+
+/// Bit i is set if the heads of bin i are equal.
+inline uint64_t tcache_equal_heads(tcache_entry* const* a, tcache_entry* const* b) noexcept {
+#ifdef __AVX2__
+    uint64_t equal = 0;
+    for (int i = 0; i < TCACHE_ENTRIES; i += 4) {
+        auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        auto y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        equal |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(x, y)))) << i;
+    }
+    return equal;
+#else
+    uint64_t equal = 0;
+    for (int i = 0; i < TCACHE_ENTRIES; i++)
+        equal |= uint64_t(a[i] == b[i]) << i;
+    return equal;
+#endif
+}
+}  // namespace details
+
+/// Bit i is set if the count or the head of bin i differs between the two tcaches.
+/// That's a few vector compares with AVX2, instead of walking the bins.
+template <class TcacheLayout>
+inline uint64_t tcache_dirty_bins(TcacheLayout const& a, TcacheLayout const& b) noexcept {
+    static_assert(is_valid_tcache_layout<TcacheLayout>(), "TcacheLayout must be one of the known tcache_perthread_struct versions");
+    return ~(details::tcache_equal_counts(a.counts, b.counts) &
+             details::tcache_equal_heads(a.entries, b.entries));
+}
+
+// chunk geometry of glibc on 64 bit platforms
+static constexpr size_t MALLOC_ALIGNMENT = 2 * sizeof(size_t);
+static constexpr size_t MIN_CHUNK_SIZE = 4 * sizeof(size_t);
+
+/// The tcache bin of a chunk of the given size, like glibc's csize2tidx().
+/// Chunks with a bin of TCACHE_ENTRIES or above never enter the tcache.
+constexpr inline size_t csize2tidx(size_t chunksize) {
+    return chunksize < MIN_CHUNK_SIZE ? 0 : (chunksize - MIN_CHUNK_SIZE + MALLOC_ALIGNMENT - 1) / MALLOC_ALIGNMENT;
+}
+
+/// The size of the chunk that serves malloc(request), like glibc's request2size().
+constexpr inline size_t request2size(size_t request) {
+    return (request + sizeof(size_t) + MALLOC_ALIGNMENT - 1 < MIN_CHUNK_SIZE)
+               ? MIN_CHUNK_SIZE
+               : (request + sizeof(size_t) + MALLOC_ALIGNMENT - 1) & ~(MALLOC_ALIGNMENT - 1);
+}
+
+/// The tcache bin that serves malloc(request), like glibc's request2size() + csize2tidx().
+constexpr inline size_t request2tidx(size_t request) {
+    return csize2tidx(request2size(request));
+}
+
+/// The fastbin of a chunk of the given size, like glibc's fastbin_index().
+/// Chunks that are too large for any fastbin give NFASTBINS.
+constexpr inline size_t csize2fidx(size_t chunksize) {
+    return (chunksize >> 4) - 2 < NFASTBINS ? (chunksize >> 4) - 2 : NFASTBINS;
+}
+
+/// The smallbin or largebin of a chunk of the given size, like glibc's bin_index() on 64 bit.
+/// Bin 1 is the unsorted bin, the smallbins are 2 to 63, and the largebins 64 to 126.
+constexpr inline size_t csize2bidx(size_t chunksize) {
+    return chunksize < MIN_LARGE_SIZE  ? chunksize >> 4
+           : (chunksize >> 6) <= 48    ? 48 + (chunksize >> 6)
+           : (chunksize >> 9) <= 20    ? 91 + (chunksize >> 9)
+           : (chunksize >> 12) <= 10   ? 110 + (chunksize >> 12)
+           : (chunksize >> 15) <= 4    ? 119 + (chunksize >> 15)
+           : (chunksize >> 18) <= 2    ? 124 + (chunksize >> 18)
+                                       : 126;
+}
+
 struct AR_MAIN {
     __libc_lock_t mutex;
     int flags;
@@ -82,20 +198,36 @@ struct GLIBC_INFO {
 struct ARENA_INFO {
     AR_MAIN* arena;  // the RVA of the main_arena
     AR_MAIN** next;  // Pointer to next arena
+    CHUNKPTR** fastbins;  // the RVA of the fastbins
     CHUNKPTR** topchunk;  // the RVA of the topchunk
     CHUNKPTR** last_remainder;  // the RVA of the last remainder
     CHUNKPTR** unsorted_bin;  // the RVA of the unsorted_bin
+    CHUNKPTR** bins;  // the RVA of the bins, starting with the unsorted_bin
+    unsigned int* binmap;  // the RVA of the binmap
     /// The RVA of the thread local cache -- but take care to cast the layout in 2.30+!
     struct tcache_perthread_struct* tcache;
     int valid = 0;  // true if lglibc_info is valid and arena-test was successful
     GLIBC_INFO version;  // glibc info
     ARENA_INFO(GLIBC_INFO libc_info, AR_MAIN* arena);
+    /// Another arena of the same glibc as the main arena, e.g. found via its `next` ring.
+    ARENA_INFO(ARENA_INFO const& main_arena, AR_MAIN* arena);
 };
 
 namespace malloc_leak {
 void* test_tcache(HookInfo& hook);
+struct tcache_perthread_struct* tcache_of(void* tcache_present);
+struct tcache_perthread_struct* leak_tcache(GLIBC_INFO const& libc_info, HookInfo& hook);
 AR_MAIN* leak_arena(GLIBC_INFO* libc_info, HookInfo& hook);
 ARENA_INFO* get_arenainfo(HookInfo& hook);
+AR_MAIN** leak_thread_arena(AR_MAIN* arena);
+
+/// The thread pointer of the calling thread.
+/// The TLS block of libc lies at the same offset from it in every thread.
+inline char* thread_pointer() {
+    char* pointer;
+    asm("mov %%fs:0, %0" : "=r"(pointer));
+    return pointer;
+}
 }  // namespace malloc_leak
 
 
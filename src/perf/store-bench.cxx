@@ -0,0 +1,105 @@
+#include "../common/spinlock.h"
+#include "../store/CachedMetaStore.h"
+#include "../store/HashMetaStore.h"
+#include "../store/ShardedMetaStore.h"
+#include "../store/ThreadLocalMetaStore.h"
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Multi-threaded throughput benchmark for the metadata stores.
+// Every thread works on its own range of chunk pointers,
+// so that all contention is caused by the store itself.
+//
+// Output: one CSV line per store, with the throughput in Mops/s
+// for 1, 2, 4, ..., 64 threads.
+
+constexpr size_t LIVE_CHUNKS_PER_THREAD = 4096;
+constexpr size_t ROUNDS = 16;
+constexpr size_t MAX_THREADS = 64;
+
+/// The baseline: a single store serialized behind one lock.
+class GlobalLockMetaStore {
+    SpinLock lock;
+    CachedMetaStore<HashMetaStore> store;
+
+public:
+    bool put(MALLOC_META chunk) {
+        std::lock_guard<SpinLock> guard{ lock };
+        return store.put(chunk);
+    }
+
+    MALLOC_META get(void* key) {
+        std::lock_guard<SpinLock> guard{ lock };
+        return store.get(key);
+    }
+
+    bool remove(MALLOC_META key) {
+        std::lock_guard<SpinLock> guard{ lock };
+        return store.remove(key);
+    }
+};
+
+template <class Store>
+void worker(Store& store, size_t thread_i, size_t& errors) {
+    auto make_chunk = [thread_i](size_t i) -> MALLOC_META {
+        auto base = (thread_i + 1) << 32;
+        return { (void*)(base + 16 * (i + 1)), 32 + 16 * (i % 64) };
+    };
+
+    for (size_t round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < LIVE_CHUNKS_PER_THREAD; i++)
+            errors += !store.put(make_chunk(i));
+        for (size_t i = 0; i < LIVE_CHUNKS_PER_THREAD; i++)
+            errors += store.get(make_chunk(i).ptr) != make_chunk(i);
+        for (size_t i = 0; i < LIVE_CHUNKS_PER_THREAD; i++)
+            errors += !store.remove(make_chunk(i));
+    }
+}
+
+/// Returns the throughput in million operations per second.
+template <class Store>
+double run(size_t threads) {
+    Store store;
+    std::vector<std::thread> pool;
+    std::vector<size_t> errors(threads);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < threads; t++)
+        pool.emplace_back([&store, &errors, t] { worker(store, t, errors[t]); });
+    for (auto& thread : pool)
+        thread.join();
+    auto end = std::chrono::steady_clock::now();
+
+    for (auto e : errors)
+        if (e) std::fprintf(stderr, "store-bench: %zu failed operations\n", e);
+
+    double ops = 3.0 * ROUNDS * LIVE_CHUNKS_PER_THREAD * threads;
+    double seconds = std::chrono::duration<double>(end - start).count();
+    return ops / seconds / 1e6;
+}
+
+template <class Store>
+void run_all(const char* name) {
+    std::printf("%s", name);
+    for (size_t threads = 1; threads <= MAX_THREADS; threads *= 2)
+        std::printf(",%f", run<Store>(threads));
+    std::printf("\n");
+    std::fflush(stdout);
+}
+
+int main() {
+    std::printf("store");
+    for (size_t threads = 1; threads <= MAX_THREADS; threads *= 2)
+        std::printf(",%zu", threads);
+    std::printf("\n");
+
+    run_all<GlobalLockMetaStore>("global-lock");
+    run_all<ShardedMetaStore<HashMetaStore>>("sharded");
+    run_all<ThreadLocalMetaStore<HashMetaStore>>("threadlocal");
+
+    return 0;
+}
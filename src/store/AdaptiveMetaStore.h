@@ -0,0 +1,164 @@
+#pragma once
+
+#include "CachedMetaStore.h"
+#include "HashMetaStore.h"
+#include "ShadowMetaStore.h"
+#include "VectorMetaStore.h"
+#include "metastore.h"
+
+#include <memory>
+
+/// A store that switches its representation with the number of live chunks.
+///
+/// Small heaps are kept in a VectorMetaStore, which is just a linear scan over a few entries.
+/// Medium heaps move into a CachedMetaStore, and large heaps into a direct-mapped
+/// ShadowMetaStore. When the heap shrinks again, the entries move back down.
+/// The thresholds for moving down are a quarter of those for moving up,
+/// so that a heap at the edge of a tier doesn't migrate back and forth.
+template <class Allocator = std::allocator<MALLOC_META>>
+class AdaptiveMetaStore : public IMetaStore {
+public:
+    enum class Tier { Vector, Cached, Shadow };
+
+    /// Move from the vector to the cached hash table above this many entries.
+    static constexpr size_t VECTOR_MAX_ENTRIES = 32;
+    /// Move from the cached hash table to the shadow above this many entries.
+    static constexpr size_t CACHED_MAX_ENTRIES = 64 * 1024;
+    static constexpr size_t HYSTERESIS = 4;
+
+private:
+    Tier tier = Tier::Vector;
+    /// The store doesn't move below the tier that was selected by reserve().
+    Tier minimum_tier = Tier::Vector;
+
+    VectorMetaStore<Allocator> vector_store;
+    CachedMetaStore<HashMetaStore, Allocator> cached_store;
+    ShadowMetaStore<HashMetaStore, Allocator> shadow_store;
+
+    /// Call `fn(store)` with the store of the current tier.
+    template <class F>
+    auto visit(F&& fn) -> decltype(fn(vector_store)) {
+        switch (tier) {
+        case Tier::Vector: return fn(vector_store);
+        case Tier::Cached: return fn(cached_store);
+        default: return fn(shadow_store);
+        }
+    }
+
+    static Tier tier_for(size_t entries) noexcept {
+        if (entries <= VECTOR_MAX_ENTRIES) return Tier::Vector;
+        if (entries <= CACHED_MAX_ENTRIES) return Tier::Cached;
+        return Tier::Shadow;
+    }
+
+    /// Check the thresholds after the store has grown.
+    void after_put() {
+        auto limit = tier == Tier::Vector ? VECTOR_MAX_ENTRIES : CACHED_MAX_ENTRIES;
+        if (UNLIKELY(tier != Tier::Shadow && size() > limit)) migrate(tier_for(size()));
+    }
+
+    /// Check the thresholds after the store has shrunk.
+    void after_remove() {
+        if (LIKELY(tier == minimum_tier)) return;
+        auto limit = tier == Tier::Cached ? VECTOR_MAX_ENTRIES : CACHED_MAX_ENTRIES;
+        if (UNLIKELY(size() * HYSTERESIS < limit)) {
+            auto target = tier_for(size());
+            migrate(target < minimum_tier ? minimum_tier : target);
+        }
+    }
+
+    /// Move all entries into the store of another tier, and release the old store.
+    void migrate(Tier target) __attribute__((noinline)) {
+        if (target == tier) return;
+
+        auto entries = size();
+        auto move_into = [&](IMetaStore& destination) {
+            destination.reserve(entries);
+            visit([&](auto& source) {
+                source.for_each([&](MALLOC_META chunk) { destination.put(chunk); });
+                source.clear();
+            });
+        };
+
+        switch (target) {
+        case Tier::Vector: move_into(vector_store); break;
+        case Tier::Cached: move_into(cached_store); break;
+        case Tier::Shadow: move_into(shadow_store); break;
+        }
+        tier = target;
+    }
+
+public:
+    AdaptiveMetaStore() {
+    }
+
+    ~AdaptiveMetaStore() {
+    }
+
+    /// The representation that is currently used.
+    Tier current_tier() const noexcept {
+        return tier;
+    }
+
+    bool put(MALLOC_META chunk) {
+        auto inserted = visit([&](auto& store) { return store.put(chunk); });
+        after_put();
+        return inserted;
+    }
+
+    size_t put_many(MALLOC_META const* chunks, size_t count) {
+        // migrate up front, instead of in the middle of the batch
+        if (tier_for(size() + count) > tier) migrate(tier_for(size() + count));
+        return visit([&](auto& store) { return store.put_many(chunks, count); });
+    }
+
+    MALLOC_META get(void* key) {
+        return visit([&](auto& store) { return store.get(key); });
+    }
+
+    bool remove(MALLOC_META key) {
+        auto removed = visit([&](auto& store) { return store.remove(key); });
+        if (LIKELY(removed)) after_remove();
+        return removed;
+    }
+
+    size_t remove_many(MALLOC_META const* keys, size_t count) {
+        auto removed = visit([&](auto& store) { return store.remove_many(keys, count); });
+        after_remove();
+        return removed;
+    }
+
+    MALLOC_META take_if_matches(void* key, MALLOC_META expected) {
+        auto stored = visit([&](auto& store) { return store.take_if_matches(key, expected); });
+        if (LIKELY(stored == expected)) after_remove();
+        return stored;
+    }
+
+    bool update(MALLOC_META key) {
+        return visit([&](auto& store) { return store.update(key); });
+    }
+
+    size_t size() {
+        return visit([](auto& store) { return store.size(); });
+    }
+
+    /// Select the tier for the requested number of entries, and keep at least that tier.
+    void reserve(size_t request) {
+        auto target = tier_for(request);
+        if (target > minimum_tier) minimum_tier = target;
+        if (minimum_tier > tier) migrate(minimum_tier);
+        visit([&](auto& store) { store.reserve(request); });
+    }
+
+    void clear() override {
+        visit([](auto& store) { store.clear(); });
+        tier = minimum_tier;
+    }
+
+    StoreStats statistics() override {
+        return visit([](auto& store) { return store.statistics(); });
+    }
+
+    template <template <class V> class A>
+    using with_allocator = AdaptiveMetaStore<A<MALLOC_META>>;
+};
@@ -5,8 +5,12 @@
 
 #include <array>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <memory>
-#include <vector>
+#include <type_traits>
+#include <utility>
 
 namespace details {
 /// A fast but very good hash function for 64-bit values.
@@ -24,28 +28,242 @@ inline size_t hash(void* ptr) noexcept {
     return x;
 }
 
+/// Whether an allocator can resize an allocation via `reallocate(p, oldn, newn)`.
+template <class Allocator, class = void>
+struct has_reallocate : std::false_type {};
+
 template <class Allocator>
+struct has_reallocate<
+    Allocator,
+    decltype(void(std::declval<Allocator&>().reallocate(nullptr, 0, 0)))> : std::true_type {};
+
+/// A fixed number of bins in manually managed storage.
+///
+/// Unlike a std::vector, the bins are not necessarily initialized on allocation,
+/// so that an incremental rehash can defer that work as well.
+///
+/// Bins that are aligned beyond what allocators guarantee, like cache-line aligned bins,
+/// get one more bin of padding, in which the table is moved up to the next aligned address.
+template <class Bin, class Allocator>
+class BinTable {
+    using BinAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Bin>;
+
+    static constexpr size_t PADDING = alignof(Bin) > alignof(std::max_align_t) ? 1 : 0;
+
+    /// the allocation, which holds `count + PADDING` bins
+    Bin* storage = nullptr;
+    Bin* data = nullptr;
+    size_t count = 0;
+
+    static Bin* align(Bin* p) noexcept {
+        constexpr uintptr_t mask = alignof(Bin) - 1;
+        return reinterpret_cast<Bin*>((reinterpret_cast<uintptr_t>(p) + mask) & ~mask);
+    }
+
+    /// Align the table in a `storage` that holds the first `n` bins at byte `offset`.
+    void align_moved(size_t offset, size_t n) noexcept {
+        data = align(storage);
+        auto moved = reinterpret_cast<char*>(storage) + offset;
+        if (moved != reinterpret_cast<char*>(data))
+            std::memmove(static_cast<void*>(data), moved, n * sizeof(Bin));
+    }
+
+    size_t offset() const noexcept {
+        return reinterpret_cast<char*>(data) - reinterpret_cast<char*>(storage);
+    }
+
+public:
+    BinTable() noexcept {
+    }
+
+    /// Allocate `count` bins, which are zeroed unless requested otherwise.
+    explicit BinTable(size_t count, bool zeroed = true) : count(count) {
+        BinAllocator alloc;
+        storage = alloc.allocate(count + PADDING);  // may throw
+        data = align(storage);
+        if (zeroed) zero(0, count);
+    }
+
+    BinTable(BinTable const&) = delete;
+
+    BinTable(BinTable&& other) noexcept : storage(other.storage), data(other.data), count(other.count) {
+        other.storage = nullptr;
+        other.data = nullptr;
+        other.count = 0;
+    }
+
+    BinTable& operator=(BinTable&& other) noexcept {
+        std::swap(storage, other.storage);
+        std::swap(data, other.data);
+        std::swap(count, other.count);
+        return *this;
+    }
+
+    ~BinTable() {
+        release();
+    }
+
+    void release() noexcept {
+        if (!storage) return;
+        BinAllocator alloc;
+        alloc.deallocate(storage, count + PADDING);
+        storage = nullptr;
+        data = nullptr;
+        count = 0;
+    }
+
+    size_t size() const noexcept {
+        return count;
+    }
+
+    bool empty() const noexcept {
+        return count == 0;
+    }
+
+    Bin& operator[](size_t i) noexcept {
+        return data[i];
+    }
+
+    Bin* begin() noexcept {
+        return data;
+    }
+
+    Bin* end() noexcept {
+        return data + count;
+    }
+
+    void zero(size_t first, size_t n) noexcept {
+        std::memset(static_cast<void*>(data + first), 0, n * sizeof(Bin));
+    }
+
+    /// Grow to `newcount` bins, keeping the existing bins and zeroing the new ones.
+    void grow(size_t newcount) {
+        grow(newcount, has_reallocate<BinAllocator>{});
+    }
+
+    /// Shrink to the first `newcount` bins, giving the rest back to the allocator.
+    void shrink(size_t newcount) {
+        shrink(newcount, has_reallocate<BinAllocator>{});
+    }
+
+private:
+    void grow(size_t newcount, std::false_type) {
+        BinTable bigger(newcount, false);  // may throw
+        std::memcpy(static_cast<void*>(bigger.data), data, count * sizeof(Bin));
+        bigger.zero(count, newcount - count);
+        std::swap(*this, bigger);
+    }
+
+    /// The allocator can resize without copying, e.g. via mremap().
+    /// The new allocation may be aligned differently, then the bins are moved within it.
+    void grow(size_t newcount, std::true_type) {
+        if (UNLIKELY(!storage)) return grow(newcount, std::false_type{});
+        BinAllocator alloc;
+        auto old_offset = offset();
+        storage = alloc.reallocate(storage, count + PADDING, newcount + PADDING);  // may throw
+        align_moved(old_offset, count);
+        zero(count, newcount - count);
+        count = newcount;
+    }
+
+    void shrink(size_t newcount, std::false_type) {
+        BinTable smaller(newcount, false);  // may throw
+        std::memcpy(static_cast<void*>(smaller.data), data, newcount * sizeof(Bin));
+        std::swap(*this, smaller);
+    }
+
+    /// The allocator unmaps the tail, so the pages go straight back to the OS.
+    void shrink(size_t newcount, std::true_type) {
+        BinAllocator alloc;
+        auto old_offset = offset();
+        storage = alloc.reallocate(storage, count + PADDING, newcount + PADDING);  // may throw
+        align_moved(old_offset, newcount);
+        count = newcount;
+    }
+};
+
+/// Hash map with a fixed number of entries per bin.
+///
+/// Every key has two candidate bins, selected by the hash and by the rotated hash.
+/// If both are full, one entry is displaced into its other bin (one level of cuckoo hashing),
+/// or the key goes into a small stash. Only if all of that fails
+/// is an entry evicted, so that it has to be stored elsewhere.
+///
+/// If `Incremental` is set, growing the table doesn't migrate all bins at once.
+/// Instead, the old and new tables are kept side by side,
+/// and every put/remove migrates a few old bins.
+///
+/// Once the table is less than 1/SHRINK_THRESHOLD full, it is halved (incrementally, if set).
+/// Entries that don't fit into the smaller table go to the stash,
+/// or are handed to the overflow handler.
+template <class Allocator, bool Incremental = false>
 class ResizeableHashMap {
 public:
     static constexpr size_t ENTRIES_PER_BIN = 4;
     using Bin = std::array<MALLOC_META, ENTRIES_PER_BIN>;
 
+    /// Number of old bins migrated per operation during an incremental rehash.
+    /// The table only grows once it holds as many entries as it has slots,
+    /// so a migration of capacity/4 bins completes long before the next one starts.
+    static constexpr size_t MIGRATION_STEP = 4;
+
+    /// Number of entries that can overflow from full bins before entries are evicted.
+    static constexpr size_t STASH_SIZE = 8;
+
+    /// The table is halved when it is less than 1/8 full,
+    /// so that it is at most 1/4 full afterwards and won't grow again soon.
+    static constexpr size_t SHRINK_THRESHOLD = 8;
+
+    /// Receives entries that have no place in the table after shrinking.
+    /// It is called during migrations, which must not fail, so it MUST NOT throw.
+    using OverflowHandler = void (*)(void* context, MALLOC_META entry);
+
 private:
     static constexpr size_t TYPICAL_CACHE_LINE_SIZE = 64;
     static_assert(sizeof(Bin) <= TYPICAL_CACHE_LINE_SIZE, "each bin should fit into a cache line");
 
-    std::vector<Bin, Allocator> bins;
+    /// Marks an old bin as migrated. Never a valid chunk pointer.
+    static constexpr uintptr_t MIGRATED = 1;
+
+    BinTable<Bin, Allocator> bins;
+
+    // only used during an incremental rehash
+    BinTable<Bin, Allocator> old_bins;
+    size_t migration_cursor = 0;
+    bool shrinking = false;
+
+    /// The table never shrinks below its initial or reserved size.
+    size_t minimum_bins;
+
+    OverflowHandler overflow_handler = nullptr;
+    void* overflow_context = nullptr;
+
+    std::array<MALLOC_META, STASH_SIZE> stash{};
+    size_t stash_entries = 0;
 
 public:
+    /// probe lengths, bin fill, displacements, stash inserts and rehashes
+    StoreStatsCounter stats;
+
     /// capacity MUST be a power of 2 and MUST be at least ENTRIES_PER_BIN.
-    ResizeableHashMap(size_t capacity) : bins(capacity / ENTRIES_PER_BIN) {
+    ResizeableHashMap(size_t capacity)
+        : bins(capacity / ENTRIES_PER_BIN), minimum_bins(capacity / ENTRIES_PER_BIN) {
         assert(/* minimum capacity is 1 bin */ capacity >= ENTRIES_PER_BIN);
         assert(/* is power of 2, i.e. single bit is set */ __builtin_popcount(capacity) == 1);
     }
     ~ResizeableHashMap() {
     }
 
-    /// Retrieve the correct bin by hash.
+    bool is_migrating() const noexcept {
+        return Incremental && !old_bins.empty();
+    }
+
+    /// The hash that selects the alternate bin of a key.
+    static size_t alternate_hash(size_t raw_hash) noexcept {
+        return (raw_hash >> 32) | (raw_hash << 32);
+    }
+
+    /// Retrieve the primary bin by hash.
     Bin& get_bin(void* key) noexcept {
         assert(!bins.empty());
         auto mask = bins.size() - 1;  // assuming cache size is power of 2
@@ -55,32 +273,98 @@ public:
 
     /// Find an entry using the key, may be NULL if no such entry exists.
     MALLOC_META* get_entry(void* key) noexcept {
-        for (auto& entry : get_bin(key))
-            if (__builtin_expect(entry.ptr == key, 0)) return &entry;
+        return get_entry(key, hash(key));
+    }
+
+    MALLOC_META* get_entry(void* key, size_t raw_hash) noexcept {
+        for (auto& entry : current_bin(raw_hash)) {
+            if (__builtin_expect(entry.ptr == key, 0)) {
+                stats.probe(1);
+                return &entry;
+            }
+        }
+
+        for (auto& entry : current_bin(alternate_hash(raw_hash))) {
+            if (__builtin_expect(entry.ptr == key, 0)) {
+                stats.probe(2);
+                return &entry;
+            }
+        }
+
+        // the stash counts as a third bin
+        if (UNLIKELY(stash_entries)) {
+            stats.probe(3);
+            for (auto& entry : stash)
+                if (entry.ptr == key) return &entry;
+        } else {
+            stats.probe(2);
+        }
+
         return nullptr;
     }
 
     /// Find an entry for insertion of a new value,
     /// may contain an old value that must first be evicted.
     MALLOC_META& get_insertion_point(void* key) noexcept {
-        auto raw_hash = hash(key);
-        auto mask = bins.size() - 1;  // assuming cache size is power of 2
-        auto& bin = bins[raw_hash & mask];
-        for (auto& entry : bin)
-            if (__builtin_expect(entry.ptr == nullptr, 0)) return entry;
+        return get_insertion_point(key, hash(key));
+    }
 
-        // If there is no empty entry, select one entry at random.
-        // The leftmost N bits of the hash should be unused,
-        // so take them as an RNG.
-        static_assert(sizeof(decltype(raw_hash)) == sizeof(uint64_t), "hash must be a 64 bit number");
-        constexpr auto entry_mask = ENTRIES_PER_BIN - 1;
-        auto entry_i = (raw_hash >> (64 - __builtin_popcount(entry_mask))) & entry_mask;
-        return bin[entry_i];
+    MALLOC_META& get_insertion_point(void*, size_t raw_hash) noexcept {
+        if (UNLIKELY(is_migrating())) advance_migration();
+
+        auto& primary = insertion_bin(raw_hash);
+        if (stats.enabled) stats.bin_fill(count_occupied(primary));
+        if (auto entry = find_empty(primary)) return *entry;
+
+        auto alternate_raw_hash = alternate_hash(raw_hash);
+        auto& alternate = insertion_bin(alternate_raw_hash);
+        if (auto entry = find_empty(alternate)) return *entry;
+
+        // both bins are full, try to make space
+        return make_space(primary, raw_hash, alternate, alternate_raw_hash);
+    }
+
+    /// Prefetch the primary bin of a key, for batched operations.
+    void prefetch(size_t raw_hash) noexcept {
+        __builtin_prefetch(&current_bin(raw_hash), 1);
+    }
+
+    /// Clear an entry that was returned by get_entry().
+    void erase(MALLOC_META& entry) noexcept {
+        entry = {};
+        if (UNLIKELY(&entry >= stash.begin() && &entry < stash.end())) --stash_entries;
+    }
+
+    /// Set the receiver of entries that are dropped while shrinking.
+    /// Without a handler, such entries are lost.
+    void on_overflow(OverflowHandler handler, void* context) noexcept {
+        overflow_handler = handler;
+        overflow_context = context;
+    }
+
+    /// Migrate a bounded number of old bins, if a rehash is in progress.
+    void advance_migration() noexcept {
+        if (LIKELY(!is_migrating())) return;
+
+        for (size_t step = 0; step < MIGRATION_STEP; step++) {
+            if (migration_cursor == old_bins.size()) break;
+            migrate_bin(migration_cursor++);
+        }
+
+        if (migration_cursor == old_bins.size()) {
+            old_bins.release();
+            migration_cursor = 0;
+        }
     }
 
     void clear() {
-        for (auto& bin : bins)
-            bin = {};
+        old_bins.release();
+        migration_cursor = 0;
+        shrinking = false;
+        bins.zero(0, bins.size());
+        stash = {};
+        stash_entries = 0;
+        stats.reset();
     }
 
     size_t capacity() const {
@@ -100,10 +384,243 @@ public:
             newcap *= 2;
         }
 
-        reserve_double(factor);
+        stats.rehash();
+        if (Incremental)
+            start_migration(factor);
+        else
+            reserve_double(factor);
+    }
+
+    /// Grow to at least `request` entries, and never shrink below that.
+    void reserve(size_t request) {
+        ensure_capacity(request);
+        if (bins.size() * ENTRIES_PER_BIN >= request && bins.size() > minimum_bins)
+            minimum_bins = bins.size();
+    }
+
+    /// Call `fn(entry)` for every entry in the table and the stash.
+    /// Completes a pending migration first.
+    template <class F>
+    void for_each(F&& fn) {
+        if (is_migrating()) finish_migration();
+        for (auto& bin : bins)
+            for (auto& entry : bin)
+                if (entry.ptr != nullptr) fn(entry);
+        if (UNLIKELY(stash_entries))
+            for (auto& entry : stash)
+                if (entry.ptr != nullptr) fn(entry);
+    }
+
+    /// Halve the table if it holds less than 1/SHRINK_THRESHOLD of its capacity.
+    /// `entries` is the number of entries that the table is responsible for.
+    void maybe_shrink(size_t entries) {
+        if (LIKELY(entries * SHRINK_THRESHOLD >= capacity())) return;
+        if (bins.size() <= minimum_bins || is_migrating()) return;
+
+        if (Incremental)
+            start_shrink();
+        else
+            shrink_in_place();
     }
 
 private:
+    static bool is_migrated(Bin& old_bin) noexcept {
+        return reinterpret_cast<uintptr_t>(old_bin[0].ptr) == MIGRATED;
+    }
+
+    static MALLOC_META* find_empty(Bin& bin) noexcept {
+        for (auto& entry : bin)
+            if (__builtin_expect(entry.ptr == nullptr, 0)) return &entry;
+        return nullptr;
+    }
+
+    static size_t count_occupied(Bin& bin) noexcept {
+        size_t occupied = 0;
+        for (auto& entry : bin)
+            occupied += entry.ptr != nullptr;
+        return occupied;
+    }
+
+    /// The hash by which an entry was placed into the bin `bin_i` of a table with `mask`.
+    static size_t placement_hash(MALLOC_META& entry, size_t bin_i, size_t mask) noexcept {
+        auto raw_hash = hash(entry.ptr);
+        return (raw_hash & mask) == bin_i ? raw_hash : alternate_hash(raw_hash);
+    }
+
+    /// The bin for a hash, in whichever table currently holds it.
+    /// During migration, the new bin may not even be initialized yet.
+    Bin& current_bin(size_t raw_hash) noexcept {
+        if (UNLIKELY(is_migrating())) {
+            auto& old_bin = old_bins[raw_hash & (old_bins.size() - 1)];
+            if (!is_migrated(old_bin)) return old_bin;
+        }
+        return bins[raw_hash & (bins.size() - 1)];
+    }
+
+    /// The bin for a hash in the new table.
+    /// New entries always go into the new table, so the old bin must be migrated first.
+    Bin& insertion_bin(size_t raw_hash) noexcept {
+        if (UNLIKELY(is_migrating())) migrate_bin(raw_hash & (old_bins.size() - 1));
+        return bins[raw_hash & (bins.size() - 1)];
+    }
+
+    /// Try to move one entry of a full bin into its other bin.
+    /// Returns the entry that was freed, or NULL.
+    MALLOC_META* displace(Bin& bin, size_t bin_raw_hash) noexcept {
+        const auto mask = bins.size() - 1;
+        const auto bin_i = bin_raw_hash & mask;
+        for (auto& entry : bin) {
+            auto raw_hash = hash(entry.ptr);
+            auto other = (raw_hash & mask) == bin_i ? alternate_hash(raw_hash) : raw_hash;
+            if ((other & mask) == bin_i) continue;
+
+            if (auto target = find_empty(insertion_bin(other))) {
+                std::swap(*target, entry);
+                stats.displacement();
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    MALLOC_META& make_space(
+        Bin& primary, size_t raw_hash, Bin& alternate, size_t alternate_raw_hash) noexcept
+        __attribute__((noinline)) {
+        if (auto entry = displace(primary, raw_hash)) return *entry;
+        if (auto entry = displace(alternate, alternate_raw_hash)) return *entry;
+
+        if (stash_entries < STASH_SIZE) {
+            ++stash_entries;
+            stats.stash_insert();
+            return *find_empty_in_stash();
+        }
+
+        // If there is no space anywhere, select one entry at random.
+        // The leftmost N bits of the hash should be unused,
+        // so take them as an RNG.
+        static_assert(sizeof(decltype(raw_hash)) == sizeof(uint64_t), "hash must be a 64 bit number");
+        constexpr auto entry_mask = ENTRIES_PER_BIN - 1;
+        auto entry_i = (raw_hash >> (64 - __builtin_popcount(entry_mask))) & entry_mask;
+        return primary[entry_i];
+    }
+
+    /// Find a new place for an entry that didn't fit into its bin of the smaller table.
+    void place_overflow(MALLOC_META entry) noexcept {
+        if (stash_entries < STASH_SIZE) {
+            ++stash_entries;
+            stats.stash_insert();
+            *find_empty_in_stash() = entry;
+        } else if (overflow_handler) {
+            overflow_handler(overflow_context, entry);
+        }
+    }
+
+    MALLOC_META* find_empty_in_stash() noexcept {
+        for (auto& entry : stash)
+            if (entry.ptr == nullptr) return &entry;
+        return nullptr;
+    }
+
+    /// Move stashed entries back into the table, after it has grown.
+    void rehome_stash() noexcept {
+        if (LIKELY(!stash_entries)) return;
+
+        for (auto& entry : stash) {
+            if (entry.ptr == nullptr) continue;
+            auto raw_hash = hash(entry.ptr);
+            auto target = find_empty(insertion_bin(raw_hash));
+            if (!target) target = find_empty(insertion_bin(alternate_hash(raw_hash)));
+            if (!target) continue;
+
+            std::swap(*target, entry);
+            --stash_entries;
+        }
+    }
+
+    /// Move all entries of an old bin into the new table.
+    ///
+    /// The new bins `old_i + k * old_bins.size()` can only receive entries from this old bin,
+    /// regardless of whether the entries were placed by their primary or alternate hash.
+    /// They are not touched before this bin was migrated,
+    /// so they can be initialized here and will always have space for the entries.
+    ///
+    /// When shrinking, two old bins are merged into one new bin,
+    /// which was zeroed up front and may run out of space.
+    void migrate_bin(size_t old_i) noexcept {
+        auto& old_bin = old_bins[old_i];
+        if (is_migrated(old_bin)) return;
+
+        const auto oldsize = old_bins.size();
+        if (!shrinking)
+            for (size_t target_i = old_i; target_i < bins.size(); target_i += oldsize)
+                bins.zero(target_i, 1);
+
+        const auto oldmask = oldsize - 1;
+        const auto newmask = bins.size() - 1;
+        for (auto& entry : old_bin) {
+            if (entry.ptr == nullptr) continue;
+            auto target_i = placement_hash(entry, old_i, oldmask) & newmask;
+            if (auto target = find_empty(bins[target_i]))
+                *target = entry;
+            else
+                place_overflow(entry);
+        }
+
+        old_bin = {};
+        old_bin[0].ptr = reinterpret_cast<void*>(MIGRATED);
+    }
+
+    void finish_migration() noexcept {
+        while (migration_cursor < old_bins.size())
+            migrate_bin(migration_cursor++);
+        old_bins.release();
+        migration_cursor = 0;
+    }
+
+    /// Allocate the new table, but defer moving the entries.
+    void start_migration(size_t factor) __attribute__((noinline)) {
+        // a previous migration must be completed first
+        if (is_migrating()) finish_migration();
+
+        BinTable<Bin, Allocator> newbins(factor * bins.size(), false);  // may throw
+        old_bins = std::move(newbins);
+        std::swap(bins, old_bins);
+        migration_cursor = 0;
+        shrinking = false;
+
+        rehome_stash();
+    }
+
+    /// Allocate a table of half the size, but defer moving the entries.
+    /// The old table is released once all bins were migrated.
+    void start_shrink() __attribute__((noinline)) {
+        BinTable<Bin, Allocator> newbins(bins.size() / 2);  // may throw
+        old_bins = std::move(newbins);
+        std::swap(bins, old_bins);
+        migration_cursor = 0;
+        shrinking = true;
+        stats.shrink();
+    }
+
+    /// Merge the upper half of the bins into the lower half, and release the upper half.
+    ///
+    /// Halving the table only drops the highest bit of the bin index,
+    /// so the entries of bin `i + newsize` move into bin `i`, and no other entry moves.
+    void shrink_in_place() __attribute__((noinline)) {
+        const auto newsize = bins.size() / 2;
+        for (size_t bin_i = newsize; bin_i < bins.size(); ++bin_i) {
+            for (auto& entry : bins[bin_i]) {
+                if (entry.ptr == nullptr) continue;
+                if (auto target = find_empty(bins[bin_i - newsize]))
+                    *target = entry;
+                else
+                    place_overflow(entry);
+            }
+        }
+        bins.shrink(newsize);  // may throw
+        stats.shrink();
+    }
+
     /// factor MUST be a multiple of 2
     ///
     /// Why noinline? Because calling this function has some stack overhead
@@ -114,7 +631,8 @@ private:
         const auto newsize = factor * oldsize;
 
         assert(newsize > oldsize);
-        bins.resize(newsize);  // may throw
+        bins.grow(newsize);  // may throw
+        const auto oldmask = oldsize - 1;
         const auto newmask = newsize - 1;
 
         // the existing elements may have to be moved to a new location
@@ -127,8 +645,8 @@ private:
                 auto& entry = bins[bin_i][entry_i];
                 if (__builtin_expect(entry.ptr == nullptr, 0)) continue;
 
-                const auto raw_hash = hash(entry.ptr);
-                const auto newbin_i = raw_hash & newmask;
+                // the entry keeps using the hash by which it was placed
+                const auto newbin_i = placement_hash(entry, bin_i, oldmask) & newmask;
 
                 // when doubling the size, there's a 50% chance of staying in the bin
                 if (__builtin_expect(bin_i == newbin_i, 0)) continue;
@@ -136,7 +654,7 @@ private:
                 // Move the entry to a new bin.
                 // It is guaranteed that the new bin `bins[newi]` will contain space:
                 // The bin index is determined by bitmasks,
-                // so that `i` and `newi` differ by at most one bit (the size was doubled).
+                // so that `i` and `newi` differ only in the new high bits.
                 // Consequently, only entries from the `i` bin can be moved to `newi`.
 
                 // Also, it is guaranteed that the first entry of the target bin will be empty.
@@ -153,33 +671,52 @@ private:
                 }
             }
         }
+
+        rehome_stash();
     }
 };
 }  // namespace details
 
-template <template <class A> class FallbackStore = MapMetaStore, class Allocator = typename std::allocator<MALLOC_META>>
+/// A ResizeableHashMap in front of a FallbackStore for entries evicted from full bins.
+/// Evictions only happen once cuckoo displacement and the stash failed,
+/// and are counted so that they can be reported.
+///
+/// The cache shrinks again once most entries were removed, e.g. after a peak of allocations.
+///
+/// With `IncrementalRehash`, growing or shrinking the cache is spread over subsequent put/remove
+/// calls instead of stalling a single malloc().
+template <
+    template <class A> class FallbackStore = MapMetaStore,
+    class Allocator = typename std::allocator<MALLOC_META>,
+    bool IncrementalRehash = false>
 class CachedMetaStore : public IMetaStore {
+    /// Number of keys that are hashed and prefetched at once by the batched operations.
+    static constexpr size_t BATCH_SIZE = 16;
+
     size_t cache_entries = 0;
-    details::ResizeableHashMap<Allocator> cache;
+    size_t evictions = 0;
+    details::ResizeableHashMap<Allocator, IncrementalRehash> cache;
     FallbackStore<Allocator> fallback_store;
+    StoreStatsCounter stats;
 
     // assuming that capacity is power of 2
     CachedMetaStore(size_t capacity) : cache(capacity) {
+        cache.on_overflow(&CachedMetaStore::evict_overflow, this);
     }
 
-public:
-    CachedMetaStore() : CachedMetaStore(128) {
-    }
-
-    ~CachedMetaStore() {
+    /// An entry didn't fit into the cache after it shrank.
+    static void evict_overflow(void* context, MALLOC_META entry) noexcept {
+        auto self = static_cast<CachedMetaStore*>(context);
+        --self->cache_entries;
+        ++self->evictions;
+        self->fallback_store.put(entry);
     }
 
-    bool put(MALLOC_META chunk) {
-        // decide whether to rehash first
-        cache.ensure_capacity(size() + 1);
+    bool put_hashed(MALLOC_META chunk, size_t raw_hash) {
+        stats.put();
 
         // insert the chunk, maybe get an old chunk back
-        std::swap(chunk, cache.get_insertion_point(chunk.ptr));
+        std::swap(chunk, cache.get_insertion_point(chunk.ptr, raw_hash));
 
         // if the bin was empty, we are done.
         if (__builtin_expect(chunk.ptr == nullptr, 1)) {
@@ -188,34 +725,113 @@ public:
         }
 
         // if the bin contained an old value, insert it into the fallback store
+        ++evictions;
         return fallback_store.put(chunk);
     }
 
+    bool remove_hashed(MALLOC_META key, size_t raw_hash) {
+        stats.remove();
+        cache.advance_migration();
+        MALLOC_META* entry = cache.get_entry(key.ptr, raw_hash);
+
+        // if the bin contains a value, just reset it
+        if (__builtin_expect(entry != nullptr, 1)) {
+
+            // check that the data is still valid
+            if (__builtin_expect(*entry != key, 0)) return false;
+
+            cache.erase(*entry);
+            --cache_entries;
+            cache.maybe_shrink(size());
+            return true;
+        }
+
+        // otherwise, go to the fallback store
+        auto removed = fallback_store.remove(key);
+        stats.fallback_lookup(removed);
+        return removed;
+    }
+
+    /// Hash and prefetch a batch of keys, then apply `op(element, hash)` to each.
+    template <class F>
+    size_t for_each_batched(MALLOC_META const* elements, size_t count, F&& op) {
+        size_t succeeded = 0;
+        size_t hashes[BATCH_SIZE];
+        for (size_t first = 0; first < count; first += BATCH_SIZE) {
+            auto n = count - first < BATCH_SIZE ? count - first : BATCH_SIZE;
+            for (size_t i = 0; i < n; i++) {
+                hashes[i] = details::hash(elements[first + i].ptr);
+                cache.prefetch(hashes[i]);
+            }
+            for (size_t i = 0; i < n; i++)
+                succeeded += op(elements[first + i], hashes[i]);
+        }
+        return succeeded;
+    }
+
+public:
+    CachedMetaStore() : CachedMetaStore(128) {
+    }
+
+    // the cache refers back to this store
+    CachedMetaStore(CachedMetaStore const&) = delete;
+
+    ~CachedMetaStore() {
+    }
+
+    bool put(MALLOC_META chunk) {
+        // decide whether to rehash first
+        cache.ensure_capacity(size() + 1);
+        return put_hashed(chunk, details::hash(chunk.ptr));
+    }
+
+    size_t put_many(MALLOC_META const* chunks, size_t count) {
+        // rehash at most once for the entire batch
+        cache.ensure_capacity(size() + count);
+        return for_each_batched(chunks, count, [this](MALLOC_META chunk, size_t raw_hash) {
+            return put_hashed(chunk, raw_hash);
+        });
+    }
+
     MALLOC_META get(void* key) {
+        stats.get();
         MALLOC_META* candidate = cache.get_entry(key);
         if (__builtin_expect(candidate != nullptr, 1)) return *candidate;
 
         // if the cache didn't contain the value,
         // look into the fallback store
-        return fallback_store.get(key);
+        auto found = fallback_store.get(key);
+        stats.fallback_lookup(found.is_some());
+        return found;
     }
 
     bool remove(MALLOC_META key) {
-        MALLOC_META* entry = cache.get_entry(key.ptr);
+        return remove_hashed(key, details::hash(key.ptr));
+    }
 
-        // if the bin contains a value, just reset it
-        if (__builtin_expect(entry != nullptr, 1)) {
+    size_t remove_many(MALLOC_META const* keys, size_t count) {
+        return for_each_batched(keys, count, [this](MALLOC_META key, size_t raw_hash) {
+            return remove_hashed(key, raw_hash);
+        });
+    }
 
-            // check that the data is still valid
-            if (__builtin_expect(*entry != key, 0)) return false;
+    MALLOC_META take_if_matches(void* key, MALLOC_META expected) {
+        stats.remove();
+        cache.advance_migration();
+        MALLOC_META* entry = cache.get_entry(key);
+        if (__builtin_expect(entry == nullptr, 0)) {
+            auto stored = fallback_store.take_if_matches(key, expected);
+            stats.fallback_lookup(stored.is_some());
+            return stored;
+        }
 
-            *entry = {};
+        auto stored = *entry;
+        if (__builtin_expect(stored == expected, 1)) {
+            cache.erase(*entry);
             --cache_entries;
-            return true;
+            cache.maybe_shrink(size());
         }
-
-        // otherwise, go to the fallback store
-        return fallback_store.remove(key);
+        return stored;
     }
 
     bool update(MALLOC_META key) {
@@ -240,16 +856,42 @@ public:
         return cache.capacity();
     }
 
+    /// Call `fn(chunk)` for every stored chunk.
+    template <class F>
+    void for_each(F&& fn) {
+        cache.for_each(fn);
+        fallback_store.for_each(fn);
+    }
+
+    /// The number of entries that had to be evicted into the fallback store.
+    size_t fallback_evictions() {
+        return evictions;
+    }
+
     void reserve(size_t request) {
-        cache.ensure_capacity(request);
+        cache.reserve(request);
     }
 
     void clear() override {
         cache_entries = 0;
+        evictions = 0;
         cache.clear();
         fallback_store.clear();
+        stats.reset();
+    }
+
+    StoreStats statistics() override {
+        auto result = stats.snapshot();
+        result += cache.stats.snapshot();
+        result.records_probe_lengths = true;
+        result.records_bin_fill = true;
+        result.entries = size();
+        result.capacity = capacity();
+        result.fallback_entries = fallback_store.size();
+        result.evictions = evictions;
+        return result;
     }
 
     template <template <class V> class A>
-    using with_allocator = CachedMetaStore<FallbackStore, A<MALLOC_META>>;
+    using with_allocator = CachedMetaStore<FallbackStore, A<MALLOC_META>, IncrementalRehash>;
 };
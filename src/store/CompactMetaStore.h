@@ -0,0 +1,365 @@
+#pragma once
+
+#include "CachedMetaStore.h"  // for details::hash() and details::BinTable
+#include "MapMetaStore.h"     // as the default fallback store
+#include "metastore.h"
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace details {
+/// A MALLOC_META packed into 64 bits.
+///
+/// Chunk pointers are 16-byte aligned and live in a 48-bit address space,
+/// and chunk sizes are multiples of 16 plus the 3 flag bits. So:
+///
+///     bits  0..43: ptr >> 4
+///     bits 44..46: size flags (PREV_INUSE, IS_MMAPPED, NON_MAIN_ARENA)
+///     bits 47..63: chunksize >> 4, i.e. chunks smaller than 2 MiB
+///
+/// Metadata that doesn't fit (unaligned pointers, huge chunks)
+/// has to be stored elsewhere. The zero entry is empty,
+/// so the null pointer never fits: it would match the empty entries.
+struct CompactMeta {
+    static constexpr unsigned KEY_BITS = 44;
+    static constexpr unsigned FLAG_BITS = 3;
+    static constexpr unsigned CHUNKSIZE_BITS = 64 - KEY_BITS - FLAG_BITS;
+    static constexpr uint64_t KEY_MASK = (UINT64_C(1) << KEY_BITS) - 1;
+
+    uint64_t raw;
+
+    static uint64_t key_of(void* ptr) noexcept {
+        return reinterpret_cast<uintptr_t>(ptr) >> 4;
+    }
+
+    static bool fits_key(void* ptr) noexcept {
+        auto p = reinterpret_cast<uintptr_t>(ptr);
+        return p != 0 && (p & 0xf) == 0 && (p >> 4) <= KEY_MASK;
+    }
+
+    static bool fits(MALLOC_META meta) noexcept {
+        auto chunksize = meta.chunksize();
+        return fits_key(meta.ptr) && (chunksize & 0xf) == 0 &&
+               (chunksize >> 4) < (UINT64_C(1) << CHUNKSIZE_BITS);
+    }
+
+    /// `meta` MUST fit.
+    static CompactMeta encode(MALLOC_META meta) noexcept {
+        auto flags = static_cast<uint64_t>(meta.size & SIZE_BITS);
+        auto chunksize = static_cast<uint64_t>(meta.chunksize() >> 4);
+        return { key_of(meta.ptr) | flags << KEY_BITS | chunksize << (KEY_BITS + FLAG_BITS) };
+    }
+
+    MALLOC_META decode() const noexcept {
+        auto ptr = reinterpret_cast<void*>((raw & KEY_MASK) << 4);
+        auto flags = (raw >> KEY_BITS) & SIZE_BITS;
+        auto chunksize = (raw >> (KEY_BITS + FLAG_BITS)) << 4;
+        return { ptr, static_cast<size_t>(chunksize | flags) };
+    }
+
+    bool is_empty() const noexcept {
+        return raw == 0;
+    }
+};
+
+/// A cache line worth of packed entries, aligned so that a bin is a single cache line.
+struct alignas(64) CompactBin {
+    static constexpr size_t ENTRIES = 8;
+    CompactMeta entries[ENTRIES];
+
+    /// Bitmask of the entries whose key bits equal `key`.
+    /// The empty entries match the key 0.
+    uint32_t match(uint64_t key) const noexcept {
+#ifdef __AVX2__
+        auto wanted = _mm256_set1_epi64x(static_cast<long long>(key));
+        auto mask = _mm256_set1_epi64x(static_cast<long long>(CompactMeta::KEY_MASK));
+        auto lo = _mm256_load_si256(reinterpret_cast<const __m256i*>(&entries[0]));
+        auto hi = _mm256_load_si256(reinterpret_cast<const __m256i*>(&entries[4]));
+        lo = _mm256_cmpeq_epi64(_mm256_and_si256(lo, mask), wanted);
+        hi = _mm256_cmpeq_epi64(_mm256_and_si256(hi, mask), wanted);
+        auto lo_bits = _mm256_movemask_pd(_mm256_castsi256_pd(lo));
+        auto hi_bits = _mm256_movemask_pd(_mm256_castsi256_pd(hi));
+        return static_cast<uint32_t>(lo_bits | hi_bits << 4);
+#else
+        uint32_t result = 0;
+        for (size_t i = 0; i < ENTRIES; i++)
+            result |= uint32_t((entries[i].raw & CompactMeta::KEY_MASK) == key) << i;
+        return result;
+#endif
+    }
+
+    uint32_t match_empty() const noexcept {
+        return match(0);
+    }
+};
+}  // namespace details
+
+/// A hash table of packed 8-byte entries in front of a FallbackStore.
+///
+/// Works like the CachedMetaStore, but each 64-byte bin holds 8 instead of 4 entries,
+/// and a bin is searched with two AVX2 compares (when compiled with -mavx2).
+/// Entries that can't be packed, and entries evicted from full bins,
+/// are kept in the fallback store.
+template <
+    template <class A> class FallbackStore = MapMetaStore,
+    class Allocator = typename std::allocator<MALLOC_META>>
+class CompactMetaStore : public IMetaStore {
+    using Bin = details::CompactBin;
+    using Entry = details::CompactMeta;
+
+    static constexpr size_t ENTRIES_PER_BIN = Bin::ENTRIES;
+
+    /// Number of keys that are hashed and prefetched at once by the batched operations.
+    static constexpr size_t BATCH_SIZE = 16;
+    static constexpr size_t TYPICAL_CACHE_LINE_SIZE = 64;
+    static_assert(sizeof(Bin) == TYPICAL_CACHE_LINE_SIZE, "each bin should fill a cache line");
+    static_assert(alignof(Bin) == TYPICAL_CACHE_LINE_SIZE, "each bin should be a single cache line");
+
+    size_t cache_entries = 0;
+    details::BinTable<Bin, Allocator> bins;
+    FallbackStore<Allocator> fallback_store;
+    StoreStatsCounter stats;
+
+    Bin& get_bin(void* key) noexcept {
+        return get_bin(details::hash(key));
+    }
+
+    Bin& get_bin(size_t raw_hash) noexcept {
+        return bins[raw_hash & (bins.size() - 1)];
+    }
+
+    /// Find the packed entry for a key, may be NULL.
+    Entry* get_entry(void* key) noexcept {
+        return get_entry(key, details::hash(key));
+    }
+
+    Entry* get_entry(void* key, size_t raw_hash) noexcept {
+        if (UNLIKELY(!Entry::fits_key(key))) return nullptr;
+        auto& bin = get_bin(raw_hash);
+        auto m = bin.match(Entry::key_of(key));
+        if (LIKELY(m)) return &bin.entries[__builtin_ctz(m)];
+        return nullptr;
+    }
+
+    bool put_hashed(MALLOC_META chunk, size_t raw_hash) {
+        stats.put();
+        if (UNLIKELY(!Entry::fits(chunk))) return fallback_store.put(chunk);
+
+        auto& bin = get_bin(raw_hash);
+        auto packed = Entry::encode(chunk);
+
+        auto empty = bin.match_empty();
+        stats.bin_fill(ENTRIES_PER_BIN - __builtin_popcount(empty));
+        if (LIKELY(empty)) {
+            bin.entries[__builtin_ctz(empty)] = packed;
+            ++cache_entries;
+            return true;
+        }
+
+        // If there is no empty entry, evict one at random,
+        // using the otherwise unused upper bits of the hash.
+        auto& victim = bin.entries[raw_hash >> (64 - 3)];
+        auto evicted = victim.decode();
+        victim = packed;
+        stats.eviction();
+        return fallback_store.put(evicted);
+    }
+
+    bool remove_hashed(MALLOC_META key, size_t raw_hash) {
+        stats.remove();
+        auto entry = get_entry(key.ptr, raw_hash);
+        if (LIKELY(entry != nullptr)) {
+            stats.probe(1);
+            if (UNLIKELY(entry->decode() != key)) return false;
+            *entry = {};
+            --cache_entries;
+            return true;
+        }
+
+        // the bin, then the fallback store
+        stats.probe(2);
+        auto removed = fallback_store.remove(key);
+        stats.fallback_lookup(removed);
+        return removed;
+    }
+
+    /// Hash and prefetch a batch of keys, then apply `op(element, hash)` to each.
+    template <class F>
+    size_t for_each_batched(MALLOC_META const* elements, size_t count, F&& op) {
+        size_t succeeded = 0;
+        size_t hashes[BATCH_SIZE];
+        for (size_t first = 0; first < count; first += BATCH_SIZE) {
+            auto n = count - first < BATCH_SIZE ? count - first : BATCH_SIZE;
+            for (size_t i = 0; i < n; i++) {
+                hashes[i] = details::hash(elements[first + i].ptr);
+                __builtin_prefetch(&get_bin(hashes[i]), 1);
+            }
+            for (size_t i = 0; i < n; i++)
+                succeeded += op(elements[first + i], hashes[i]);
+        }
+        return succeeded;
+    }
+
+    void ensure_capacity(size_t required) {
+        if (LIKELY(required <= capacity())) return;
+
+        auto factor = 2;
+        while (UNLIKELY(required > factor * capacity()))
+            factor *= 2;
+        reserve_double(factor);
+    }
+
+    /// factor MUST be a multiple of 2
+    void reserve_double(size_t factor) __attribute__((noinline)) {
+        const auto oldsize = bins.size();
+        const auto newsize = factor * oldsize;
+        assert(newsize > oldsize);
+        bins.grow(newsize);  // may throw
+        stats.rehash();
+        const auto newmask = newsize - 1;
+
+        // Entries can only move from bin `i` into bins `i + k * oldsize`,
+        // which are empty except for entries from this same bin,
+        // so there is always space in the target bin.
+        for (size_t bin_i = 0; bin_i < oldsize; ++bin_i) {
+            __builtin_prefetch(&bins[oldsize + bin_i], 1);
+
+            for (auto& entry : bins[bin_i].entries) {
+                if (UNLIKELY(entry.is_empty())) continue;
+
+                auto newbin_i = details::hash(entry.decode().ptr) & newmask;
+                if (newbin_i == bin_i) continue;
+
+                auto& target = bins[newbin_i];
+                target.entries[__builtin_ctz(target.match_empty())] = entry;
+                entry = {};
+            }
+        }
+    }
+
+public:
+    /// capacity MUST be a power of 2 and MUST be at least one bin.
+    explicit CompactMetaStore(size_t capacity = 128) : bins(capacity / ENTRIES_PER_BIN) {
+        assert(/* minimum capacity is 1 bin */ capacity >= ENTRIES_PER_BIN);
+        assert(/* is power of 2, i.e. single bit is set */ __builtin_popcount(capacity) == 1);
+    }
+
+    ~CompactMetaStore() {
+    }
+
+    bool put(MALLOC_META chunk) {
+        if (UNLIKELY(!Entry::fits(chunk))) {
+            stats.put();
+            return fallback_store.put(chunk);
+        }
+
+        ensure_capacity(size() + 1);
+        return put_hashed(chunk, details::hash(chunk.ptr));
+    }
+
+    size_t put_many(MALLOC_META const* chunks, size_t count) {
+        // grow at most once for the entire batch
+        ensure_capacity(size() + count);
+        return for_each_batched(chunks, count, [this](MALLOC_META chunk, size_t raw_hash) {
+            return put_hashed(chunk, raw_hash);
+        });
+    }
+
+    MALLOC_META get(void* key) {
+        stats.get();
+        auto entry = get_entry(key);
+        if (LIKELY(entry != nullptr)) {
+            stats.probe(1);
+            return entry->decode();
+        }
+
+        stats.probe(2);
+        auto found = fallback_store.get(key);
+        stats.fallback_lookup(found.is_some());
+        return found;
+    }
+
+    bool remove(MALLOC_META key) {
+        return remove_hashed(key, details::hash(key.ptr));
+    }
+
+    size_t remove_many(MALLOC_META const* keys, size_t count) {
+        return for_each_batched(keys, count, [this](MALLOC_META key, size_t raw_hash) {
+            return remove_hashed(key, raw_hash);
+        });
+    }
+
+    MALLOC_META take_if_matches(void* key, MALLOC_META expected) {
+        stats.remove();
+        auto entry = get_entry(key);
+        if (UNLIKELY(entry == nullptr)) {
+            stats.probe(2);
+            auto stored = fallback_store.take_if_matches(key, expected);
+            stats.fallback_lookup(stored.is_some());
+            return stored;
+        }
+
+        stats.probe(1);
+        auto stored = entry->decode();
+        if (LIKELY(stored == expected)) {
+            *entry = {};
+            --cache_entries;
+        }
+        return stored;
+    }
+
+    bool update(MALLOC_META key) {
+        auto entry = get_entry(key.ptr);
+        if (UNLIKELY(entry == nullptr)) return fallback_store.update(key);
+
+        if (LIKELY(Entry::fits(key))) {
+            *entry = Entry::encode(key);
+            return true;
+        }
+
+        // the new size can't be packed
+        *entry = {};
+        --cache_entries;
+        stats.eviction();
+        return fallback_store.put(key);
+    }
+
+    size_t size() {
+        return cache_entries + fallback_store.size();
+    }
+
+    /// The capacity of the packed table, not of the entire store.
+    size_t capacity() {
+        return bins.size() * ENTRIES_PER_BIN;
+    }
+
+    void reserve(size_t request) {
+        ensure_capacity(request);
+    }
+
+    void clear() override {
+        cache_entries = 0;
+        bins.zero(0, bins.size());
+        fallback_store.clear();
+        stats.reset();
+    }
+
+    StoreStats statistics() override {
+        auto result = stats.snapshot();
+        result.records_probe_lengths = true;
+        result.records_bin_fill = true;
+        result.entries = size();
+        result.capacity = capacity();
+        result.fallback_entries = fallback_store.size();
+        return result;
+    }
+
+    template <template <class V> class A>
+    using with_allocator = CompactMetaStore<FallbackStore, A<MALLOC_META>>;
+};
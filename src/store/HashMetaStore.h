@@ -15,6 +15,7 @@ class HashMetaStore : public IMetaStore {
     using Container =
         std::unordered_map<void*, size_t, PtrHash, std::equal_to<void*>, Allocator>;
     Container elements{};
+    StoreStatsCounter stats;
 
 public:
     HashMetaStore() {
@@ -24,19 +25,40 @@ public:
     }
 
     bool put(MALLOC_META chunk) {
+        stats.put();
         // emplace() inserts the element and returns an <iterator, bool>
         // pair that indicates whether insertion was successful.
         return chunk.ptr && elements.emplace(chunk.ptr, chunk.size).second;
     }
 
     MALLOC_META get(void* key) {
+        stats.get();
         auto it = elements.find(key);
         if (it == elements.end()) return {};
 
         return { key, it->second };
     }
 
+    MALLOC_META take_if_matches(void* key, MALLOC_META expected) {
+        stats.remove();
+        auto it = elements.find(key);
+        if (it == elements.end()) return {};
+
+        MALLOC_META stored = { key, it->second };
+        if (stored == expected) elements.erase(it);
+        return stored;
+    }
+
+    size_t put_many(MALLOC_META const* chunks, size_t count) {
+        elements.reserve(elements.size() + count);
+        size_t inserted = 0;
+        for (size_t i = 0; i < count; i++)
+            inserted += put(chunks[i]);
+        return inserted;
+    }
+
     bool remove(MALLOC_META key) {
+        stats.remove();
         auto it = elements.find(key.ptr);
         if (it == elements.end()) return false;
         if (MALLOC_META{ key.ptr, it->second } != key) return false;
@@ -58,12 +80,27 @@ public:
         return elements.size();
     }
 
+    /// Call `fn(chunk)` for every stored chunk.
+    template <class F>
+    void for_each(F&& fn) {
+        for (auto& element : elements)
+            fn(MALLOC_META{ element.first, element.second });
+    }
+
     void reserve(size_t size) override {
         elements.reserve(size);
     }
 
     void clear() {
         elements.clear();
+        stats.reset();
+    }
+
+    StoreStats statistics() override {
+        auto result = stats.snapshot();
+        result.entries = elements.size();
+        result.capacity = elements.bucket_count();
+        return result;
     }
 
     template <template <class V> class A>
@@ -1,5 +1,7 @@
+#pragma once
 
 #include "../hook/hookinfo.h"
+#include <atomic>
 #include <cassert>
 #include <cerrno>
 #include <cstddef>
@@ -13,6 +15,11 @@
 
 namespace {
 
+/// The number of allocations and deallocations of all InternalAllocators so far.
+/// They change the glibc heap between two snapshots of the facade, see UnsortedBinModel.
+/// Thread-safe stores allocate from several threads at once.
+std::atomic<unsigned long> internal_heap_operations{ 0 };
+
 /// The InternalAllocator class is a C++ allocator
 /// that uses the *original* malloc implementation,
 /// without going through or wrappers.
@@ -37,6 +44,7 @@ struct InternalAllocator {
         }
 
         if (n <= std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            ++internal_heap_operations;
             if (auto p = info.call_malloc_raw(n * sizeof(T))) {
                 // debug("internal allocate() = %p\n", p);
                 return static_cast<T*>(p);
@@ -54,8 +62,20 @@ struct InternalAllocator {
 
     void deallocate(T* p, std::size_t) noexcept {
         // debug("internal deallocate(%p)\n", p);
+        ++internal_heap_operations;
         info.call_free_raw(p);
     }
+
+    // all instances share the same underlying heap
+    template <class U>
+    bool operator==(InternalAllocator<U> const&) const noexcept {
+        return true;
+    }
+
+    template <class U>
+    bool operator!=(InternalAllocator<U> const&) const noexcept {
+        return false;
+    }
 };
 
 }  // namespace
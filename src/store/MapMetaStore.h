@@ -8,6 +8,7 @@ template <class Allocator = std::allocator<std::pair<void*, MALLOC_META>>>
 class MapMetaStore : public IMetaStore {
     using Container = std::map<void*, MALLOC_META, std::less<void*>, Allocator>;
     Container elements;
+    StoreStatsCounter stats;
 
 public:
     MapMetaStore() : elements{} {
@@ -17,6 +18,7 @@ public:
     }
 
     bool put(MALLOC_META chunk) {
+        stats.put();
         return chunk.ptr && elements.emplace(chunk.ptr, chunk).second;
     }
 
@@ -25,13 +27,41 @@ public:
     }
 
     MALLOC_META get(void* key) {
+        stats.get();
         auto it = elements.find(key);
         if (it == elements.end()) return {};
 
         return it->second;
     }
 
+    MALLOC_META take_if_matches(void* key, MALLOC_META expected) {
+        stats.remove();
+        auto it = elements.find(key);
+        if (it == elements.end()) return {};
+
+        MALLOC_META stored = it->second;
+        if (stored == expected) elements.erase(it);
+        return stored;
+    }
+
+    /// Chunks are often allocated in ascending order,
+    /// so each insertion uses the position after the previous one as a hint.
+    size_t put_many(MALLOC_META const* chunks, size_t count) {
+        size_t inserted = 0;
+        auto hint = elements.end();
+        for (size_t i = 0; i < count; i++) {
+            stats.put();
+            if (!chunks[i].ptr) continue;
+            auto before = elements.size();
+            hint = elements.emplace_hint(hint, chunks[i].ptr, chunks[i]);
+            inserted += elements.size() != before;
+            ++hint;
+        }
+        return inserted;
+    }
+
     bool remove(MALLOC_META key) {
+        stats.remove();
         auto it = elements.find(key.ptr);
         if (it == elements.end()) return false;
         if (it->second != key) return false;
@@ -44,8 +74,22 @@ public:
         return elements.size();
     }
 
+    /// Call `fn(chunk)` for every stored chunk.
+    template <class F>
+    void for_each(F&& fn) {
+        for (auto& element : elements)
+            fn(element.second);
+    }
+
     void clear() {
         elements.clear();
+        stats.reset();
+    }
+
+    StoreStats statistics() override {
+        auto result = stats.snapshot();
+        result.entries = elements.size();
+        return result;
     }
 
     template <template <class V> class A>
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "InternalAllocator.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MMAP_HUGEPAGES
+#define MMAP_HUGEPAGES 0
+#endif
+
+namespace {
+
+/// The MmapAllocator class is a C++ allocator
+/// that serves large allocations from private anonymous mappings.
+///
+/// Metadata tables therefore don't live in the glibc heap,
+/// and growing them doesn't perturb the tcache/bins/top chunk
+/// that the facade takes snapshots of.
+/// Tables can grow in place (or at least without copying) via mremap().
+///
+/// Allocations smaller than a page are forwarded to the InternalAllocator,
+/// since a mapping per tree node would be far too expensive.
+
+template <class T>
+struct MmapAllocator {
+    using value_type = T;
+
+    static constexpr size_t HUGEPAGE_SIZE = 2 * 1024 * 1024;
+
+    InternalAllocator<T> small;
+
+    MmapAllocator() = default;
+
+    template <class U>
+    constexpr MmapAllocator(MmapAllocator<U> const&) {
+    }
+
+    static size_t page_size() noexcept {
+        static const size_t size = sysconf(_SC_PAGESIZE);
+        return size;
+    }
+
+    static bool is_mapped(std::size_t n) noexcept {
+        return n * sizeof(T) >= page_size();
+    }
+
+    static size_t mapping_size(std::size_t n) noexcept {
+        auto page_mask = page_size() - 1;
+        return (n * sizeof(T) + page_mask) & ~page_mask;
+    }
+
+    static void advise(void* p, size_t size) noexcept {
+        if (MMAP_HUGEPAGES && size >= HUGEPAGE_SIZE) madvise(p, size, MADV_HUGEPAGE);
+    }
+
+    T* allocate(std::size_t n) noexcept {
+        if (!is_mapped(n)) return small.allocate(n);
+
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            std::fprintf(stderr, "ShadowHeap: ERROR: internal allocate() impossibly large");
+            std::abort();
+        }
+
+        auto size = mapping_size(n);
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            std::fprintf(stderr, "ShadowHeap: ERROR: internal mmap() failed\n");
+            std::abort();
+        }
+
+        advise(p, size);
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        if (!is_mapped(n)) return small.deallocate(p, n);
+        munmap(p, mapping_size(n));
+    }
+
+    /// Resize an allocation, keeping the first `std::min(oldn, newn)` elements.
+    /// Between mappings, the pages are moved by the kernel instead of being copied.
+    T* reallocate(T* p, std::size_t oldn, std::size_t newn) noexcept {
+        if (is_mapped(oldn) && is_mapped(newn)) {
+            auto newsize = mapping_size(newn);
+            void* q = mremap(p, mapping_size(oldn), newsize, MREMAP_MAYMOVE);
+            if (q == MAP_FAILED) {
+                std::fprintf(stderr, "ShadowHeap: ERROR: internal mremap() failed\n");
+                std::abort();
+            }
+            advise(q, newsize);
+            return static_cast<T*>(q);
+        }
+
+        T* q = allocate(newn);
+        std::memcpy(static_cast<void*>(q), p, (oldn < newn ? oldn : newn) * sizeof(T));
+        deallocate(p, oldn);
+        return q;
+    }
+
+    template <class U>
+    bool operator==(MmapAllocator<U> const&) const noexcept {
+        return true;
+    }
+
+    template <class U>
+    bool operator!=(MmapAllocator<U> const&) const noexcept {
+        return false;
+    }
+};
+
+}  // namespace
@@ -0,0 +1,178 @@
+#pragma once
+
+#include "../common/common.h"
+#include "../common/spinlock.h"
+#include "MmapAllocator.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <sys/mman.h>
+
+namespace details {
+/// The lock of a NodePool, linked into the list of all pools that were used.
+struct PoolLock {
+    SpinLock lock;
+    PoolLock* next = nullptr;
+
+    constexpr PoolLock() = default;
+
+    /// The pools that were used so far, newest first.
+    static std::atomic<PoolLock*>& used() noexcept {
+        static std::atomic<PoolLock*> head{ nullptr };
+        return head;
+    }
+
+    void add_to_used() noexcept {
+        auto& head = used();
+        auto first = head.load(std::memory_order_relaxed);
+        do {
+            next = first;
+        } while (!head.compare_exchange_weak(first, this, std::memory_order_release));
+    }
+};
+
+/// Lock all pools that were used so far, e.g. across fork(), since all stores share them.
+/// Returns the first of them, for unlock_pools().
+inline PoolLock* lock_pools() noexcept {
+    auto first = PoolLock::used().load(std::memory_order_acquire);
+    for (auto pool = first; pool; pool = pool->next)
+        pool->lock.lock();
+    return first;
+}
+
+inline void unlock_pools(PoolLock* first) noexcept {
+    for (auto pool = first; pool; pool = pool->next)
+        pool->lock.unlock();
+}
+
+/// A free list of fixed-size nodes, carved out of large private mappings.
+///
+/// There is one pool per node size, shared by all containers,
+/// so the pool is guarded by a lock. Memory is never returned to the system,
+/// but freed nodes are reused by any container with the same node size.
+template <size_t NodeSize>
+class NodePool {
+    static_assert(NodeSize >= sizeof(void*), "a node must be able to hold a free-list link");
+
+    static constexpr size_t SLAB_SIZE = 1024 * 1024;
+
+    struct FreeNode {
+        FreeNode* next;
+    };
+
+    PoolLock pool_lock;
+    FreeNode* free_list = nullptr;
+    char* slab_cursor = nullptr;
+    char* slab_end = nullptr;
+
+    void* allocate_from_new_slab() __attribute__((noinline)) {
+        void* slab = mmap(
+            nullptr, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+            -1, 0);
+        if (slab == MAP_FAILED) {
+            std::fprintf(stderr, "ShadowHeap: ERROR: internal slab mmap() failed\n");
+            std::abort();
+        }
+
+        // the rest of the previous slab (less than a node) is abandoned
+        slab_cursor = static_cast<char*>(slab) + NodeSize;
+        slab_end = static_cast<char*>(slab) + SLAB_SIZE;
+        return slab;
+    }
+
+public:
+    constexpr NodePool() = default;
+
+    static NodePool& instance() noexcept {
+        // constant-initialized, so this is safe to use before main() and from the hooks
+        static NodePool pool;
+        // a guarded static, which doesn't allocate either
+        static bool used = (pool.pool_lock.add_to_used(), true);
+        (void)used;
+        return pool;
+    }
+
+    void* allocate() noexcept {
+        std::lock_guard<SpinLock> guard{ pool_lock.lock };
+
+        if (LIKELY(free_list != nullptr)) {
+            auto node = free_list;
+            free_list = node->next;
+            return node;
+        }
+
+        if (LIKELY(slab_end - slab_cursor >= static_cast<ptrdiff_t>(NodeSize))) {
+            auto node = slab_cursor;
+            slab_cursor += NodeSize;
+            return node;
+        }
+
+        return allocate_from_new_slab();
+    }
+
+    void deallocate(void* p) noexcept {
+        std::lock_guard<SpinLock> guard{ pool_lock.lock };
+        auto node = static_cast<FreeNode*>(p);
+        node->next = free_list;
+        free_list = node;
+    }
+};
+}  // namespace details
+
+namespace {
+
+/// The PoolAllocator class is a C++ allocator for node-based containers
+/// such as std::map and std::unordered_map.
+///
+/// Single nodes come from a per-size free list (see details::NodePool),
+/// so inserting or erasing a fallback entry doesn't call the real malloc.
+/// Arrays (e.g. the bucket array of a hash table) are forwarded to the MmapAllocator.
+
+template <class T>
+struct PoolAllocator {
+    using value_type = T;
+
+    /// Node sizes are rounded up to the malloc alignment,
+    /// so that similar node types share a pool.
+    static constexpr size_t NODE_ALIGNMENT = 16;
+    static constexpr size_t NODE_SIZE = (sizeof(T) + NODE_ALIGNMENT - 1) & ~(NODE_ALIGNMENT - 1);
+    using Pool = details::NodePool<NODE_SIZE>;
+
+    /// Nodes are only aligned to NODE_ALIGNMENT. Over-aligned types, like cache-line aligned bins,
+    /// are allocated as arrays, whose container aligns them (see details::BinTable).
+    static constexpr bool OVERALIGNED = alignof(T) > NODE_ALIGNMENT;
+
+    MmapAllocator<T> arrays;
+
+    PoolAllocator() = default;
+
+    template <class U>
+    constexpr PoolAllocator(PoolAllocator<U> const&) {
+    }
+
+    T* allocate(std::size_t n) noexcept {
+        if (LIKELY(n == 1 && !OVERALIGNED)) return static_cast<T*>(Pool::instance().allocate());
+        return arrays.allocate(n);
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        if (LIKELY(n == 1 && !OVERALIGNED)) return Pool::instance().deallocate(p);
+        arrays.deallocate(p, n);
+    }
+
+    // all instances share the same pools
+    template <class U>
+    bool operator==(PoolAllocator<U> const&) const noexcept {
+        return true;
+    }
+
+    template <class U>
+    bool operator!=(PoolAllocator<U> const&) const noexcept {
+        return false;
+    }
+};
+
+}  // namespace
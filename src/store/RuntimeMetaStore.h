@@ -0,0 +1,226 @@
+#pragma once
+
+#include "AdaptiveMetaStore.h"
+#include "CachedMetaStore.h"
+#include "CompactMetaStore.h"
+#include "HashMetaStore.h"
+#include "MapMetaStore.h"
+#include "ShadowMetaStore.h"
+#include "SwissMetaStore.h"
+#include "VectorMetaStore.h"
+#include "metastore.h"
+
+#include <cstring>
+#include <memory>
+#include <new>
+
+namespace details {
+/// The operations of a store, as plain function pointers on a type-erased store.
+struct StoreOperations {
+    void* (*create)();
+    void (*destroy)(void* store);
+    bool (*put)(void* store, MALLOC_META chunk);
+    MALLOC_META (*get)(void* store, void* key);
+    bool (*remove)(void* store, MALLOC_META key);
+    bool (*update)(void* store, MALLOC_META key);
+    MALLOC_META (*take_if_matches)(void* store, void* key, MALLOC_META expected);
+    size_t (*put_many)(void* store, MALLOC_META const* chunks, size_t count);
+    size_t (*remove_many)(void* store, MALLOC_META const* keys, size_t count);
+    size_t (*size)(void* store);
+    void (*reserve)(void* store, size_t request);
+    void (*clear)(void* store);
+    StoreStats (*statistics)(void* store);
+};
+
+/// The StoreOperations of a concrete store.
+/// The calls are qualified, so that they don't go through the vtable again.
+/// The operations of `Store`. The store itself is allocated with `Allocator`, like its entries,
+/// so that a store created during an operation of the facade doesn't call the hooked malloc().
+template <class Store, class Allocator>
+struct StoreOperationsFor {
+    using StoreAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Store>;
+
+    static Store& self(void* store) noexcept {
+        return *static_cast<Store*>(store);
+    }
+
+    static void* create() {
+        StoreAllocator alloc;
+        return new (alloc.allocate(1)) Store{};
+    }
+    static void destroy(void* store) {
+        StoreAllocator alloc;
+        self(store).~Store();
+        alloc.deallocate(static_cast<Store*>(store), 1);
+    }
+    static bool put(void* store, MALLOC_META chunk) {
+        return self(store).Store::put(chunk);
+    }
+    static MALLOC_META get(void* store, void* key) {
+        return self(store).Store::get(key);
+    }
+    static bool remove(void* store, MALLOC_META key) {
+        return self(store).Store::remove(key);
+    }
+    static bool update(void* store, MALLOC_META key) {
+        return self(store).Store::update(key);
+    }
+    static MALLOC_META take_if_matches(void* store, void* key, MALLOC_META expected) {
+        return self(store).Store::take_if_matches(key, expected);
+    }
+    static size_t put_many(void* store, MALLOC_META const* chunks, size_t count) {
+        return self(store).Store::put_many(chunks, count);
+    }
+    static size_t remove_many(void* store, MALLOC_META const* keys, size_t count) {
+        return self(store).Store::remove_many(keys, count);
+    }
+    static size_t size(void* store) {
+        return self(store).Store::size();
+    }
+    static void reserve(void* store, size_t request) {
+        self(store).Store::reserve(request);
+    }
+    static void clear(void* store) {
+        self(store).Store::clear();
+    }
+    static StoreStats statistics(void* store) {
+        return self(store).Store::statistics();
+    }
+
+    static const StoreOperations table;
+};
+
+template <class Store, class Allocator>
+const StoreOperations StoreOperationsFor<Store, Allocator>::table = {
+    create,   destroy,     put,  get,     remove, update,     take_if_matches,
+    put_many, remove_many, size, reserve, clear,  statistics,
+};
+}  // namespace details
+
+/// A store whose implementation is selected at startup, e.g. via SHADOWHEAP_STORE.
+///
+/// All stores are compiled in, and the selected one is called through a table
+/// of function pointers. That is a single indirect call per operation,
+/// which is resolved once instead of going through a vtable on each call.
+/// Until a store is selected, the cached hash table is used.
+template <class Allocator = std::allocator<MALLOC_META>>
+class RuntimeMetaStore : public IMetaStore {
+    struct Choice {
+        const char* name;
+        const details::StoreOperations* operations;
+    };
+
+    template <class Store>
+    static constexpr const details::StoreOperations* operations_for() {
+        return &details::StoreOperationsFor<Store, Allocator>::table;
+    }
+
+    static constexpr size_t CHOICES = 9;
+
+    static Choice const* choices() noexcept {
+        static const Choice table[CHOICES] = {
+            { "cached", operations_for<CachedMetaStore<HashMetaStore, Allocator>>() },
+            { "incremental", operations_for<CachedMetaStore<HashMetaStore, Allocator, true>>() },
+            { "hash", operations_for<HashMetaStore<Allocator>>() },
+            { "map", operations_for<MapMetaStore<Allocator>>() },
+            { "vector", operations_for<VectorMetaStore<Allocator>>() },
+            { "swiss", operations_for<SwissMetaStore<Allocator>>() },
+            { "compact", operations_for<CompactMetaStore<HashMetaStore, Allocator>>() },
+            { "shadow", operations_for<ShadowMetaStore<HashMetaStore, Allocator>>() },
+            { "adaptive", operations_for<AdaptiveMetaStore<Allocator>>() },
+        };
+        return table;
+    }
+
+    const details::StoreOperations* operations;
+    const char* selected;
+    void* store;
+
+public:
+    /// The names that select() accepts, for error messages.
+    static const char* available_stores() noexcept {
+        return "cached, incremental, hash, map, vector, swiss, compact, shadow, adaptive";
+    }
+
+    RuntimeMetaStore()
+        : operations(choices()[0].operations),
+          selected(choices()[0].name),
+          store(operations->create()) {
+    }
+
+    RuntimeMetaStore(RuntimeMetaStore const&) = delete;
+
+    ~RuntimeMetaStore() {
+        operations->destroy(store);
+    }
+
+    /// Switch to the store with the given name, which discards all entries.
+    /// Returns false if there is no such store.
+    bool select(const char* name) {
+        for (size_t i = 0; i < CHOICES; i++) {
+            auto& choice = choices()[i];
+            if (std::strcmp(choice.name, name) != 0) continue;
+
+            if (choice.operations != operations) {
+                operations->destroy(store);
+                operations = choice.operations;
+                store = operations->create();
+            }
+            selected = choice.name;
+            return true;
+        }
+        return false;
+    }
+
+    /// The name of the selected store.
+    const char* selected_store() const noexcept {
+        return selected;
+    }
+
+    bool put(MALLOC_META chunk) {
+        return operations->put(store, chunk);
+    }
+
+    MALLOC_META get(void* key) {
+        return operations->get(store, key);
+    }
+
+    bool remove(MALLOC_META key) {
+        return operations->remove(store, key);
+    }
+
+    bool update(MALLOC_META key) {
+        return operations->update(store, key);
+    }
+
+    MALLOC_META take_if_matches(void* key, MALLOC_META expected) {
+        return operations->take_if_matches(store, key, expected);
+    }
+
+    size_t put_many(MALLOC_META const* chunks, size_t count) {
+        return operations->put_many(store, chunks, count);
+    }
+
+    size_t remove_many(MALLOC_META const* keys, size_t count) {
+        return operations->remove_many(store, keys, count);
+    }
+
+    size_t size() {
+        return operations->size(store);
+    }
+
+    void reserve(size_t request) {
+        operations->reserve(store, request);
+    }
+
+    void clear() override {
+        operations->clear(store);
+    }
+
+    StoreStats statistics() override {
+        return operations->statistics(store);
+    }
+
+    template <template <class V> class A>
+    using with_allocator = RuntimeMetaStore<A<MALLOC_META>>;
+};
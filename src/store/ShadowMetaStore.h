@@ -0,0 +1,327 @@
+#pragma once
+
+#include "MapMetaStore.h"  // as the default fallback store
+#include "metastore.h"
+
+#include <cstdint>
+#include <memory>
+#include <sys/mman.h>
+
+/// A direct-mapped store in the style of ASan's shadow memory.
+///
+/// Every 16-byte granule of the address space has one slot in a shadow array,
+/// which holds the raw size of the chunk starting there, or 0.
+/// A lookup therefore needs no hashing and no probing.
+///
+/// The main arena grows contiguously, so its shadow is one large reservation
+/// that is committed lazily by the kernel as slots are touched.
+/// Its base is learned from the first main-arena chunk that is stored.
+/// Chunks outside of that span (mmapped chunks, other arenas)
+/// are shadowed through a two-level page table of smaller reservations.
+/// Unaligned keys and chunks of size 0 go to the FallbackStore.
+template <
+    template <class A> class FallbackStore = MapMetaStore,
+    class Allocator = typename std::allocator<MALLOC_META>>
+class ShadowMetaStore : public IMetaStore {
+    using Slot = size_t;
+
+    static constexpr unsigned ADDRESS_BITS = 48;
+    static constexpr unsigned GRANULE_BITS = 4;  // chunks are 16-byte aligned
+
+    /// The main arena shadow covers 16 GiB of heap, which reserves 8 GiB of shadow.
+    static constexpr unsigned HEAP_SPAN_BITS = 34;
+    /// The heap base is rounded down, to cover chunks that were allocated earlier.
+    static constexpr uintptr_t HEAP_BASE_ALIGNMENT = uintptr_t(1) << 26;
+
+    /// Each leaf shadows 4 MiB of address space, with a 2 MiB reservation.
+    static constexpr unsigned LEAF_BITS = 22;
+    static constexpr unsigned DIRECTORY_BITS = 13;
+    static constexpr unsigned ROOT_BITS = ADDRESS_BITS - LEAF_BITS - DIRECTORY_BITS;
+
+    static constexpr size_t LEAF_SLOTS = size_t(1) << (LEAF_BITS - GRANULE_BITS);
+    static constexpr size_t DIRECTORY_ENTRIES = size_t(1) << DIRECTORY_BITS;
+    static constexpr size_t ROOT_ENTRIES = size_t(1) << ROOT_BITS;
+
+    using Leaf = Slot*;       // array of LEAF_SLOTS slots
+    using Directory = Leaf*;  // array of DIRECTORY_ENTRIES leaves
+
+    uintptr_t heap_base = 0;
+    uintptr_t heap_span = 0;  // 0 until the heap shadow was reserved
+    Slot* heap_shadow = nullptr;
+    /// one past the highest heap shadow slot that was used, bounds for_each()
+    size_t heap_slots_used = 0;
+
+    Directory* root = nullptr;  // array of ROOT_ENTRIES directories
+
+    size_t entries = 0;
+    FallbackStore<Allocator> fallback_store;
+    StoreStatsCounter stats;
+
+    /// Number of slots that are looked up and prefetched at once by the batched operations.
+    static constexpr size_t BATCH_SIZE = 16;
+
+    /// Reserve zeroed memory that is only committed once it is touched.
+    static void* reserve_zeroed(size_t size) noexcept {
+        void* p = mmap(
+            nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+            0);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    static bool is_aligned(void* key) noexcept {
+        return (reinterpret_cast<uintptr_t>(key) & ((uintptr_t(1) << GRANULE_BITS) - 1)) == 0;
+    }
+
+    /// Find the shadow slot of a key, which MUST be aligned.
+    /// Returns NULL if the slot doesn't exist and `create` isn't set,
+    /// or if the shadow can't be reserved.
+    Slot* slot_of(void* key, bool create) noexcept {
+        auto p = reinterpret_cast<uintptr_t>(key);
+
+        if (LIKELY(p - heap_base < heap_span)) return &heap_shadow[(p - heap_base) >> GRANULE_BITS];
+
+        if (UNLIKELY(p >> ADDRESS_BITS)) return nullptr;
+        return table_slot_of(p, create);
+    }
+
+    Slot* table_slot_of(uintptr_t p, bool create) noexcept {
+        auto root_i = p >> (LEAF_BITS + DIRECTORY_BITS);
+        auto directory_i = (p >> LEAF_BITS) & (DIRECTORY_ENTRIES - 1);
+        auto slot_i = (p & ((uintptr_t(1) << LEAF_BITS) - 1)) >> GRANULE_BITS;
+
+        if (UNLIKELY(!root)) {
+            if (!create) return nullptr;
+            root = static_cast<Directory*>(reserve_zeroed(ROOT_ENTRIES * sizeof(Directory)));
+            if (!root) return nullptr;
+        }
+
+        auto& directory = root[root_i];
+        if (UNLIKELY(!directory)) {
+            if (!create) return nullptr;
+            directory = static_cast<Directory>(reserve_zeroed(DIRECTORY_ENTRIES * sizeof(Leaf)));
+            if (!directory) return nullptr;
+        }
+
+        auto& leaf = directory[directory_i];
+        if (UNLIKELY(!leaf)) {
+            if (!create) return nullptr;
+            leaf = static_cast<Leaf>(reserve_zeroed(LEAF_SLOTS * sizeof(Slot)));
+            if (!leaf) return nullptr;
+        }
+
+        return &leaf[slot_i];
+    }
+
+    /// Reserve the shadow for a main-arena heap around `key`.
+    /// Only possible while the store is empty,
+    /// since existing entries would otherwise be hidden by the new span.
+    void reserve_heap_shadow(void* key) __attribute__((noinline)) {
+        auto base = reinterpret_cast<uintptr_t>(key) & ~(HEAP_BASE_ALIGNMENT - 1);
+        auto span = uintptr_t(1) << HEAP_SPAN_BITS;
+        auto shadow = static_cast<Slot*>(reserve_zeroed((span >> GRANULE_BITS) * sizeof(Slot)));
+        if (!shadow) return;
+
+        heap_shadow = shadow;
+        heap_base = base;
+        heap_span = span;
+    }
+
+    /// Prefetch the slots of a batch of keys, then apply `op(element)` to each.
+    template <class F>
+    size_t for_each_batched(MALLOC_META const* elements, size_t count, F&& op) {
+        size_t succeeded = 0;
+        for (size_t first = 0; first < count; first += BATCH_SIZE) {
+            auto n = count - first < BATCH_SIZE ? count - first : BATCH_SIZE;
+            for (size_t i = 0; i < n; i++) {
+                auto key = elements[first + i].ptr;
+                if (LIKELY(is_aligned(key)))
+                    if (auto slot = slot_of(key, false)) __builtin_prefetch(slot, 1);
+            }
+            for (size_t i = 0; i < n; i++)
+                succeeded += op(elements[first + i]);
+        }
+        return succeeded;
+    }
+
+    template <class F>
+    void for_each_leaf(F&& fn) {
+        if (!root) return;
+        for (size_t root_i = 0; root_i < ROOT_ENTRIES; root_i++) {
+            auto directory = root[root_i];
+            if (!directory) continue;
+            for (size_t directory_i = 0; directory_i < DIRECTORY_ENTRIES; directory_i++)
+                if (directory[directory_i]) fn(directory[directory_i]);
+        }
+    }
+
+public:
+    ShadowMetaStore() {
+    }
+
+    ~ShadowMetaStore() {
+        if (heap_shadow) munmap(heap_shadow, (heap_span >> GRANULE_BITS) * sizeof(Slot));
+        for_each_leaf([](Leaf leaf) { munmap(leaf, LEAF_SLOTS * sizeof(Slot)); });
+        if (root) {
+            for (size_t root_i = 0; root_i < ROOT_ENTRIES; root_i++)
+                if (root[root_i]) munmap(root[root_i], DIRECTORY_ENTRIES * sizeof(Leaf));
+            munmap(root, ROOT_ENTRIES * sizeof(Directory));
+        }
+    }
+
+    bool put(MALLOC_META chunk) {
+        stats.put();
+        if (UNLIKELY(!chunk.ptr || !chunk.size || !is_aligned(chunk.ptr)))
+            return fallback_store.put(chunk);
+
+        if (UNLIKELY(!heap_span) && entries == 0 && chunk.is_main_arena() && !chunk.is_mmapped())
+            reserve_heap_shadow(chunk.ptr);
+
+        auto slot = slot_of(chunk.ptr, true);
+        if (UNLIKELY(!slot)) return fallback_store.put(chunk);
+        // each slot is a bin of one entry
+        stats.bin_fill(*slot != 0);
+        if (UNLIKELY(*slot)) return false;
+
+        *slot = chunk.size;
+        ++entries;
+
+        auto heap_offset = reinterpret_cast<uintptr_t>(chunk.ptr) - heap_base;
+        if (LIKELY(heap_offset < heap_span) && (heap_offset >> GRANULE_BITS) >= heap_slots_used)
+            heap_slots_used = (heap_offset >> GRANULE_BITS) + 1;
+        return true;
+    }
+
+    size_t put_many(MALLOC_META const* chunks, size_t count) {
+        return for_each_batched(chunks, count, [this](MALLOC_META chunk) { return put(chunk); });
+    }
+
+    MALLOC_META get(void* key) {
+        stats.get();
+        if (LIKELY(is_aligned(key))) {
+            auto slot = slot_of(key, false);
+            if (LIKELY(slot && *slot)) {
+                stats.probe(1);
+                return { key, *slot };
+            }
+        }
+
+        // the slot, then the fallback store
+        stats.probe(2);
+        auto found = fallback_store.get(key);
+        stats.fallback_lookup(found.is_some());
+        return found;
+    }
+
+    bool remove(MALLOC_META key) {
+        stats.remove();
+        if (LIKELY(is_aligned(key.ptr))) {
+            auto slot = slot_of(key.ptr, false);
+            if (LIKELY(slot && *slot)) {
+                stats.probe(1);
+                MALLOC_META found{ key.ptr, *slot };
+                if (UNLIKELY(found != key)) return false;
+                *slot = 0;
+                --entries;
+                return true;
+            }
+        }
+
+        stats.probe(2);
+        auto removed = fallback_store.remove(key);
+        stats.fallback_lookup(removed);
+        return removed;
+    }
+
+    size_t remove_many(MALLOC_META const* keys, size_t count) {
+        return for_each_batched(keys, count, [this](MALLOC_META key) { return remove(key); });
+    }
+
+    MALLOC_META take_if_matches(void* key, MALLOC_META expected) {
+        stats.remove();
+        if (LIKELY(is_aligned(key))) {
+            auto slot = slot_of(key, false);
+            if (LIKELY(slot && *slot)) {
+                stats.probe(1);
+                MALLOC_META stored{ key, *slot };
+                if (LIKELY(stored == expected)) {
+                    *slot = 0;
+                    --entries;
+                }
+                return stored;
+            }
+        }
+
+        stats.probe(2);
+        auto stored = fallback_store.take_if_matches(key, expected);
+        stats.fallback_lookup(stored.is_some());
+        return stored;
+    }
+
+    bool update(MALLOC_META key) {
+        if (LIKELY(is_aligned(key.ptr) && key.size)) {
+            auto slot = slot_of(key.ptr, false);
+            if (LIKELY(slot && *slot)) {
+                *slot = key.size;
+                return true;
+            }
+        }
+        return fallback_store.update(key);
+    }
+
+    size_t size() {
+        return entries + fallback_store.size();
+    }
+
+    /// Call `fn(chunk)` for every stored chunk.
+    /// This scans the used part of the heap shadow and all leaves, so it is slow.
+    template <class F>
+    void for_each(F&& fn) {
+        for (size_t i = 0; i < heap_slots_used; i++) {
+            if (!heap_shadow[i]) continue;
+            auto key = reinterpret_cast<void*>(heap_base + (i << GRANULE_BITS));
+            fn(MALLOC_META{ key, heap_shadow[i] });
+        }
+
+        for (size_t root_i = 0; root && root_i < ROOT_ENTRIES; root_i++) {
+            auto directory = root[root_i];
+            if (!directory) continue;
+            for (size_t directory_i = 0; directory_i < DIRECTORY_ENTRIES; directory_i++) {
+                auto leaf = directory[directory_i];
+                if (!leaf) continue;
+                auto leaf_base = root_i << (LEAF_BITS + DIRECTORY_BITS) | directory_i << LEAF_BITS;
+                for (size_t slot_i = 0; slot_i < LEAF_SLOTS; slot_i++) {
+                    if (!leaf[slot_i]) continue;
+                    auto key = reinterpret_cast<void*>(leaf_base | slot_i << GRANULE_BITS);
+                    fn(MALLOC_META{ key, leaf[slot_i] });
+                }
+            }
+        }
+
+        fallback_store.for_each(fn);
+    }
+
+    void clear() override {
+        // dropping the pages zeroes them, and gives the memory back
+        if (heap_shadow)
+            madvise(heap_shadow, (heap_span >> GRANULE_BITS) * sizeof(Slot), MADV_DONTNEED);
+        for_each_leaf([](Leaf leaf) { madvise(leaf, LEAF_SLOTS * sizeof(Slot), MADV_DONTNEED); });
+        entries = 0;
+        heap_slots_used = 0;
+        fallback_store.clear();
+        stats.reset();
+    }
+
+    /// The capacity is the number of slots in the main heap shadow.
+    StoreStats statistics() override {
+        auto result = stats.snapshot();
+        result.records_probe_lengths = true;
+        result.records_bin_fill = true;
+        result.entries = size();
+        result.capacity = heap_span >> GRANULE_BITS;
+        result.fallback_entries = fallback_store.size();
+        return result;
+    }
+
+    template <template <class V> class A>
+    using with_allocator = ShadowMetaStore<FallbackStore, A<MALLOC_META>>;
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include "../common/spinlock.h"
+#include "CachedMetaStore.h"
+#include "metastore.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+/// A thread-safe store that splits the keyspace into independently locked shards.
+///
+/// Each shard is a complete CachedMetaStore behind its own SpinLock,
+/// so two threads only contend when their chunks hash into the same shard.
+/// The number of shards MUST be a power of 2.
+template <
+    template <class A> class FallbackStore = MapMetaStore,
+    class Allocator = typename std::allocator<MALLOC_META>,
+    size_t Shards = 64>
+class ShardedMetaStore : public IMetaStore {
+    static_assert(Shards > 0 && (Shards & (Shards - 1)) == 0, "Shards must be a power of 2");
+
+    static constexpr size_t TYPICAL_CACHE_LINE_SIZE = 64;
+
+    // every shard gets its own cache line(s) to avoid false sharing between locks
+    struct alignas(TYPICAL_CACHE_LINE_SIZE) Shard {
+        SpinLock lock;
+        CachedMetaStore<FallbackStore, Allocator> store;
+    };
+
+    std::array<Shard, Shards> shards;
+
+    /// Select the shard by Fibonacci hashing.
+    /// This is deliberately independent from details::hash(),
+    /// whose bits already select the bin inside each shard.
+    Shard& get_shard(void* key) noexcept {
+        constexpr auto shard_bits = __builtin_ctzll(Shards);
+        if (shard_bits == 0) return shards[0];
+        auto x = reinterpret_cast<uint64_t>(key) >> 4;  // chunks are 16-byte aligned
+        x *= UINT64_C(0x9e3779b97f4a7c15);
+        return shards[x >> (64 - shard_bits)];
+    }
+
+    /// Apply `op(shard, element)` to each element under its shard's lock.
+    /// The lock is kept while consecutive elements fall into the same shard.
+    template <class F>
+    size_t for_each_locked(MALLOC_META const* elements, size_t count, F&& op) {
+        size_t succeeded = 0;
+        Shard* locked = nullptr;
+        for (size_t i = 0; i < count; i++) {
+            auto& shard = get_shard(elements[i].ptr);
+            if (&shard != locked) {
+                if (locked) locked->lock.unlock();
+                locked = &shard;
+                locked->lock.lock();
+            }
+            succeeded += op(shard, elements[i]);
+        }
+        if (locked) locked->lock.unlock();
+        return succeeded;
+    }
+
+public:
+    static constexpr bool is_thread_safe = true;
+
+    ShardedMetaStore() {
+    }
+
+    ~ShardedMetaStore() {
+    }
+
+    bool put(MALLOC_META chunk) {
+        auto& shard = get_shard(chunk.ptr);
+        std::lock_guard<SpinLock> guard{ shard.lock };
+        return shard.store.put(chunk);
+    }
+
+    MALLOC_META get(void* key) {
+        auto& shard = get_shard(key);
+        std::lock_guard<SpinLock> guard{ shard.lock };
+        return shard.store.get(key);
+    }
+
+    bool remove(MALLOC_META key) {
+        auto& shard = get_shard(key.ptr);
+        std::lock_guard<SpinLock> guard{ shard.lock };
+        return shard.store.remove(key);
+    }
+
+    MALLOC_META take_if_matches(void* key, MALLOC_META expected) {
+        auto& shard = get_shard(key);
+        std::lock_guard<SpinLock> guard{ shard.lock };
+        return shard.store.take_if_matches(key, expected);
+    }
+
+    size_t put_many(MALLOC_META const* chunks, size_t count) {
+        return for_each_locked(chunks, count, [](Shard& shard, MALLOC_META chunk) {
+            return shard.store.put(chunk);
+        });
+    }
+
+    size_t remove_many(MALLOC_META const* keys, size_t count) {
+        return for_each_locked(keys, count, [](Shard& shard, MALLOC_META key) {
+            return shard.store.remove(key);
+        });
+    }
+
+    bool update(MALLOC_META key) {
+        auto& shard = get_shard(key.ptr);
+        std::lock_guard<SpinLock> guard{ shard.lock };
+        return shard.store.update(key);
+    }
+
+    /// Sum of all shard sizes.
+    /// Only a snapshot if other threads modify the store concurrently.
+    size_t size() {
+        size_t total = 0;
+        for (auto& shard : shards) {
+            std::lock_guard<SpinLock> guard{ shard.lock };
+            total += shard.store.size();
+        }
+        return total;
+    }
+
+    /// The summed capacity of the caching layers of all shards.
+    size_t capacity() {
+        size_t total = 0;
+        for (auto& shard : shards) {
+            std::lock_guard<SpinLock> guard{ shard.lock };
+            total += shard.store.capacity();
+        }
+        return total;
+    }
+
+    /// Lock all shards, in the order of the array.
+    void lock_all() override {
+        for (auto& shard : shards)
+            shard.lock.lock();
+    }
+
+    void unlock_all() override {
+        for (auto& shard : shards)
+            shard.lock.unlock();
+    }
+
+    /// Spread the requested capacity evenly over all shards.
+    void reserve(size_t request) {
+        auto per_shard = (request + Shards - 1) / Shards;
+        for (auto& shard : shards) {
+            std::lock_guard<SpinLock> guard{ shard.lock };
+            shard.store.reserve(per_shard);
+        }
+    }
+
+    void clear() override {
+        for (auto& shard : shards) {
+            std::lock_guard<SpinLock> guard{ shard.lock };
+            shard.store.clear();
+        }
+    }
+
+    /// The sum of the statistics of all shards.
+    StoreStats statistics() override {
+        StoreStats total;
+        for (auto& shard : shards) {
+            std::lock_guard<SpinLock> guard{ shard.lock };
+            total += shard.store.statistics();
+        }
+        return total;
+    }
+
+    template <template <class V> class A>
+    using with_allocator = ShardedMetaStore<FallbackStore, A<MALLOC_META>, Shards>;
+};
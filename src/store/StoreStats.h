@@ -0,0 +1,193 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+
+/// Statistics about the behaviour of a metadata store.
+///
+/// The counters are only maintained if compiled with SHADOWHEAP_STORE_STATS,
+/// otherwise only the structural fields (entries, capacity) are filled in.
+/// Stores that are composed of other stores report the sum of their parts.
+struct StoreStats {
+    /// Histograms have one bucket per value, the last bucket also counts all larger values.
+    static constexpr size_t HISTOGRAM_SIZE = 16;
+
+    size_t entries = 0;
+    /// capacity of the primary table, 0 if the store has no fixed capacity
+    size_t capacity = 0;
+    size_t fallback_entries = 0;
+
+    size_t puts = 0;
+    size_t gets = 0;
+    size_t removes = 0;
+    /// lookups that weren't answered by the primary table
+    size_t fallback_lookups = 0;
+    /// ... and that found the key in the fallback store
+    size_t fallback_hits = 0;
+    /// entries that had to be moved into the fallback store
+    size_t evictions = 0;
+    /// entries that were moved to their alternate bin to make space
+    size_t displacements = 0;
+    /// entries that overflowed into a stash
+    size_t stash_inserts = 0;
+    /// number of times the primary table grew
+    size_t rehashes = 0;
+    /// number of times the primary table was halved
+    size_t shrinks = 0;
+
+    /// number of bins, groups or elements inspected per lookup
+    size_t probe_lengths[HISTOGRAM_SIZE] = {};
+    /// number of occupied entries in the target bin of an insertion
+    size_t bin_fill[HISTOGRAM_SIZE] = {};
+    /// Whether the store records the histograms. The trees and hash maps have no bins and record neither,
+    /// VectorMetaStore only records the probe lengths.
+    bool records_probe_lengths = false;
+    bool records_bin_fill = false;
+
+    StoreStats& operator+=(StoreStats const& other) noexcept {
+        entries += other.entries;
+        capacity += other.capacity;
+        fallback_entries += other.fallback_entries;
+        puts += other.puts;
+        gets += other.gets;
+        removes += other.removes;
+        fallback_lookups += other.fallback_lookups;
+        fallback_hits += other.fallback_hits;
+        evictions += other.evictions;
+        displacements += other.displacements;
+        stash_inserts += other.stash_inserts;
+        rehashes += other.rehashes;
+        shrinks += other.shrinks;
+        for (size_t i = 0; i < HISTOGRAM_SIZE; i++) {
+            probe_lengths[i] += other.probe_lengths[i];
+            bin_fill[i] += other.bin_fill[i];
+        }
+        records_probe_lengths |= other.records_probe_lengths;
+        records_bin_fill |= other.records_bin_fill;
+        return *this;
+    }
+
+    void dump(FILE* out, const char* name) const {
+        fprintf(out, "ShadowHeap: store statistics for %s\n", name);
+        fprintf(out, "  entries:          %zu (fallback: %zu)\n", entries, fallback_entries);
+        fprintf(out, "  capacity:         %zu\n", capacity);
+        fprintf(out, "  puts/gets/removes: %zu/%zu/%zu\n", puts, gets, removes);
+        fprintf(out, "  fallback lookups: %zu (hits: %zu)\n", fallback_lookups, fallback_hits);
+        fprintf(out, "  evictions:        %zu\n", evictions);
+        fprintf(out, "  displacements:    %zu\n", displacements);
+        fprintf(out, "  stash inserts:    %zu\n", stash_inserts);
+        fprintf(out, "  rehashes:         %zu (shrinks: %zu)\n", rehashes, shrinks);
+        dump_histogram(out, "probe lengths:", probe_lengths, records_probe_lengths);
+        dump_histogram(out, "bin fill:     ", bin_fill, records_bin_fill);
+    }
+
+private:
+    static void dump_histogram(FILE* out, const char* name, size_t const* histogram, bool recorded) {
+        fprintf(out, "  %s   ", name);
+        if (!recorded) {
+            fprintf(out, " n/a\n");
+            return;
+        }
+        for (size_t i = 0; i < HISTOGRAM_SIZE; i++)
+            fprintf(out, " %zu", histogram[i]);
+        fprintf(out, "\n");
+    }
+};
+
+namespace details {
+/// Counts events for StoreStats if SHADOWHEAP_STORE_STATS is enabled.
+template <bool Enabled>
+struct StatsCounter {
+    /// Guards counting that needs extra work, such as counting the occupied entries of a bin.
+    static constexpr bool enabled = true;
+
+    StoreStats stats;
+
+    static void add_to_histogram(size_t* histogram, size_t value) noexcept {
+        histogram[value < StoreStats::HISTOGRAM_SIZE ? value : StoreStats::HISTOGRAM_SIZE - 1]++;
+    }
+
+    void put() noexcept {
+        stats.puts++;
+    }
+    void get() noexcept {
+        stats.gets++;
+    }
+    void remove() noexcept {
+        stats.removes++;
+    }
+    void fallback_lookup(bool hit) noexcept {
+        stats.fallback_lookups++;
+        stats.fallback_hits += hit;
+    }
+    void eviction() noexcept {
+        stats.evictions++;
+    }
+    void displacement() noexcept {
+        stats.displacements++;
+    }
+    void stash_insert() noexcept {
+        stats.stash_inserts++;
+    }
+    void rehash() noexcept {
+        stats.rehashes++;
+    }
+    void shrink() noexcept {
+        stats.shrinks++;
+    }
+    void probe(size_t length) noexcept {
+        add_to_histogram(stats.probe_lengths, length);
+    }
+    void bin_fill(size_t occupied) noexcept {
+        add_to_histogram(stats.bin_fill, occupied);
+    }
+    void reset() noexcept {
+        stats = {};
+    }
+
+    StoreStats snapshot() const noexcept {
+        return stats;
+    }
+};
+
+/// Statistics are disabled: all counting compiles to nothing.
+template <>
+struct StatsCounter<false> {
+    static constexpr bool enabled = false;
+
+    void put() noexcept {
+    }
+    void get() noexcept {
+    }
+    void remove() noexcept {
+    }
+    void fallback_lookup(bool) noexcept {
+    }
+    void eviction() noexcept {
+    }
+    void displacement() noexcept {
+    }
+    void stash_insert() noexcept {
+    }
+    void rehash() noexcept {
+    }
+    void shrink() noexcept {
+    }
+    void probe(size_t) noexcept {
+    }
+    void bin_fill(size_t) noexcept {
+    }
+    void reset() noexcept {
+    }
+
+    StoreStats snapshot() const noexcept {
+        return {};
+    }
+};
+}  // namespace details
+
+#ifdef SHADOWHEAP_STORE_STATS
+using StoreStatsCounter = details::StatsCounter<true>;
+#else
+using StoreStatsCounter = details::StatsCounter<false>;
+#endif
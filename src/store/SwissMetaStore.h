@@ -0,0 +1,359 @@
+#pragma once
+
+#include "CachedMetaStore.h"  // for details::hash()
+#include "metastore.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace details {
+/// The control bytes of a group of 16 slots, one byte per slot.
+///
+/// A control byte is either EMPTY, DELETED, or holds the low 7 bits of the hash
+/// of the slot's key. This way, all 16 candidates of a group
+/// can be filtered with a single SIMD comparison
+/// before any MALLOC_META entry has to be loaded.
+struct SwissGroup {
+    static constexpr size_t WIDTH = 16;
+    static constexpr int8_t EMPTY = -128;  // 0b1000'0000
+    static constexpr int8_t DELETED = -2;  // 0b1111'1110
+
+    alignas(16) int8_t ctrl[WIDTH];
+
+    SwissGroup() {
+        for (auto& c : ctrl)
+            c = EMPTY;
+    }
+
+    /// Bitmask of the slots whose control byte equals `tag`.
+    uint32_t match(int8_t tag) const noexcept {
+#ifdef __SSE2__
+        auto group = _mm_load_si128(reinterpret_cast<const __m128i*>(ctrl));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < WIDTH; i++)
+            mask |= uint32_t(ctrl[i] == tag) << i;
+        return mask;
+#endif
+    }
+
+    uint32_t match_empty() const noexcept {
+        return match(EMPTY);
+    }
+
+    /// Bitmask of the slots that are EMPTY or DELETED, i.e. have the sign bit set.
+    uint32_t match_free() const noexcept {
+#ifdef __SSE2__
+        auto group = _mm_load_si128(reinterpret_cast<const __m128i*>(ctrl));
+        return _mm_movemask_epi8(group);
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < WIDTH; i++)
+            mask |= uint32_t(ctrl[i] < 0) << i;
+        return mask;
+#endif
+    }
+};
+}  // namespace details
+
+/// An open-addressing store in the style of the Abseil/Swiss tables.
+///
+/// Keys are probed group by group, and within a group by control-byte tags,
+/// so that a lookup usually costs one control-byte compare and one entry load.
+/// The control bytes are kept apart from the slots, like in Abseil:
+/// four groups of control bytes share a cache line, and the control bytes of the whole table
+/// are a sixteenth of its size, so they mostly stay cached. A lookup then usually touches
+/// one cache line of slots. If the slots followed their control bytes, a group would span five lines.
+/// There is no fallback store: the table grows before it gets too full.
+template <class Allocator = std::allocator<MALLOC_META>>
+class SwissMetaStore : public IMetaStore {
+    using Group = details::SwissGroup;
+    using GroupAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Group>;
+
+    /// Maximum load (including tombstones) is 7/8 of the capacity.
+    static constexpr size_t MAX_LOAD_NUMERATOR = 7;
+    static constexpr size_t MAX_LOAD_DENOMINATOR = 8;
+
+    /// Number of keys that are hashed and prefetched at once by the batched operations.
+    static constexpr size_t BATCH_SIZE = 16;
+
+    std::vector<Group, GroupAllocator> groups;
+    /// the slots of group `g` are `slots[g * Group::WIDTH ...]`
+    std::vector<MALLOC_META, Allocator> slots;
+    size_t entries = 0;
+    size_t tombstones = 0;
+    StoreStatsCounter stats;
+
+    static int8_t tag_of(size_t raw_hash) noexcept {
+        return static_cast<int8_t>(raw_hash & 0x7f);
+    }
+
+    /// Visit the groups in the probe sequence of a hash, as `visit(group, group_index)`,
+    /// until the callback returns true. Returns the number of visited groups.
+    /// Triangular probing visits every group if the group count is a power of 2.
+    template <class F>
+    size_t probe(size_t raw_hash, F&& visit) noexcept {
+        const auto mask = groups.size() - 1;
+        auto group_i = (raw_hash >> 7) & mask;
+        size_t step = 1;
+        for (; !visit(groups[group_i], group_i); step++)
+            group_i = (group_i + step) & mask;
+        return step;
+    }
+
+    MALLOC_META& slot(size_t group_i, int i) noexcept {
+        return slots[group_i * Group::WIDTH + i];
+    }
+
+    /// Locate the slot of a key, returns false if there is none.
+    bool locate(void* key, size_t raw_hash, size_t& found_group, int& found_i) noexcept {
+        const auto tag = tag_of(raw_hash);
+        bool found = false;
+        auto length = probe(raw_hash, [&](Group& group, size_t group_i) {
+            for (auto m = group.match(tag); m; m &= m - 1) {
+                auto i = __builtin_ctz(m);
+                if (LIKELY(slot(group_i, i).ptr == key)) {
+                    found = true;
+                    found_group = group_i;
+                    found_i = i;
+                    return true;
+                }
+            }
+            return group.match_empty() != 0;
+        });
+        stats.probe(length);
+        return found;
+    }
+
+    MALLOC_META* find(void* key) noexcept {
+        size_t group_i;
+        int i;
+        if (UNLIKELY(!locate(key, details::hash(key), group_i, i))) return nullptr;
+        return &slot(group_i, i);
+    }
+
+    void erase(size_t group_i, int i) noexcept {
+        // If this group still has an EMPTY slot, no probe ever continued past it,
+        // so the slot can become EMPTY again instead of leaving a tombstone.
+        auto& group = groups[group_i];
+        if (group.match_empty()) {
+            group.ctrl[i] = Group::EMPTY;
+        } else {
+            group.ctrl[i] = Group::DELETED;
+            ++tombstones;
+        }
+        slot(group_i, i) = {};
+        --entries;
+    }
+
+    /// Insert without checking for duplicates or load.
+    void insert_unchecked(MALLOC_META chunk) noexcept {
+        const auto raw_hash = details::hash(chunk.ptr);
+        probe(raw_hash, [&](Group& group, size_t group_i) {
+            auto m = group.match_free();
+            if (UNLIKELY(!m)) return false;
+            auto i = __builtin_ctz(m);
+            if (group.ctrl[i] == Group::DELETED) --tombstones;
+            group.ctrl[i] = tag_of(raw_hash);
+            slot(group_i, i) = chunk;
+            return true;
+        });
+        ++entries;
+    }
+
+    void rehash(size_t group_count) __attribute__((noinline)) {
+        std::vector<Group, GroupAllocator> old_groups(group_count);  // may throw
+        std::vector<MALLOC_META, Allocator> old_slots(group_count * Group::WIDTH);
+        stats.rehash();
+        std::swap(old_groups, groups);
+        std::swap(old_slots, slots);
+        entries = 0;
+        tombstones = 0;
+
+        for (size_t g = 0; g < old_groups.size(); g++)
+            for (size_t i = 0; i < Group::WIDTH; i++)
+                if (old_groups[g].ctrl[i] >= 0) insert_unchecked(old_slots[g * Group::WIDTH + i]);
+    }
+
+    bool fits(size_t used, size_t group_count) const noexcept {
+        auto capacity = group_count * Group::WIDTH;
+        return used * MAX_LOAD_DENOMINATOR <= capacity * MAX_LOAD_NUMERATOR;
+    }
+
+    /// Make sure that one more entry can be inserted.
+    void ensure_free_slot() {
+        if (LIKELY(fits(entries + tombstones + 1, groups.size()))) return;
+
+        // If the table is mostly tombstones, cleaning up is enough.
+        auto group_count = groups.size();
+        while (!fits(2 * (entries + 1), group_count))
+            group_count *= 2;
+        rehash(group_count);
+    }
+
+    void prefetch(size_t raw_hash) noexcept {
+        __builtin_prefetch(&groups[(raw_hash >> 7) & (groups.size() - 1)], 1);
+    }
+
+    bool put_hashed(MALLOC_META chunk, size_t raw_hash) {
+        stats.put();
+        if (UNLIKELY(!chunk.ptr)) return false;
+        ensure_free_slot();
+
+        // Look for duplicates and for the first free slot in a single probe.
+        const auto tag = tag_of(raw_hash);
+        Group* target_group = nullptr;
+        size_t target_group_i = 0;
+        int target_i = 0;
+        bool duplicate = false;
+        probe(raw_hash, [&](Group& group, size_t group_i) {
+            for (auto m = group.match(tag); m; m &= m - 1) {
+                if (UNLIKELY(slot(group_i, __builtin_ctz(m)).ptr == chunk.ptr)) {
+                    duplicate = true;
+                    return true;
+                }
+            }
+            auto free = group.match_free();
+            if (!target_group && free) {
+                stats.bin_fill(Group::WIDTH - __builtin_popcount(free));
+                target_group = &group;
+                target_group_i = group_i;
+                target_i = __builtin_ctz(free);
+            }
+            return group.match_empty() != 0;
+        });
+        if (UNLIKELY(duplicate)) return false;
+
+        if (target_group->ctrl[target_i] == Group::DELETED) --tombstones;
+        target_group->ctrl[target_i] = tag;
+        slot(target_group_i, target_i) = chunk;
+        ++entries;
+        return true;
+    }
+
+    bool remove_hashed(MALLOC_META key, size_t raw_hash) {
+        stats.remove();
+        size_t group_i;
+        int i;
+        if (UNLIKELY(!locate(key.ptr, raw_hash, group_i, i))) return false;
+        if (UNLIKELY(slot(group_i, i) != key)) return false;
+        erase(group_i, i);
+        return true;
+    }
+
+    /// Hash and prefetch a batch of keys, then apply `op(element, hash)` to each.
+    template <class F>
+    size_t for_each_batched(MALLOC_META const* elements, size_t count, F&& op) {
+        size_t succeeded = 0;
+        size_t hashes[BATCH_SIZE];
+        for (size_t first = 0; first < count; first += BATCH_SIZE) {
+            auto n = count - first < BATCH_SIZE ? count - first : BATCH_SIZE;
+            for (size_t i = 0; i < n; i++) {
+                hashes[i] = details::hash(elements[first + i].ptr);
+                prefetch(hashes[i]);
+            }
+            for (size_t i = 0; i < n; i++)
+                succeeded += op(elements[first + i], hashes[i]);
+        }
+        return succeeded;
+    }
+
+public:
+    /// capacity MUST be a power of 2 and at least one group.
+    explicit SwissMetaStore(size_t capacity = 128)
+        : groups(capacity / Group::WIDTH), slots(capacity / Group::WIDTH * Group::WIDTH) {
+    }
+
+    ~SwissMetaStore() {
+    }
+
+    bool put(MALLOC_META chunk) {
+        return put_hashed(chunk, details::hash(chunk.ptr));
+    }
+
+    size_t put_many(MALLOC_META const* chunks, size_t count) {
+        // grow at most once for the entire batch
+        reserve(entries + tombstones + count);
+        return for_each_batched(chunks, count, [this](MALLOC_META chunk, size_t raw_hash) {
+            return put_hashed(chunk, raw_hash);
+        });
+    }
+
+    MALLOC_META get(void* key) {
+        stats.get();
+        auto entry = find(key);
+        if (UNLIKELY(entry == nullptr)) return {};
+        return *entry;
+    }
+
+    bool remove(MALLOC_META key) {
+        return remove_hashed(key, details::hash(key.ptr));
+    }
+
+    size_t remove_many(MALLOC_META const* keys, size_t count) {
+        return for_each_batched(keys, count, [this](MALLOC_META key, size_t raw_hash) {
+            return remove_hashed(key, raw_hash);
+        });
+    }
+
+    MALLOC_META take_if_matches(void* key, MALLOC_META expected) {
+        stats.remove();
+        size_t group_i;
+        int i;
+        if (UNLIKELY(!locate(key, details::hash(key), group_i, i))) return {};
+
+        auto stored = slot(group_i, i);
+        if (LIKELY(stored == expected)) erase(group_i, i);
+        return stored;
+    }
+
+    bool update(MALLOC_META key) {
+        auto entry = find(key.ptr);
+        if (UNLIKELY(entry == nullptr)) return false;
+        *entry = key;
+        return true;
+    }
+
+    size_t size() {
+        return entries;
+    }
+
+    size_t capacity() {
+        return groups.size() * Group::WIDTH;
+    }
+
+    void reserve(size_t request) {
+        auto group_count = groups.size();
+        while (!fits(request, group_count))
+            group_count *= 2;
+        if (group_count != groups.size()) rehash(group_count);
+    }
+
+    void clear() override {
+        for (auto& group : groups)
+            group = Group{};
+        for (auto& entry : slots)
+            entry = {};
+        entries = 0;
+        tombstones = 0;
+        stats.reset();
+    }
+
+    StoreStats statistics() override {
+        auto result = stats.snapshot();
+        result.records_probe_lengths = true;
+        result.records_bin_fill = true;
+        result.entries = entries;
+        result.capacity = capacity();
+        return result;
+    }
+
+    template <template <class V> class A>
+    using with_allocator = SwissMetaStore<A<MALLOC_META>>;
+};
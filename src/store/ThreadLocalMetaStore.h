@@ -0,0 +1,417 @@
+#pragma once
+
+#include "../common/common.h"
+#include "../common/spinlock.h"
+#include "CachedMetaStore.h"
+#include "metastore.h"
+
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <pthread.h>
+
+namespace details {
+/// A bounded lock-free multi-producer single-consumer queue of metadata.
+///
+/// Based on the bounded MPMC queue by Dmitry Vyukov,
+/// with the consumer side simplified because it is guarded externally.
+/// Capacity MUST be a power of 2.
+template <size_t Capacity>
+class RemoteFreeQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+    static constexpr size_t TYPICAL_CACHE_LINE_SIZE = 64;
+
+    struct Cell {
+        std::atomic<size_t> sequence;
+        MALLOC_META meta;
+    };
+
+    Cell cells[Capacity];
+    alignas(TYPICAL_CACHE_LINE_SIZE) std::atomic<size_t> enqueue_pos{ 0 };
+    alignas(TYPICAL_CACHE_LINE_SIZE) size_t dequeue_pos = 0;
+
+public:
+    RemoteFreeQueue() {
+        for (size_t i = 0; i < Capacity; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    /// May be called by any thread. Returns false if the queue is full.
+    bool push(MALLOC_META meta) noexcept {
+        auto pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            auto& cell = cells[pos & (Capacity - 1)];
+            auto seq = cell.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.meta = meta;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// Must only be called by one thread at a time.
+    bool pop(MALLOC_META& meta) noexcept {
+        auto& cell = cells[dequeue_pos & (Capacity - 1)];
+        auto seq = cell.sequence.load(std::memory_order_acquire);
+        if (LIKELY(seq != dequeue_pos + 1)) return false;
+
+        meta = cell.meta;
+        cell.sequence.store(dequeue_pos + Capacity, std::memory_order_release);
+        ++dequeue_pos;
+        return true;
+    }
+};
+}  // namespace details
+
+/// A thread-safe store in which every thread owns a private CachedMetaStore.
+///
+/// The owner of a chunk is derived from the region of the heap that holds it, like glibc's
+/// arena_for_chunk(): the main arena, the mmapped chunks, or one heap of HEAP_MAX_SIZE bytes
+/// of another arena. The first thread that stores a chunk of a region owns the region,
+/// which is recorded in a lock-free directory. Threads usually allocate from an arena of their own,
+/// so same-thread operations only touch the owner's store, behind its uncontended lock.
+/// Threads that share an arena with its owner store their chunks under the owner's lock,
+/// where glibc also contends on the mutex of the arena.
+///
+/// A free from another thread tries to take the owner's lock, and then fails right away
+/// like with its own store. Only while another thread holds that lock, the free doesn't wait:
+/// it is pushed into the owner's lock-free queue, and the holder of the lock applies it
+/// before anything else, usually the owner on its next call. Until then the free is assumed to be valid.
+/// If the chunk isn't stored or doesn't match, the invalid or double free is reported
+/// when the queue is drained, see set_invalid_free_handler(). If the queue is full,
+/// the free waits for the owner's lock.
+///
+/// get() only has a pointer, so no region. It looks the chunk up in all thread stores.
+template <
+    template <class A> class FallbackStore = MapMetaStore,
+    class Allocator = typename std::allocator<MALLOC_META>>
+class ThreadLocalMetaStore : public IMetaStore {
+    static constexpr size_t TYPICAL_CACHE_LINE_SIZE = 64;
+    static constexpr size_t REMOTE_FREE_QUEUE_SIZE = 256;
+    /// the number of regions that can be owned, beyond those the regions share the overflow slot
+    static constexpr size_t DIRECTORY_SIZE = 1024;
+
+public:
+    /// Reports a free from another thread that the owner couldn't apply.
+    using InvalidFreeHandler = void (*)(MALLOC_META);
+
+private:
+    using SlotStore = CachedMetaStore<FallbackStore, Allocator>;
+
+    struct alignas(TYPICAL_CACHE_LINE_SIZE) Slot {
+        SpinLock lock;
+        pthread_t owner{};
+        Slot* next = nullptr;
+        SlotStore store;
+        details::RemoteFreeQueue<REMOTE_FREE_QUEUE_SIZE> remote_frees;
+
+        Slot() = default;
+
+        explicit Slot(pthread_t owner) : owner(owner) {
+        }
+
+        /// Apply all pending remote frees. The lock MUST be held.
+        void drain(InvalidFreeHandler on_invalid_free) {
+            MALLOC_META meta;
+            while (UNLIKELY(remote_frees.pop(meta)))
+                if (UNLIKELY(!store.remove(meta))) on_invalid_free(meta);
+        }
+    };
+
+    using SlotAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Slot>;
+
+    /// A region of the heap and the slot that owns it. The owner is published after the region.
+    struct DirectoryEntry {
+        std::atomic<uintptr_t> region{ 0 };
+        std::atomic<Slot*> owner{ nullptr };
+    };
+
+    static constexpr uintptr_t MAIN_ARENA_REGION = 1;
+    static constexpr uintptr_t MMAPPED_REGION = 2;
+    static constexpr uintptr_t HEAP_REGION = 4;
+
+    /// The region of the heap that holds `chunk`, never 0.
+    static uintptr_t region_of(MALLOC_META chunk) noexcept {
+        if (chunk.is_mmapped()) return MMAPPED_REGION;
+        if (chunk.is_main_arena()) return MAIN_ARENA_REGION;
+        return ((uintptr_t)chunk.ptr & ~(HEAP_MAX_SIZE - 1)) | HEAP_REGION;
+    }
+
+    /// Per-thread lookup cache of the slots of the thread, shared by all instances of this store type.
+    /// An entry belongs to the instance with its generation, which no other instance gets,
+    /// so the entry of a destroyed store is never used again, even by a store at the same address.
+    /// A few instances (e.g. the stores of several arenas) can be used alternately.
+    struct LocalCache {
+        static constexpr size_t ENTRIES = 4;
+        struct Entry {
+            uint64_t generation;
+            Slot* slot;
+        } entries[ENTRIES];
+
+        Entry& entry_for(uint64_t generation) noexcept {
+            return entries[generation % ENTRIES];
+        }
+    };
+
+    static LocalCache& local_cache() noexcept {
+        static thread_local LocalCache cache{};
+        return cache;
+    }
+
+    static uint64_t new_generation() noexcept {
+        static std::atomic<uint64_t> last{ 0 };
+        return ++last;
+    }
+
+    const uint64_t generation = new_generation();
+    std::atomic<Slot*> slots{ nullptr };
+    /// the first of the slots that lock_all() locked, a thread may add another in the meantime
+    Slot* locked_slots = nullptr;
+    DirectoryEntry directory[DIRECTORY_SIZE];
+    /// owns the regions that don't fit into the directory, all threads use it under its lock
+    Slot overflow;
+    InvalidFreeHandler on_invalid_free = report_invalid_free;
+
+    static void report_invalid_free(MALLOC_META meta) {
+        warn("FREE    (CHK ) Element of another thread has invalid metadata %p\n", meta.ptr);
+        warn("free(%p) failed\n", meta.ptr);
+        raise(SIGILL);
+    }
+
+    Slot& local_slot() {
+        auto& entry = local_cache().entry_for(generation);
+        if (LIKELY(entry.generation == generation)) return *entry.slot;
+        return register_thread();
+    }
+
+    /// Find or create the slot of the current thread.
+    Slot& register_thread() __attribute__((noinline)) {
+        auto self = pthread_self();
+        Slot* slot = nullptr;
+        for (auto s = slots.load(std::memory_order_acquire); s; s = s->next)
+            if (pthread_equal(s->owner, self)) slot = s;
+
+        if (!slot) {
+            SlotAllocator alloc;
+            slot = new (alloc.allocate(1)) Slot(self);
+            auto head = slots.load(std::memory_order_relaxed);
+            do {
+                slot->next = head;
+            } while (!slots.compare_exchange_weak(head, slot, std::memory_order_release));
+        }
+
+        local_cache().entry_for(generation) = { generation, slot };
+        return *slot;
+    }
+
+    /// The slot that owns `region`. With `claimant`, an unowned region is claimed for it,
+    /// otherwise nullptr is returned for it: no chunk of the region was ever stored.
+    Slot* owner_of(uintptr_t region, Slot* claimant) noexcept {
+        auto hash = (region >> 1) * UINT64_C(0x9e3779b97f4a7c15);
+        for (size_t i = 0; i < DIRECTORY_SIZE; i++) {
+            auto& entry = directory[(hash + i) & (DIRECTORY_SIZE - 1)];
+            auto known = entry.region.load(std::memory_order_acquire);
+            if (known == 0) {
+                if (!claimant) return nullptr;
+                if (entry.region.compare_exchange_strong(known, region, std::memory_order_acq_rel)) {
+                    entry.owner.store(claimant, std::memory_order_release);
+                    return claimant;
+                }
+                // another thread claimed this entry first, `known` is its region
+            }
+            if (known != region) continue;
+
+            // the claimant publishes itself right after the region
+            Slot* owner;
+            while (UNLIKELY(!(owner = entry.owner.load(std::memory_order_acquire))))
+                __builtin_ia32_pause();
+            return owner;
+        }
+        return &overflow;
+    }
+
+    /// Run `op(store)` on the store of `owner`, another thread, under its lock if it is free.
+    /// While the lock is held, the removal of `meta` is handed to the owner and `deferred` is returned.
+    template <class R, class Op>
+    R remove_remote(Slot& owner, MALLOC_META meta, R deferred, Op&& op) {
+        std::unique_lock<SpinLock> guard{ owner.lock, std::try_to_lock };
+        if (UNLIKELY(!guard.owns_lock())) {
+            if (LIKELY(owner.remote_frees.push(meta))) {
+                info("FREE    (RMT ) Deferred the check of %p, its owner is busy\n", meta.ptr);
+                return deferred;
+            }
+            guard.lock();
+        }
+        owner.drain(on_invalid_free);
+        return op(owner.store);
+    }
+
+public:
+    static constexpr bool is_thread_safe = true;
+
+    ThreadLocalMetaStore() {
+    }
+
+    ~ThreadLocalMetaStore() {
+        SlotAllocator alloc;
+        auto s = slots.exchange(nullptr);
+        while (s) {
+            auto next = s->next;
+            s->~Slot();
+            alloc.deallocate(s, 1);
+            s = next;
+        }
+    }
+
+    /// Report the frees from other threads that fail once they are applied with `handler`
+    /// instead of raising SIGILL.
+    void set_invalid_free_handler(InvalidFreeHandler handler) noexcept {
+        on_invalid_free = handler;
+    }
+
+    bool put(MALLOC_META chunk) {
+        auto& local = local_slot();
+        auto owner = owner_of(region_of(chunk), &local);
+        std::lock_guard<SpinLock> guard{ owner->lock };
+        owner->drain(on_invalid_free);
+        return owner->store.put(chunk);
+    }
+
+    /// Looks in the store of the calling thread first, then in all others.
+    MALLOC_META get(void* key) {
+        auto& local = local_slot();
+        {
+            std::lock_guard<SpinLock> guard{ local.lock };
+            local.drain(on_invalid_free);
+            auto found = local.store.get(key);
+            if (LIKELY(found.is_some())) return found;
+        }
+
+        for (auto s = slots.load(std::memory_order_acquire); s; s = s->next) {
+            if (s == &local) continue;
+            std::lock_guard<SpinLock> guard{ s->lock };
+            s->drain(on_invalid_free);
+            auto found = s->store.get(key);
+            if (found.is_some()) return found;
+        }
+
+        std::lock_guard<SpinLock> guard{ overflow.lock };
+        overflow.drain(on_invalid_free);
+        return overflow.store.get(key);
+    }
+
+    /// A chunk of another thread whose owner is busy is queued for it and reported as removed, see above.
+    bool remove(MALLOC_META key) {
+        auto& local = local_slot();
+        auto owner = owner_of(region_of(key), nullptr);
+        if (UNLIKELY(!owner)) return false;
+        if (UNLIKELY(owner != &local))
+            return remove_remote(*owner, key, true, [&](SlotStore& store) { return store.remove(key); });
+
+        std::lock_guard<SpinLock> guard{ local.lock };
+        local.drain(on_invalid_free);
+        return local.store.remove(key);
+    }
+
+    /// A chunk of another thread whose owner is busy is queued for it, and `expected` is returned
+    /// as if it matched, see above.
+    MALLOC_META take_if_matches(void* key, MALLOC_META expected) {
+        auto& local = local_slot();
+        auto owner = owner_of(region_of(expected), nullptr);
+        if (UNLIKELY(!owner)) return {};
+        if (UNLIKELY(owner != &local))
+            return remove_remote(
+                *owner, expected, expected, [&](SlotStore& store) { return store.take_if_matches(key, expected); });
+
+        std::lock_guard<SpinLock> guard{ local.lock };
+        local.drain(on_invalid_free);
+        return local.store.take_if_matches(key, expected);
+    }
+
+    bool update(MALLOC_META key) {
+        if (auto owner = owner_of(region_of(key), nullptr)) {
+            std::lock_guard<SpinLock> guard{ owner->lock };
+            owner->drain(on_invalid_free);
+            if (LIKELY(owner->store.update(key))) return true;
+        }
+
+        // The flags that select the region changed, which glibc never does. Move the chunk.
+        auto old = get(key.ptr);
+        if (!old.is_some()) return false;
+        auto owner = owner_of(region_of(old), nullptr);
+        {
+            std::lock_guard<SpinLock> guard{ owner->lock };
+            owner->drain(on_invalid_free);
+            if (!owner->store.remove(old)) return false;
+        }
+        return put(key);
+    }
+
+    /// The number of entries in all thread stores, after applying pending remote frees.
+    size_t size() {
+        size_t total = 0;
+        for_each_slot([&](Slot& slot) { total += slot.store.size(); });
+        return total;
+    }
+
+    /// Reserves space in the store of the calling thread only.
+    void reserve(size_t request) {
+        auto& local = local_slot();
+        std::lock_guard<SpinLock> guard{ local.lock };
+        local.store.reserve(request);
+    }
+
+    void clear() override {
+        for_each_slot([](Slot& slot) { slot.store.clear(); });
+    }
+
+    /// Lock the slots of all threads and the overflow slot, without applying their remote frees.
+    void lock_all() override {
+        locked_slots = slots.load(std::memory_order_acquire);
+        for (auto s = locked_slots; s; s = s->next)
+            s->lock.lock();
+        overflow.lock.lock();
+    }
+
+    void unlock_all() override {
+        overflow.lock.unlock();
+        for (auto s = locked_slots; s; s = s->next)
+            s->lock.unlock();
+        locked_slots = nullptr;
+    }
+
+    /// The sum of the statistics of all thread stores.
+    StoreStats statistics() override {
+        StoreStats total;
+        for_each_slot([&](Slot& slot) { total += slot.store.statistics(); });
+        return total;
+    }
+
+    template <template <class V> class A>
+    using with_allocator = ThreadLocalMetaStore<FallbackStore, A<MALLOC_META>>;
+
+private:
+    /// Run `fn(slot)` on every slot, under its lock and after applying its pending remote frees.
+    template <class F>
+    void for_each_slot(F&& fn) {
+        for (auto s = slots.load(std::memory_order_acquire); s; s = s->next) {
+            std::lock_guard<SpinLock> guard{ s->lock };
+            s->drain(on_invalid_free);
+            fn(*s);
+        }
+        std::lock_guard<SpinLock> guard{ overflow.lock };
+        overflow.drain(on_invalid_free);
+        fn(overflow);
+    }
+};
@@ -15,6 +15,14 @@ template <class Allocator = std::allocator<MALLOC_META>>
 class VectorMetaStore : public IMetaStore {
     using Container = std::vector<MALLOC_META, Allocator>;
     Container elements;
+    StoreStatsCounter stats;
+
+    /// The stored chunk for `key`, or the end. Not counted in the statistics,
+    /// so that a put() only counts as a put.
+    typename Container::iterator find(void* key) {
+        return std::find_if(
+            elements.begin(), elements.end(), [&](MALLOC_META const& el) { return el.ptr == key; });
+    }
 
 public:
     VectorMetaStore() {
@@ -24,7 +32,8 @@ public:
     }
 
     bool put(MALLOC_META chunk) {
-        if (chunk.ptr && !get(chunk.ptr).ptr) {
+        stats.put();
+        if (chunk.ptr && find(chunk.ptr) == elements.end()) {
             elements.emplace_back(chunk);
             return true;
         }
@@ -33,19 +42,42 @@ public:
     }
 
     MALLOC_META get(void* key) {
-        for (auto& chunk : elements) {
-            if (chunk.ptr == key) return chunk;
+        stats.get();
+        auto it = find(key);
+        if (it == elements.end()) {
+            stats.probe(elements.size());
+            return {};
+        }
+
+        stats.probe(it - elements.begin() + 1);
+        return *it;
+    }
+
+    MALLOC_META take_if_matches(void* key, MALLOC_META expected) {
+        stats.remove();
+        auto it = find(key);
+        if (it == elements.end()) return {};
+
+        auto stored = *it;
+        if (stored == expected) {
+            using std::swap;
+            swap(*it, elements.back());
+            elements.pop_back();
         }
+        return stored;
+    }
 
-        return {};
+    size_t put_many(MALLOC_META const* chunks, size_t count) {
+        elements.reserve(elements.size() + count);
+        size_t inserted = 0;
+        for (size_t i = 0; i < count; i++)
+            inserted += put(chunks[i]);
+        return inserted;
     }
 
     bool remove(MALLOC_META key) {
-        auto it = std::find_if(elements.begin(), elements.end(), [&](auto el) {
-            // debug("META KEY   (RM): %16p %16p %zu\n", &key, key.ptr, key.size);
-            // debug("META STORE (RM): %16p %16p %zu\n", &el, el.ptr, el.size);
-            return el.ptr == key.ptr;
-        });
+        stats.remove();
+        auto it = find(key.ptr);
         if (it == elements.end()) return false;
         if (*it != key) return false;
 
@@ -61,12 +93,28 @@ public:
         return elements.size();
     }
 
+    /// Call `fn(chunk)` for every stored chunk.
+    template <class F>
+    void for_each(F&& fn) {
+        for (auto& chunk : elements)
+            fn(chunk);
+    }
+
     void reserve(size_t size) override {
         elements.reserve(size);
     }
 
     void clear() {
         elements.clear();
+        stats.reset();
+    }
+
+    StoreStats statistics() override {
+        auto result = stats.snapshot();
+        result.records_probe_lengths = true;
+        result.entries = elements.size();
+        result.capacity = elements.capacity();
+        return result;
     }
 
     template <template <class V> class A>
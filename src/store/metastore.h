@@ -1,8 +1,12 @@
 #pragma once
 #include "../common/malloc_meta.h"
+#include "StoreStats.h"
 
 class IMetaStore {
 public:
+    /// whether the store may be used from multiple threads without external locking
+    static constexpr bool is_thread_safe = false;
+
     /// save metadata for a chunk
     virtual bool put(MALLOC_META chunk) = 0;
 
@@ -18,6 +22,31 @@ public:
         return old.is_some() && remove(old) && put(key);
     }
 
+    /// remove the entry for `key` if it matches `expected` (by pointer and chunksize),
+    /// with a single lookup. Returns the stored entry, which was removed iff it matches,
+    /// or an empty MALLOC_META if there is none.
+    virtual MALLOC_META take_if_matches(void* key, MALLOC_META expected) {
+        auto stored = get(key);
+        if (stored.is_some() && stored == expected && !remove(stored)) return {};
+        return stored;
+    }
+
+    /// save metadata for many chunks, returns the number of successful insertions
+    virtual size_t put_many(MALLOC_META const* chunks, size_t count) {
+        size_t inserted = 0;
+        for (size_t i = 0; i < count; i++)
+            inserted += put(chunks[i]);
+        return inserted;
+    }
+
+    /// remove many metadata entries (if they match), returns the number of removals
+    virtual size_t remove_many(MALLOC_META const* keys, size_t count) {
+        size_t removed = 0;
+        for (size_t i = 0; i < count; i++)
+            removed += remove(keys[i]);
+        return removed;
+    }
+
     /// get the number of currently stored metadata entries
     virtual size_t size() = 0;
 
@@ -29,6 +58,22 @@ public:
     // Deletes all elements
     virtual void clear() = 0;
 
+    /// Report the size of the store and, if compiled with SHADOWHEAP_STORE_STATS,
+    /// the counters collected since the last clear().
+    virtual StoreStats statistics() {
+        StoreStats stats;
+        stats.entries = size();
+        return stats;
+    }
+
+    /// Hold all locks of the store until unlock_all(), so that no other thread is in the middle
+    /// of an operation, e.g. across fork(). A store without locks of its own does nothing.
+    virtual void lock_all() {
+    }
+
+    virtual void unlock_all() {
+    }
+
     template <template <class V> class Allocator>
     using with_allocator = void;
 };
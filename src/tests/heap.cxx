@@ -0,0 +1,858 @@
+// Tests of the snapshots of the glibc heap that the facade keeps, on fake tcaches and chunks.
+// Built twice, as heap.t and with -mavx2 as heap-avx2.t, so that both code paths are covered.
+
+#include "../facade/FastbinShadow.h"
+#include "../facade/ShadowHeapFacade.h"
+#include "../facade/SortedBinShadow.h"
+#include "../facade/UnsortedBinModel.h"
+#include "../leak/leak.h"
+#include "../tests/tap.h"
+
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/// Fake chunks in a buffer, laid out one after the other like in a glibc heap.
+/// The tests link them into bins like glibc does.
+class FakeHeap {
+    static constexpr size_t SIZE = 1 << 20;
+    unsigned char* memory;
+    size_t used = 0;
+
+public:
+    FakeHeap() : memory(static_cast<unsigned char*>(std::calloc(1, SIZE))) {
+    }
+
+    FakeHeap(FakeHeap const&) = delete;
+
+    ~FakeHeap() {
+        std::free(memory);
+    }
+
+    /// A new chunk of the given size after the previous one, in use.
+    CHUNK_HEADER* chunk(size_t size) {
+        auto chunk = reinterpret_cast<CHUNK_HEADER*>(memory + used);
+        chunk->size = size | PREV_INUSE;
+        used += size;
+        return chunk;
+    }
+
+    /// A new bin, whose header links to itself while the list is empty.
+    CHUNK_HEADER* bin() {
+        auto bin = chunk(MIN_CHUNK_SIZE);
+        bin->fd = bin;
+        bin->bk = bin;
+        return bin;
+    }
+};
+
+/// Insert `chunk` at the head of the list `bin`, like glibc does on free() or when it sorts out chunks.
+void insert_head(CHUNK_HEADER* bin, CHUNK_HEADER* chunk) {
+    chunk->fd = bin->fd;
+    chunk->bk = bin;
+    bin->fd->bk = chunk;
+    bin->fd = chunk;
+}
+
+/// Take the chunk at the tail of the list `bin`, like glibc does when it sorts out or allocates a chunk.
+CHUNK_HEADER* take_tail(CHUNK_HEADER* bin) {
+    auto chunk = bin->bk;
+    bin->bk = chunk->bk;
+    chunk->bk->fd = bin;
+    return chunk;
+}
+
+/// Remove `chunk` from the middle of its list, like glibc's unlink_chunk().
+void unlink_chunk(CHUNK_HEADER* chunk) {
+    chunk->fd->bk = chunk->bk;
+    chunk->bk->fd = chunk->fd;
+}
+
+/// A new free chunk, followed by a chunk in use that repeats its size as prev_size.
+CHUNK_HEADER* free_chunk(FakeHeap& heap, size_t size) {
+    auto chunk = heap.chunk(size);
+    auto next = heap.chunk(MIN_CHUNK_SIZE);
+    next->prev_size = size;
+    next->size &= ~PREV_INUSE;
+    return chunk;
+}
+
+/// Link `chunk` into a list in the place of `old`.
+void replace_chunk(CHUNK_HEADER* old, CHUNK_HEADER* chunk) {
+    chunk->fd = old->fd;
+    chunk->bk = old->bk;
+    old->fd->bk = chunk;
+    old->bk->fd = chunk;
+}
+
+/// The fd of a chunk in a fastbin that points to `next`, like glibc's PROTECT_PTR() since 2.32.
+CHUNKPTR* protect(CHUNKPTR* chunk, CHUNKPTR* next, bool safe_linking) {
+    if (!safe_linking) return next;
+    return (CHUNKPTR*)(((uintptr_t)&chunk->fd >> 12) ^ (uintptr_t)next);
+}
+
+/// Push `chunk` onto a fastbin, like free() does.
+void push_fastbin(CHUNKPTR*& fastbin, CHUNKPTR* chunk, bool safe_linking) {
+    chunk->fd = protect(chunk, fastbin, safe_linking);
+    fastbin = chunk;
+}
+
+/// Pop the head of a fastbin, like malloc() does.
+void pop_fastbin(CHUNKPTR*& fastbin, bool safe_linking) {
+    auto chunk = fastbin;
+    fastbin = protect(chunk, chunk->fd, safe_linking);
+}
+
+/// The dirty bins as the scalar fallback computes them, bin by bin.
+template <class TcacheLayout>
+uint64_t expected_dirty_bins(TcacheLayout const& a, TcacheLayout const& b) {
+    uint64_t dirty = 0;
+    for (int i = 0; i < TCACHE_ENTRIES; i++)
+        dirty |= uint64_t(a.counts[i] != b.counts[i] || a.entries[i] != b.entries[i]) << i;
+    return dirty;
+}
+
+template <class TcacheLayout>
+void test_tcache_dirty_bins(TAP& tap, const char* name) {
+    tap.subtest(name, 6, [](TAP& tap) {
+        TcacheLayout before, after;
+        std::memset(&before, 0, sizeof(before));
+        for (int i = 0; i < TCACHE_ENTRIES; i++) {
+            before.counts[i] = i % 7;
+            before.entries[i] = (tcache_entry*)(0x555555550000 + 0x100 * i);
+        }
+
+        after = before;
+        tap.ok_eq(tcache_dirty_bins(after, before), 0u, "no bin changed");
+
+        bool counts_ok = true;
+        bool heads_ok = true;
+        for (int i = 0; i < TCACHE_ENTRIES; i++) {
+            after = before;
+            after.counts[i]++;
+            counts_ok &= tcache_dirty_bins(after, before) == uint64_t(1) << i;
+            after = before;
+            after.entries[i] = nullptr;
+            heads_ok &= tcache_dirty_bins(after, before) == uint64_t(1) << i;
+        }
+        tap.ok(counts_ok, "a changed count marks exactly its own bin, for all 64 bins");
+        tap.ok(heads_ok, "a changed head marks exactly its own bin, for all 64 bins");
+
+        // the counts of the 2.30 layout have 16 bits, a change above the first 8 must be found, too
+        bool high_ok = true;
+        for (int i = 0; i < TCACHE_ENTRIES; i++) {
+            after = before;
+            after.counts[i] ^= (sizeof(after.counts[i]) > 1 ? 0x100 : 0x80);
+            high_ok &= tcache_dirty_bins(after, before) == uint64_t(1) << i;
+        }
+        tap.ok(high_ok, "a change in the highest bits of a count marks its bin");
+
+        after = before;
+        for (int i = 0; i < TCACHE_ENTRIES; i++)
+            after.counts[i]++;
+        tap.ok_eq(tcache_dirty_bins(after, before), ~uint64_t(0), "all bins changed");
+
+        // patterns that mix counts and heads across the lanes of the vectors
+        bool patterns_ok = true;
+        uint64_t state = 0x9E3779B97F4A7C15ull;
+        for (int round = 0; round < 1000; round++) {
+            after = before;
+            for (int i = 0; i < TCACHE_ENTRIES; i++) {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                if (state & 1) after.counts[i] += 1 + (state >> 8) % 3;
+                if (state & 2) after.entries[i] = (tcache_entry*)(state & ~uint64_t(0xf));
+            }
+            patterns_ok &= tcache_dirty_bins(after, before) == expected_dirty_bins(after, before);
+        }
+        tap.ok(patterns_ok, "random patterns match the bin by bin comparison");
+    });
+}
+
+void test_UnsortedBinModel(TAP& tap) {
+    tap.subtest("UnsortedBinModel follows the changes of the unsorted bin", 20, [](TAP& tap) {
+        FakeHeap heap;
+        auto bin = heap.bin();
+        CHUNKPTR* fastbins[NFASTBINS] = {};
+        unsigned long heap_operations = 0;
+        UnsortedBinModel model;
+
+        // chunks that don't border each other, and pairs of neighbours for consolidation
+        CHUNK_HEADER* chunks[6];
+        for (auto& chunk : chunks) {
+            chunk = heap.chunk(0x90);
+            heap.chunk(0x20);
+        }
+        auto prev = heap.chunk(0x90);
+        auto freed_after_prev = heap.chunk(0x90);
+        heap.chunk(0x20);
+        auto freed_before_next = heap.chunk(0x90);
+        auto next = heap.chunk(0x90);
+        heap.chunk(0x20);
+
+        auto update = [&](UnsortedBinChanges changes) {
+            changes.known = true;
+            return model.update(bin, fastbins, heap_operations, changes);
+        };
+
+        for (int i = 0; i < 3; i++)
+            insert_head(bin, chunks[i]);
+        tap.ok(model.rebuild(bin, fastbins, heap_operations) == nullptr, "rebuild() records the list");
+        tap.ok_eq(model.size(), 3u, "all chunks are recorded");
+        tap.ok(model.verify(bin, 100) == nullptr, "the recorded list verifies");
+
+        insert_head(bin, chunks[3]);
+        insert_head(bin, chunks[4]);
+        tap.ok(update({}) && model.size() == 5, "update() follows pushes at the head");
+        tap.ok(model.verify(bin, 100) == nullptr, "the list verifies after pushes");
+
+        take_tail(bin);
+        take_tail(bin);
+        tap.ok(update({}) && model.size() == 3, "update() follows sort-outs at the tail");
+        tap.ok(model.verify(bin, 100) == nullptr, "the list verifies after sort-outs");
+
+        // free() consolidates the freed chunk with the free chunk before it, which is in the middle
+        insert_head(bin, prev);
+        insert_head(bin, chunks[5]);
+        tap.ok(update({}) && model.size() == 5, "update() follows more pushes");
+        {
+            UnsortedBinChanges changes;
+            changes.freed = freed_after_prev;
+            changes.freed_size = 0x90;
+            changes.prev = prev;
+            changes.prev_size = 0x90;
+            unlink_chunk(prev);
+            prev->size = 0x120 | PREV_INUSE;
+            insert_head(bin, prev);
+            tap.ok(update(changes) && model.size() == 5, "update() follows a backward consolidation");
+            tap.ok_eq(model.get(prev).chunksize, 0x120u, "the consolidated chunk is recorded with its new size");
+            tap.ok(model.verify(bin, 100) == nullptr, "the list verifies after a backward consolidation");
+        }
+
+        // free() consolidates the freed chunk with the free chunk after it, which is in the middle
+        insert_head(bin, next);
+        insert_head(bin, chunks[0]);
+        tap.ok(update({}) && model.size() == 7, "update() follows pushes before a consolidation");
+        {
+            UnsortedBinChanges changes;
+            changes.freed = freed_before_next;
+            changes.freed_size = 0x90;
+            changes.next = next;
+            changes.next_size = 0x90;
+            unlink_chunk(next);
+            freed_before_next->size = 0x120 | PREV_INUSE;
+            insert_head(bin, freed_before_next);
+            bool updated = update(changes);
+            tap.ok(updated && model.size() == 7 && model.get(next).ptr == nullptr,
+                   "update() follows a forward consolidation");
+            tap.ok(model.verify(bin, 100) == nullptr, "the list verifies after a forward consolidation");
+        }
+
+        // malloc_consolidate() empties the fastbins, and may unlink chunks anywhere
+        fastbins[3] = (CHUNKPTR*)heap.chunk(0x50);
+        tap.ok(!update({}), "update() gives up when another fastbin changed");
+        tap.ok(model.rebuild(bin, fastbins, heap_operations) == nullptr, "rebuild() records the list again");
+        heap_operations++;
+        tap.ok(!update({}), "update() gives up after internal heap operations");
+        model.rebuild(bin, fastbins, heap_operations);
+
+        // corruption
+        auto middle = bin->fd->fd->fd;
+        auto size = middle->size;
+        middle->size = 0x1000 | PREV_INUSE;
+        tap.ok(model.verify(bin, 100) == middle, "the sweep finds a corrupted chunk in the middle");
+        middle->size = size;
+
+        auto tail = bin->bk;
+        bin->bk = middle;
+        tap.ok(model.verify(bin, 100) == bin, "verify() finds a changed end of the list");
+        bin->bk = tail;
+
+        // a cycle that never returns to the bin
+        chunks[1]->fd = chunks[2];
+        chunks[2]->fd = chunks[1];
+        bin->fd = chunks[1];
+        tap.ok(model.rebuild(bin, fastbins, heap_operations) == chunks[1], "rebuild() finds a cycle");
+    });
+}
+
+void test_FastbinShadow(TAP& tap, const char* name, bool safe_linking) {
+    tap.subtest(name, 14, [safe_linking](TAP& tap) {
+        FakeHeap heap;
+        CHUNKPTR* fastbins[NFASTBINS] = {};
+        FastbinShadow shadow;
+        shadow.use_safe_linking(safe_linking);
+
+        constexpr size_t fidx = 2;
+        CHUNKPTR* chunks[16];
+        for (auto& chunk : chunks)
+            chunk = (CHUNKPTR*)heap.chunk(0x40);
+        auto& fastbin = fastbins[fidx];
+
+        tap.ok(shadow.update(fastbins, NFASTBINS, nullptr) == nullptr, "empty fastbins are recorded");
+        tap.ok_eq(shadow.verify(fastbins, fidx), size_t(NFASTBINS), "empty fastbins verify");
+
+        bool pushes_ok = true;
+        for (int i = 0; i < 8; i++) {
+            push_fastbin(fastbin, chunks[i], safe_linking);
+            pushes_ok &= shadow.update(fastbins, fidx, chunks[i]) == nullptr;
+            pushes_ok &= shadow.verify(fastbins, fidx) == NFASTBINS;
+        }
+        tap.ok(pushes_ok && shadow.size(fidx) == 8, "update() follows pushes");
+
+        pop_fastbin(fastbin, safe_linking);
+        tap.ok(shadow.update(fastbins, fidx, nullptr) == nullptr && shadow.size(fidx) == 7,
+               "update() follows a pop");
+        tap.ok_eq(shadow.verify(fastbins, fidx), size_t(NFASTBINS), "the fastbin verifies after a pop");
+
+        // malloc() moves chunks of the same size into the tcache along with the one it returns
+        for (int i = 0; i < 4; i++)
+            pop_fastbin(fastbin, safe_linking);
+        tap.ok(shadow.update(fastbins, fidx, nullptr) == nullptr && shadow.size(fidx) == 3,
+               "update() follows several pops at once");
+
+        fastbins[5] = chunks[12];
+        chunks[12]->fd = protect(chunks[12], nullptr, safe_linking);
+        tap.ok_eq(shadow.verify(fastbins, fidx), 5u, "verify() finds a changed head of another fastbin");
+        fastbins[5] = nullptr;
+
+        auto fd = fastbin->fd;
+        fastbin->fd = protect(fastbin, chunks[13], safe_linking);
+        tap.ok_eq(shadow.verify(fastbins, fidx), fidx, "verify() finds a corrupted fd of the head");
+        fastbin->fd = fd;
+
+        // malloc() follows the fd of the second chunk too, when it moves it into the tcache
+        auto second = chunks[1];
+        second->fd = protect(second, chunks[13], safe_linking);
+        tap.ok_eq(shadow.verify(fastbins, fidx), fidx, "verify() finds a corrupted fd of the second chunk");
+        for (int i = 0; i < 2; i++)
+            pop_fastbin(fastbin, safe_linking);
+        tap.ok(shadow.update(fastbins, fidx, nullptr) == chunks[13],
+               "update() reports a head that the pops don't explain");
+        second->fd = protect(second, chunks[0], safe_linking);
+
+        // malloc_consolidate() empties all fastbins
+        fastbin = nullptr;
+        tap.ok(shadow.update(fastbins, NFASTBINS, nullptr) == nullptr && shadow.size(fidx) == 0,
+               "update() follows an emptied fastbin");
+
+        // cycles: through the head, further down, and a long one
+        auto cycle = [&](size_t length, size_t back_to) {
+            for (size_t i = 0; i < length; i++) {
+                auto next = i + 1 < length ? chunks[i + 1] : chunks[back_to];
+                chunks[i]->fd = protect(chunks[i], next, safe_linking);
+            }
+            fastbin = chunks[0];
+            auto linked_twice = shadow.update(fastbins, NFASTBINS, nullptr);
+            fastbin = nullptr;
+            shadow.update(fastbins, NFASTBINS, nullptr);
+            return linked_twice;
+        };
+        tap.ok(cycle(2, 0) != nullptr, "rebuild() finds a cycle through the head");
+        tap.ok(cycle(5, 2) != nullptr, "rebuild() finds a cycle further down");
+        tap.ok(cycle(16, 1) != nullptr, "rebuild() finds a long cycle");
+    });
+}
+
+void test_fastbin_and_tcache_indices(TAP& tap) {
+    tap.subtest("csize2fidx() and request2tidx() match glibc", 4, [](TAP& tap) {
+        // glibc: fastbin_index(sz) = (sz >> 4) - 2, for the sizes up to request2size(MAX_FAST_SIZE)
+        bool fastbins_ok = true;
+        for (size_t size = 0x20; size <= 0xb0; size += MALLOC_ALIGNMENT)
+            fastbins_ok &= csize2fidx(size) == (size >> 4) - 2;
+        tap.ok(fastbins_ok, "the fastbins of the sizes 0x20 to 0xb0");
+
+        bool larger_ok = csize2fidx(0x10) == NFASTBINS;
+        for (size_t size = 0xc0; size <= 0x10000; size += MALLOC_ALIGNMENT)
+            larger_ok &= csize2fidx(size) == NFASTBINS;
+        tap.ok(larger_ok, "other sizes have no fastbin");
+
+        // glibc: csize2tidx(request2size(req)), with the largest tcache request 1032
+        struct {
+            size_t request, tidx;
+        } const boundaries[] = { { 0, 0 },   { 24, 0 },   { 25, 1 },    { 40, 1 },    { 41, 2 },
+                                 { 56, 2 },  { 57, 3 },   { 1016, 62 }, { 1017, 63 }, { 1032, 63 },
+                                 { 1033, 64 } };
+        bool boundaries_ok = true;
+        for (auto const& b : boundaries)
+            boundaries_ok &= request2tidx(b.request) == b.tidx;
+        tap.ok(boundaries_ok, "the tcache bins at the boundaries of the requests");
+
+        bool tidx_ok = true;
+        for (size_t request = 0; request <= 2048; request++) {
+            size_t nb = request + 8 + 15 < 32 ? 32 : (request + 8 + 15) & ~size_t(15);
+            tidx_ok &= request2tidx(request) == (nb - 32 + 15) / 16;
+        }
+        tap.ok(tidx_ok, "the tcache bins of all requests up to 2048");
+    });
+}
+
+/// The smallbins and largebins of a fake arena, with the binmap that glibc keeps for them.
+struct FakeBins {
+    CHUNKPTR* bins[NBINS * 2 - 2];
+    unsigned int binmap[BINMAPSIZE] = {};
+    CHUNKPTR* fastbins[NFASTBINS] = {};
+
+    FakeBins() {
+        for (size_t i = 1; i < NBINS; i++) {
+            auto bin = header(i);
+            bin->fd = bin;
+            bin->bk = bin;
+        }
+    }
+
+    FakeBins(FakeBins const&) = delete;
+
+    /// The header of bin `i`, like glibc's bin_at().
+    CHUNK_HEADER* header(size_t i) {
+        return CHUNK_HEADER::from_memory((void*)&bins[(i - 1) * 2]);
+    }
+
+    /// Insert `chunk` at the head of its bin and mark the bin, like glibc does when it sorts out a chunk.
+    void insert(size_t i, CHUNK_HEADER* chunk) {
+        insert_head(header(i), chunk);
+        binmap[i >> BINMAPSHIFT] |= 1U << (i & (BITSPERMAP - 1));
+    }
+};
+
+void test_SortedBinShadow(TAP& tap) {
+    tap.subtest("SortedBinShadow follows the ends of the bins and sweeps their middle", 16, [](TAP& tap) {
+        FakeHeap heap;
+        FakeBins arena;
+        SortedBinShadow shadow;
+        unsigned long heap_operations = 0;
+
+        constexpr size_t small = 0x100, large = 0x500;
+        constexpr size_t sbidx = csize2bidx(small), lbidx = csize2bidx(large);
+        CHUNK_HEADER* smalls[8];
+        for (auto& chunk : smalls)
+            chunk = free_chunk(heap, small);
+        CHUNK_HEADER* larges[5];
+        for (auto& chunk : larges)
+            chunk = free_chunk(heap, large);
+        auto unsorted = free_chunk(heap, large);
+
+        auto update = [&](SortedBinChanges changes) {
+            changes.known = true;
+            shadow.update(arena.bins, arena.binmap, arena.fastbins, heap_operations, changes);
+        };
+        auto verify = [&](size_t bidx, size_t budget) {
+            return shadow.verify(arena.bins, arena.binmap, bidx, budget);
+        };
+
+        shadow.update(arena.bins, arena.binmap, arena.fastbins, heap_operations, {});
+        tap.ok(verify(sbidx, 100) == nullptr, "empty bins verify");
+
+        for (int i = 0; i < 6; i++)
+            arena.insert(sbidx, smalls[i]);
+        update({});
+        tap.ok(verify(sbidx, 0) == nullptr, "the ends verify after pushes");
+
+        take_tail(arena.header(sbidx));
+        update({});
+        tap.ok(verify(sbidx, 0) == nullptr, "the ends verify after a chunk was taken from the tail");
+
+        // the second complete sweep over the settled bin compares the digest
+        tap.ok(verify(sbidx, 100) == nullptr, "sweeps over the unchanged bin verify");
+
+        auto head = arena.header(sbidx)->fd;
+        head->size += MALLOC_ALIGNMENT;
+        tap.ok(verify(sbidx, 0) == head, "verify() finds a corrupted head");
+        head->size -= MALLOC_ALIGNMENT;
+
+        arena.binmap[0] ^= 1U << 5;
+        tap.ok(verify(sbidx, 0) == arena.header(5), "verify() finds a changed binmap");
+        arena.binmap[0] ^= 1U << 5;
+
+        // a chunk swapped into the middle with consistent links and size, while another bin changed
+        auto middle = smalls[3];
+        replace_chunk(middle, smalls[6]);
+        update({});
+        tap.ok(verify(sbidx, 100) == arena.header(sbidx), "the sweep finds a chunk swapped into the middle");
+        // after a mismatch the bin stays corrupted until an unknown change records it again
+        replace_chunk(smalls[6], middle);
+        heap_operations++;
+        update({});
+        tap.ok(verify(sbidx, 100) == nullptr, "the bin verifies again once it was recorded again");
+
+        insert_head(middle, smalls[7]);
+        tap.ok(verify(sbidx, 100) != nullptr, "the sweep finds a chunk inserted into the middle");
+        unlink_chunk(smalls[7]);
+        heap_operations++;
+        update({});
+        tap.ok(verify(sbidx, 100) == nullptr, "the bin without the inserted chunk verifies again");
+
+        // free() consolidates a free neighbour and unlinks it from the middle of its bin
+        unlink_chunk(middle);
+        SortedBinChanges consolidate;
+        consolidate.neighbours[0] = sbidx;
+        update(consolidate);
+        tap.ok(verify(sbidx, 100) == nullptr, "a consolidated neighbour may leave the middle");
+
+        // an unexpected operation of glibc itself, e.g. a realloc()
+        smalls[2]->next_chunk()->prev_size = 0;
+        heap_operations++;
+        update({});
+        tap.ok(verify(sbidx, 100) == smalls[2], "a sweep after an unknown change checks each chunk");
+        smalls[2]->next_chunk()->prev_size = small;
+
+        for (auto chunk : larges)
+            arena.insert(lbidx, chunk);
+        heap_operations++;
+        update({});
+        tap.ok(verify(lbidx, 100) == nullptr, "the largebin verifies");
+
+        // malloc() sorts out the unsorted bin and inserts its chunks into the largebins by size
+        insert_head(arena.header(1), unsorted);
+        update({});
+        take_tail(arena.header(1));
+        insert_head(larges[2], unsorted);
+        update({});
+        tap.ok(verify(lbidx, 100) == nullptr, "a sorted-out chunk may enter the middle of a largebin");
+
+        // malloc() takes a best fit out of the middle of a largebin
+        unlink_chunk(unsorted);
+        SortedBinChanges best_fit;
+        best_fit.best_fit = lbidx;
+        update(best_fit);
+        tap.ok(verify(lbidx, 100) == nullptr, "a best fit may leave the middle of a largebin");
+
+        unlink_chunk(larges[2]);
+        update({});
+        tap.ok(verify(lbidx, 100) != nullptr, "the sweep finds a chunk that left the middle otherwise");
+    });
+}
+
+/// glibc's bin_index() on 64 bit, to compare csize2bidx() against.
+size_t glibc_bin_index(size_t sz) {
+    if (sz < 64 * 16) return sz >> 4;
+    return ((sz >> 6) <= 48)    ? 48 + (sz >> 6)
+           : ((sz >> 9) <= 20)  ? 91 + (sz >> 9)
+           : ((sz >> 12) <= 10) ? 110 + (sz >> 12)
+           : ((sz >> 15) <= 4)  ? 119 + (sz >> 15)
+           : ((sz >> 18) <= 2)  ? 124 + (sz >> 18)
+                                : 126;
+}
+
+void test_bin_indices(TAP& tap) {
+    tap.subtest("csize2bidx() matches glibc's bin_index()", 2, [](TAP& tap) {
+        struct {
+            size_t chunksize, bidx;
+        } const boundaries[] = { { 0x20, 2 },      { 1008, 63 },     { 1024, 64 },     { 3072, 96 },
+                                 { 3136, 97 },     { 10240, 111 },   { 10752, 112 },   { 40960, 120 },
+                                 { 45056, 120 },   { 131072, 123 },  { 163840, 124 },  { 262144, 125 },
+                                 { 524288, 126 },  { 786432, 126 } };
+        bool boundaries_ok = true;
+        for (auto const& b : boundaries)
+            boundaries_ok &= csize2bidx(b.chunksize) == b.bidx && glibc_bin_index(b.chunksize) == b.bidx;
+        tap.ok(boundaries_ok, "the bins at the boundaries of their spacing");
+
+        bool all_ok = true;
+        for (size_t size = MIN_CHUNK_SIZE; size <= (size_t(1) << 21); size += MALLOC_ALIGNMENT)
+            all_ok &= csize2bidx(size) == glibc_bin_index(size);
+        tap.ok(all_ok, "the bins of all sizes up to 2 MiB");
+    });
+}
+
+/// A glibc whose arenas are laid out like AR_MAIN, i.e. without the field before the fastbins,
+/// but whose version is `version`. Its tcache is `tcache`.
+GLIBC_INFO fake_glibc(const char* version, tcache_perthread_struct* tcache) {
+    HookInfo hook;
+    GLIBC_INFO glibc{ hook };
+    strncpy(glibc.version, version, GLIBC_LEN_VERSION - 1);
+    glibc.offset_adjust_references = 0;
+    glibc.offset_sb0_to_main_arena = 0x68;
+    glibc.tcache_present = tcache;
+    glibc.valid = 1;
+    return glibc;
+}
+
+/// A fake arena whose bins link to themselves while they are empty, and whose top chunk lies in `heap`.
+/// Its `next` ring only holds itself, until the tests link more arenas into it.
+struct FakeArena {
+    AR_MAIN arena{};
+
+    explicit FakeArena(FakeHeap& heap) {
+        for (size_t i = 1; i < NBINS; i++) {
+            auto bin = header(i);
+            bin->fd = bin;
+            bin->bk = bin;
+        }
+        arena.top = (CHUNKPTR*)heap.chunk(0x10000);
+        arena.next = &arena;
+    }
+
+    FakeArena(FakeArena const&) = delete;
+
+    /// The header of bin `i`, like glibc's bin_at().
+    CHUNK_HEADER* header(size_t i) {
+        return CHUNK_HEADER::from_memory((void*)&arena.bins[(i - 1) * 2]);
+    }
+
+    CHUNK_HEADER* top() {
+        return (CHUNK_HEADER*)arena.top;
+    }
+};
+
+/// The SIGILLs that the facade raised, see count_detections().
+volatile sig_atomic_t detections = 0;
+
+/// Count the SIGILLs of the facade instead of dying from them.
+void count_detections() {
+    signal(SIGILL, [](int) { detections = detections + 1; });
+}
+
+void test_sampling(TAP& tap) {
+    tap.subtest("sampling only checks the snapshots that were stored", 10, [](TAP& tap) {
+        using Policy = StaticMitigations<MITIGATION_TOP | MITIGATION_USB | MITIGATION_TCA, tcache_perthread_struct>;
+        static FakeHeap heap;
+        static FakeArena main_arena{ heap };
+        static tcache_perthread_struct tcache{};
+        static ARENA_INFO main_info{ fake_glibc("2.29", &tcache), &main_arena.arena };
+        static ShadowHeapFacade facade;
+        facade.initialize_with_arena(&main_info);
+        count_detections();
+        detections = 0;
+
+        auto& op = ShadowHeapFacade::operation();
+        void* ret = heap.chunk(0x20)->to_memory();
+        auto free_chunks = heap.chunk(0);
+        // the changes of glibc during a malloc(): the top chunk, the unsorted bin and a tcache bin
+        auto malloc = [&](void (*glibc)(FakeArena&, tcache_perthread_struct&, CHUNK_HEADER*&)) {
+            facade.malloc_pre<Policy>(0x18);
+            glibc(main_arena, tcache, free_chunks);
+            facade.malloc_post<Policy>(0x18, ret);
+            facade.end_operation();
+        };
+        auto changes = [](FakeArena& arena, tcache_perthread_struct& tcache, CHUNK_HEADER*& free_chunks) {
+            arena.top()->size -= 0x40;
+            auto unsorted = free_chunks;
+            unsorted->size = 0x20 | PREV_INUSE;
+            auto cached = unsorted->next_chunk();
+            cached->size = 0x20 | PREV_INUSE;
+            free_chunks = cached->next_chunk();
+            insert_head(arena.header(1), unsorted);
+            auto entry = (tcache_entry*)cached->to_memory();
+            entry->next = tcache.entries[0];
+            tcache.entries[0] = entry;
+            tcache.counts[0]++;
+        };
+
+        facade.modes.sampleRate = 1;
+        bool always = true;
+        for (int i = 0; i < 1000; i++)
+            always &= facade.sample_next();
+        tap.ok(always, "rate 1 samples every operation");
+
+        bool all_checked = true;
+        for (int i = 0; i < 3; i++) {
+            malloc(changes);
+            all_checked &= op.arena_sampled && op.tcache_sampled;
+        }
+        tap.ok(all_checked && detections == 0, "rate 1 checks every operation");
+        // an overflow into the top chunk between two operations
+        main_arena.top()->size += 0x1000;
+        malloc(changes);
+        tap.ok_eq(int(detections), 1, "the checks find a corrupted top chunk");
+
+        // the xorshift generator samples about 1 in N operations
+        for (unsigned long rate : { 8ul, 100ul }) {
+            facade.modes.sampleRate = rate;
+            constexpr size_t DRAWS = 200000;
+            size_t sampled = 0;
+            for (size_t i = 0; i < DRAWS; i++)
+                sampled += facade.sample_next();
+            auto expected = DRAWS / rate;
+            if (!tap.ok(sampled > expected * 9 / 10 && sampled < expected * 11 / 10, "about 1 in N are sampled"))
+                tap.note() << "rate " << rate << ": " << sampled << " of " << DRAWS << std::endl;
+        }
+
+        // an operation that isn't sampled skips the stores, so the next one must skip the checks
+        detections = 0;
+        facade.modes.sampleRate = ULONG_MAX;
+        malloc(changes);
+        tap.ok(op.arena_sampled && op.tcache_sampled, "the operation before the skipped stores is checked");
+        malloc(changes);
+        tap.ok(!op.arena_sampled && !op.tcache_sampled, "the operation after the skipped stores isn't checked");
+        tap.ok_eq(int(detections), 0, "the stale snapshots aren't checked");
+
+        facade.modes.sampleRate = 1;
+        malloc(changes);
+        malloc(changes);
+        tap.ok(op.arena_sampled && op.tcache_sampled && detections == 0,
+               "the snapshots are stored again before the next sampled operation");
+        main_arena.top()->size += 0x1000;
+        malloc(changes);
+        tap.ok_eq(int(detections), 1, "the checks find a corrupted top chunk again");
+    });
+}
+
+void test_ArenaShadows(TAP& tap) {
+    tap.subtest("ArenaShadows finds the arenas on the ring and locks them in order", 10, [](TAP& tap) {
+        static FakeHeap heap;
+        static FakeArena main_arena{ heap };
+        static tcache_perthread_struct tcache{};
+        static ARENA_INFO main_info{ fake_glibc("2.29", &tcache), &main_arena.arena };
+        static ShadowHeapData main_data;
+        main_data.ensure_initialized();
+
+        // more arenas than can be shadowed, linked into the ring after the main arena
+        constexpr size_t RING = MAX_ARENAS + 10;
+        static std::vector<AR_MAIN> ring(RING);
+        auto link_ring = [&](size_t length) {
+            main_arena.arena.next = length ? &ring[0] : &main_arena.arena;
+            for (size_t i = 0; i < length; i++)
+                ring[i].next = i + 1 < length ? &ring[i + 1] : &main_arena.arena;
+        };
+
+        {
+            link_ring(3);
+            static ArenaShadows arenas;
+            arenas.ensure_initialized(&main_info, &main_data);
+            auto third = arenas.for_arena(&ring[2]);
+            tap.ok(third && third->info->arena == &ring[2] && arenas.size() == 4u,
+                   "an arena is found by walking the ring");
+            tap.ok(arenas.for_arena(&ring[0]) == arenas.at(1), "the arenas before it were added too");
+
+            // the chunks of other arenas lie in heaps of HEAP_MAX_SIZE bytes, which start with their arena
+            auto memory = static_cast<char*>(aligned_alloc(HEAP_MAX_SIZE, HEAP_MAX_SIZE));
+            *(AR_MAIN**)memory = &ring[1];
+            auto chunk = (CHUNK_HEADER*)(memory + 0x1000);
+            chunk->size = 0x20 | PREV_INUSE | NON_MAIN_ARENA;
+            tap.ok(arenas.for_chunk(chunk) == arenas.at(2), "a chunk of another arena belongs to its heap");
+            chunk = (CHUNK_HEADER*)(memory + HEAP_MAX_SIZE - 0x20);
+            chunk->size = 0x20 | PREV_INUSE | NON_MAIN_ARENA;
+            tap.ok(arenas.for_chunk(chunk) == arenas.at(2), "so does one at the end of the heap");
+            tap.ok(arenas.for_chunk(heap.chunk(0x20)) == arenas.main_arena(),
+                   "a chunk of the main arena belongs to it");
+            free(memory);
+
+            // lock_table_and_all() locks the arenas, then the table, so no arena is added meanwhile
+            size_t locked = arenas.lock_table_and_all();
+            bool all_held = locked == 4;
+            for (size_t i = 0; i < locked; i++)
+                all_held &= !arenas.at(i)->data->lock.try_lock();
+            tap.ok(all_held, "lock_table_and_all() holds the locks of all arenas");
+
+            link_ring(5);
+            std::atomic<bool> found{ false };
+            std::thread discoverer{ [&] { found = arenas.for_arena(&ring[4]) != nullptr; } };
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            bool waited = !found;
+            arenas.unlock_table_and_all(locked);
+            discoverer.join();
+            tap.ok(waited && found && arenas.size() == 6u, "arenas are only added after unlock_table_and_all()");
+
+            locked = arenas.lock_all(4);
+            bool from_first = locked == 6 && arenas.at(3)->data->lock.try_lock();
+            for (size_t i = 4; i < locked; i++)
+                from_first &= !arenas.at(i)->data->lock.try_lock();
+            arenas.at(3)->data->lock.unlock();
+            for (size_t i = 4; i < locked; i++)
+                arenas.at(i)->data->lock.unlock();
+            tap.ok(from_first, "lock_all(first) only locks the arenas from `first` on");
+        }
+
+        {
+            link_ring(RING);
+            static ArenaShadows arenas;
+            arenas.ensure_initialized(&main_info, &main_data);
+            tap.ok(arenas.for_arena(&ring[RING - 1]) == nullptr && arenas.size() == MAX_ARENAS,
+                   "at most MAX_ARENAS arenas are shadowed");
+        }
+
+        {
+            // an overwritten ring that never returns to the main arena
+            link_ring(3);
+            ring[2].next = &ring[1];
+            static ArenaShadows arenas;
+            arenas.ensure_initialized(&main_info, &main_data);
+            tap.ok(arenas.for_arena(&ring[5]) == nullptr && arenas.size() == 4u,
+                   "the walk stops on a ring without the main arena");
+        }
+    });
+}
+
+void test_thread_arena(TAP& tap) {
+    tap.subtest("the arena of a thread is read from glibc's thread_arena", 5, [](TAP& tap) {
+        // a thread that isn't the first gets an arena of its own on its first allocation
+        AR_MAIN* arena = nullptr;
+        AR_MAIN** glibc_arena = nullptr;
+        ptrdiff_t offset = 0;
+        std::thread{ [&] {
+            auto chunk = CHUNK_HEADER::from_memory(malloc(0x18));
+            if (!chunk->is_main_arena()) arena = *(AR_MAIN**)((uintptr_t)chunk & ~(HEAP_MAX_SIZE - 1));
+            glibc_arena = malloc_leak::leak_thread_arena(arena);
+            offset = (char*)glibc_arena - malloc_leak::thread_pointer();
+            free(chunk->to_memory());
+        } }.join();
+        tap.ok(arena && glibc_arena, "leak_thread_arena() finds the thread_arena of a thread");
+        auto own = *(AR_MAIN**)(malloc_leak::thread_pointer() + offset);
+        tap.ok(own && own != arena, "it lies at the same offset from the thread pointer in every thread");
+
+        static FakeHeap heap;
+        static FakeArena main_arena{ heap };
+        static AR_MAIN other{};
+        static tcache_perthread_struct tcache{};
+        static ARENA_INFO main_info{ fake_glibc("2.29", &tcache), &main_arena.arena };
+        static ShadowHeapFacade facade;
+        facade.initialize_with_arena(&main_info);
+        main_arena.arena.next = &other;
+        other.next = &main_arena.arena;
+
+        auto& thread = ShadowHeapFacade::thread_data();
+        AR_MAIN* fake_thread_arena = &other;
+        thread.glibc_arena = &fake_thread_arena;
+        auto guessed = facade.guess_thread_arena();
+        tap.ok(guessed && guessed->info->arena == &other, "the arena of the thread is glibc's thread_arena");
+
+        // after the thread released its arena, glibc picks any arena, so all are locked
+        fake_thread_arena = nullptr;
+        facade.select_thread_arena();
+        bool all_held = ShadowHeapFacade::operation().all_locked == facade.arenas.size();
+        for (size_t i = 0; i < facade.arenas.size(); i++)
+            all_held &= !facade.arenas.at(i)->data->lock.try_lock();
+        tap.ok(all_held && facade.arenas.size() == 2u, "all arenas are locked while glibc picks one");
+        facade.end_operation();
+        bool all_free = true;
+        for (size_t i = 0; i < facade.arenas.size(); i++) {
+            auto& lock = facade.arenas.at(i)->data->lock;
+            all_free &= lock.try_lock();
+            lock.unlock();
+        }
+        tap.ok(all_free, "end_operation() releases them");
+        thread.glibc_arena = nullptr;
+    });
+}
+
+int main() {
+    TAP tap{ 11 };
+
+#ifdef __AVX2__
+    tap.note() << "compiled with AVX2" << std::endl;
+#else
+    tap.note() << "compiled without AVX2" << std::endl;
+#endif
+
+    test_tcache_dirty_bins<tcache_perthread_struct>(tap, "tcache_dirty_bins() with 8 bit counts");
+    test_tcache_dirty_bins<tcache_perthread_struct_2_30>(tap, "tcache_dirty_bins() with 16 bit counts");
+    test_UnsortedBinModel(tap);
+    test_FastbinShadow(tap, "FastbinShadow follows pushes and pops", false);
+    test_FastbinShadow(tap, "FastbinShadow follows pushes and pops with safe-linking", true);
+    test_fastbin_and_tcache_indices(tap);
+    test_SortedBinShadow(tap);
+    test_bin_indices(tap);
+    test_sampling(tap);
+    test_ArenaShadows(tap);
+    test_thread_arena(tap);
+
+    return tap.print_result() ? 0 : 1;
+}
@@ -1,12 +1,27 @@
 
+#include "../store/AdaptiveMetaStore.h"
 #include "../store/CachedMetaStore.h"
+#include "../store/CompactMetaStore.h"
 #include "../store/MapMetaStore.h"
+#include "../store/MmapAllocator.h"
+#include "../store/PoolAllocator.h"
+#include "../store/RuntimeMetaStore.h"
+#include "../store/HashMetaStore.h"
+#include "../store/ShadowMetaStore.h"
+#include "../store/ShardedMetaStore.h"
+#include "../store/SwissMetaStore.h"
+#include "../store/ThreadLocalMetaStore.h"
 #include "../store/UnorderedMapMetaStore.h"
 #include "../store/VectorMetaStore.h"
 #include "../tests/tap.h"
 
+#include <atomic>
+#include <chrono>
 #include <ostream>
+#include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 
 using namespace std;
 
@@ -15,7 +30,7 @@ static auto operator<<(std::ostream& out, std::pair<bool, MALLOC_META> value)
     return out << '<' << value.first << ", " << value.second << '>';
 }
 
-constexpr size_t SUBTESTS = 15;
+constexpr size_t SUBTESTS = 20;
 
 void test_Store(TAP& tap, IMetaStore& store) {
     void* key1 = (void*)1234;
@@ -40,6 +55,20 @@ void test_Store(TAP& tap, IMetaStore& store) {
     tap.ok(store.remove({ key1, 17 }), "remove(chunk1) works");
     tap.ok(store.remove({ key2, 141 }), "remove(updated chunk2) works");
     tap.ok_eq(store.size(), 0u, "size() == 0");
+
+    store.put(chunk1);
+    tap.ok_eq(store.take_if_matches(key1, { key1, 1234 }), chunk1,
+              "take_if_matches(manipulated chunk1) returns stored chunk");
+    tap.ok_eq(store.take_if_matches(key1, chunk1), chunk1, "take_if_matches(chunk1) works");
+    tap.ok_eq(store.take_if_matches(key1, chunk1), MALLOC_META{},
+              "take_if_matches(chunk1) removed the chunk");
+
+    std::vector<MALLOC_META> batch;
+    for (size_t i = 0; i < 100; i++)
+        batch.push_back({ (void*)(0x555555560000 + 32 * i), 32 | PREV_INUSE });
+    tap.ok_eq(store.put_many(batch.data(), batch.size()), 100u, "put_many() of 100 chunks");
+    tap.ok(store.remove_many(batch.data(), batch.size()) == 100u && store.size() == 0u,
+           "remove_many() of 100 chunks");
 }
 
 void test_Cached_reserve(TAP& tap) {
@@ -107,12 +136,689 @@ void test_Cached_rehash(TAP& tap) {
         tap.ok(remove_ok, "removing stored chunks");
 
         tap.ok_eq(store.size(), 0u, "no elements remain");
-        tap.ok_eq(store.capacity(), 256u, "cache capacity is unchanged");
+        tap.ok_eq(store.capacity(), 128u, "cache shrinks back to its initial capacity");
+    });
+}
+
+void test_Cached_incremental_rehash(TAP& tap) {
+    tap.subtest("CachedMetaStore can rehash incrementally", 5, [](TAP& tap) {
+        CachedMetaStore<MapMetaStore, std::allocator<MALLOC_META>, true> store;
+
+        auto make_example_chunk = [](size_t i) -> MALLOC_META {
+            return { (void*)(32 + 16 * i), 13 + i };
+        };
+
+        // every put may trigger or advance a migration,
+        // so verify old entries while the tables are side by side
+        bool put_ok = true;
+        bool get_ok = true;
+        for (size_t i = 0; i < 10000; i++) {
+            put_ok &= store.put(make_example_chunk(i));
+            get_ok &= store.get(make_example_chunk(i / 2).ptr) == make_example_chunk(i / 2);
+            get_ok &= store.get(make_example_chunk(i).ptr) == make_example_chunk(i);
+        }
+        tap.ok(put_ok && store.size() == 10000u, "added 10000 elements");
+        tap.ok(get_ok, "entries remain reachable during migration");
+        tap.ok(store.capacity() >= 8192u, "the cache has grown");
+
+        bool remove_ok = true;
+        for (size_t i = 0; i < 10000; i++)
+            remove_ok &= store.remove(make_example_chunk(i));
+        tap.ok(remove_ok, "removing stored chunks");
+        tap.ok_eq(store.size(), 0u, "no elements remain");
+    });
+}
+
+void test_Compact_null_key(TAP& tap) {
+    tap.subtest("CompactMetaStore doesn't match null against empty entries", 5, [](TAP& tap) {
+        CompactMetaStore<> store;
+
+        MALLOC_META chunk{ (void*)0x7f0012345670, 0x20 | PREV_INUSE };
+        store.put(chunk);
+        tap.ok_eq(store.take_if_matches(nullptr, {}), MALLOC_META{}, "take_if_matches() of null");
+        tap.ok(!store.remove({ nullptr, 0 }), "remove() of null");
+        tap.ok(!store.update({ nullptr, 32 }), "update() of null");
+        tap.ok(!store.put({ nullptr, 32 }), "put() of null");
+        tap.ok_eq(store.size(), size_t(1), "size() is unchanged");
+    });
+}
+
+void test_Compact_packing(TAP& tap) {
+    tap.subtest("CompactMetaStore packs unless entries don't fit", 7, [](TAP& tap) {
+        CompactMetaStore<> store;
+
+        MALLOC_META small{ (void*)0x7f0012345670, 0x20 | PREV_INUSE };
+        MALLOC_META huge{ (void*)0x7f0012345680, (size_t(1) << 22) | IS_MMAPPED };
+        tap.ok(store.put(small) && store.put(huge), "put() packed and unpackable chunks");
+        tap.ok(store.get(small.ptr).equals_ptr_size_flags(small), "flags survive packing");
+        tap.ok(store.get(huge.ptr).equals_ptr_size_flags(huge), "huge chunk is retrievable");
+
+        MALLOC_META grown{ small.ptr, (size_t(1) << 23) | PREV_INUSE };
+        tap.ok(store.update(grown) && store.get(small.ptr) == grown,
+               "update() to an unpackable size");
+        tap.ok(store.remove(grown) && store.remove(huge) && store.size() == 0u,
+               "remove() from both tables");
+
+        auto make_example_chunk = [](size_t i) -> MALLOC_META {
+            return { (void*)(0x10000 + 16 * i), 32 + 16 * (i % 100) };
+        };
+        bool ok = true;
+        for (size_t i = 0; i < 10000; i++)
+            ok &= store.put(make_example_chunk(i));
+        for (size_t i = 0; i < 10000; i++)
+            ok &= store.get(make_example_chunk(i).ptr) == make_example_chunk(i);
+        tap.ok(ok && store.capacity() >= 8192u, "entries survive growing the table");
+
+        for (size_t i = 0; i < 10000; i++)
+            ok &= store.remove(make_example_chunk(i));
+        tap.ok(ok && store.size() == 0u, "removing stored chunks");
+    });
+}
+
+template <class Allocator>
+void test_Compact_alignment_with(TAP& tap, const char* name) {
+    tap.subtest(name, 3, [](TAP& tap) {
+        using Bin = details::CompactBin;
+        auto aligned = [](details::BinTable<Bin, Allocator>& bins) {
+            bool ok = reinterpret_cast<uintptr_t>(bins.begin()) % 64 == 0;
+            for (size_t i = 0; i < bins.size() && i < 1000; i++)
+                ok &= bins[i].entries[0].raw == (i < 4 ? i + 1 : 0);
+            return ok;
+        };
+
+        details::BinTable<Bin, Allocator> bins(4);
+        for (uint64_t i = 0; i < 4; i++)
+            bins[i].entries[0].raw = i + 1;
+        tap.ok(aligned(bins), "a new table is aligned to cache lines");
+        bins.grow(1024);
+        tap.ok(aligned(bins), "the grown table is aligned and keeps its bins");
+        bins.shrink(4);
+        tap.ok(aligned(bins), "the shrunk table is aligned and keeps its bins");
+    });
+}
+
+void test_Compact_alignment(TAP& tap) {
+    test_Compact_alignment_with<std::allocator<MALLOC_META>>(
+        tap, "CompactMetaStore bins are aligned to cache lines");
+    test_Compact_alignment_with<MmapAllocator<MALLOC_META>>(
+        tap, "CompactMetaStore bins are aligned to cache lines, also when they are mapped");
+}
+
+void test_Shadow_direct_mapping(TAP& tap) {
+    tap.subtest("ShadowMetaStore maps heap and other chunks to shadow slots", 6, [](TAP& tap) {
+        ShadowMetaStore<> store;
+
+        auto make_heap_chunk = [](size_t i) -> MALLOC_META {
+            return { (void*)(0x555555560000 + 16 * i), (32 + 16 * (i % 100)) | PREV_INUSE };
+        };
+        MALLOC_META below_heap{ (void*)0x555550000010, 0x20 };
+        MALLOC_META mmapped{ (void*)0x7f0012345010, 0x21000 | IS_MMAPPED };
+        MALLOC_META other_arena{ (void*)0x7f0020000a30, 0x40 | NON_MAIN_ARENA };
+
+        bool ok = true;
+        for (size_t i = 0; i < 10000; i++)
+            ok &= store.put(make_heap_chunk(i));
+        tap.ok(ok && store.size() == 10000u, "put() heap chunks");
+
+        tap.ok(store.put(below_heap) && store.put(mmapped) && store.put(other_arena),
+               "put() chunks outside of the heap shadow");
+        tap.ok(!store.put(mmapped), "put() rejects duplicates");
+
+        for (size_t i = 0; i < 10000; i++)
+            ok &= store.get(make_heap_chunk(i).ptr).equals_ptr_size_flags(make_heap_chunk(i));
+        ok &= store.get(below_heap.ptr) == below_heap;
+        ok &= store.get(mmapped.ptr) == mmapped && store.get(other_arena.ptr) == other_arena;
+        ok &= !store.get((void*)0x7f0012346010).is_some();
+        tap.ok(ok, "get() finds every chunk");
+
+        for (size_t i = 0; i < 10000; i += 2)
+            ok &= store.remove(make_heap_chunk(i));
+        ok &= store.remove(mmapped) && !store.remove(mmapped);
+        tap.ok(ok && store.size() == 5002u, "remove() clears the slots");
+
+        store.clear();
+        tap.ok(store.size() == 0u && !store.get(make_heap_chunk(1).ptr).is_some(),
+               "clear() empties all shadows");
+    });
+}
+
+void test_Mmap_allocator(TAP& tap) {
+    tap.subtest("MmapAllocator backs growing stores with private mappings", 5, [](TAP& tap) {
+        MmapAllocator<size_t> alloc;
+        size_t page_elements = MmapAllocator<size_t>::page_size() / sizeof(size_t);
+
+        auto data = alloc.allocate(page_elements);
+        for (size_t i = 0; i < page_elements; i++)
+            data[i] = i;
+        data = alloc.reallocate(data, page_elements, 4 * page_elements);
+        bool kept = true;
+        for (size_t i = 0; i < page_elements; i++)
+            kept &= data[i] == i;
+        tap.ok(kept, "reallocate() keeps the contents");
+        alloc.deallocate(data, 4 * page_elements);
+
+        CachedMetaStore<MapMetaStore, MmapAllocator<MALLOC_META>> store;
+        auto make_example_chunk = [](size_t i) -> MALLOC_META {
+            return { (void*)(32 + 16 * i), 13 + i };
+        };
+
+        bool put_ok = true;
+        for (size_t i = 0; i < 10000; i++)
+            put_ok &= store.put(make_example_chunk(i));
+        tap.ok(put_ok && store.size() == 10000u, "added 10000 elements");
+        tap.ok(store.capacity() >= 8192u, "the cache has grown");
+
+        bool get_ok = true;
+        for (size_t i = 0; i < 10000; i++)
+            get_ok &= store.get(make_example_chunk(i).ptr) == make_example_chunk(i);
+        tap.ok(get_ok, "retrieving stored chunks");
+
+        bool remove_ok = true;
+        for (size_t i = 0; i < 10000; i++)
+            remove_ok &= store.remove(make_example_chunk(i));
+        tap.ok(remove_ok && store.size() == 0u, "removing stored chunks");
+    });
+}
+
+template <class Store>
+void test_Cached_cuckoo_with(TAP& tap, const char* name) {
+    tap.subtest(name, 3, [](TAP& tap) {
+        constexpr size_t COUNT = 10000;
+        Store store;
+
+        auto make_example_chunk = [](size_t i) -> MALLOC_META {
+            return { (void*)(0x555555560000 + 48 * i), 48 | PREV_INUSE };
+        };
+
+        bool ok = true;
+        for (size_t i = 0; i < COUNT; i++)
+            ok &= store.put(make_example_chunk(i));
+        for (size_t i = 0; i < COUNT; i++)
+            ok &= store.get(make_example_chunk(i).ptr) == make_example_chunk(i);
+        tap.ok(ok, "entries are retrievable");
+
+        tap.note() << "fallback evictions: " << store.fallback_evictions() << std::endl;
+        tap.ok(store.fallback_evictions() * 20 < COUNT, "less than 5% of entries were evicted");
+
+        for (size_t i = 0; i < COUNT; i++)
+            ok &= store.remove(make_example_chunk(i));
+        tap.ok(ok && store.size() == 0u, "entries are removable");
+    });
+}
+
+void test_Cached_cuckoo(TAP& tap) {
+    test_Cached_cuckoo_with<CachedMetaStore<MapMetaStore>>(
+        tap, "CachedMetaStore displaces entries before evicting them");
+    test_Cached_cuckoo_with<CachedMetaStore<MapMetaStore, std::allocator<MALLOC_META>, true>>(
+        tap, "CachedMetaStore displaces entries during incremental rehash");
+}
+
+template <class Store>
+void test_Cached_shrink_with(TAP& tap, const char* name) {
+    tap.subtest(name, 4, [](TAP& tap) {
+        constexpr size_t COUNT = 20000;
+        constexpr size_t REMAINING = 100;
+        Store store;
+
+        auto make_example_chunk = [](size_t i) -> MALLOC_META {
+            return { (void*)(0x555555560000 + 48 * i), 48 | PREV_INUSE };
+        };
+
+        bool ok = true;
+        for (size_t i = 0; i < COUNT; i++)
+            ok &= store.put(make_example_chunk(i));
+        auto peak_capacity = store.capacity();
+
+        // keep every 200th chunk, so that the survivors are spread over the table
+        for (size_t i = 0; i < COUNT; i++)
+            if (i % (COUNT / REMAINING) != 0) ok &= store.remove(make_example_chunk(i));
+        tap.ok(ok && store.size() == REMAINING, "removed all but 100 chunks");
+
+        tap.note() << "capacity: " << peak_capacity << " -> " << store.capacity() << std::endl;
+        tap.ok(store.capacity() * 16 <= peak_capacity, "the cache has shrunk");
+        tap.ok(store.capacity() >= 128u, "but not below its initial capacity");
+
+        for (size_t i = 0; i < COUNT; i += COUNT / REMAINING)
+            ok &= store.get(make_example_chunk(i).ptr) == make_example_chunk(i);
+        for (size_t i = 0; i < COUNT; i += COUNT / REMAINING)
+            ok &= store.remove(make_example_chunk(i));
+        tap.ok(ok && store.size() == 0u, "remaining chunks survived shrinking");
+    });
+}
+
+void test_Cached_shrink(TAP& tap) {
+    test_Cached_shrink_with<CachedMetaStore<MapMetaStore>>(
+        tap, "CachedMetaStore shrinks after most entries were removed");
+    test_Cached_shrink_with<CachedMetaStore<MapMetaStore, std::allocator<MALLOC_META>, true>>(
+        tap, "CachedMetaStore shrinks incrementally");
+}
+
+void test_Adaptive_tiers(TAP& tap) {
+    tap.subtest("AdaptiveMetaStore migrates between tiers", 7, [](TAP& tap) {
+        using Store = AdaptiveMetaStore<>;
+        using Tier = Store::Tier;
+        constexpr size_t COUNT = 80000;
+        Store store;
+
+        auto make_example_chunk = [](size_t i) -> MALLOC_META {
+            return { (void*)(0x555555560000 + 48 * i), 48 | PREV_INUSE };
+        };
+        auto check_range = [&](size_t first, size_t last) {
+            bool ok = store.size() == last - first;
+            for (size_t i = first; i < last; i++)
+                ok &= store.get(make_example_chunk(i).ptr) == make_example_chunk(i);
+            return ok;
+        };
+
+        bool ok = true;
+        for (size_t i = 0; i < 20; i++)
+            ok &= store.put(make_example_chunk(i));
+        tap.ok(ok && store.current_tier() == Tier::Vector, "small heaps use the vector");
+
+        for (size_t i = 20; i < 1000; i++)
+            ok &= store.put(make_example_chunk(i));
+        tap.ok(ok && store.current_tier() == Tier::Cached && check_range(0, 1000),
+               "medium heaps use the cached hash table");
+
+        for (size_t i = 1000; i < COUNT; i++)
+            ok &= store.put(make_example_chunk(i));
+        tap.ok(ok && store.current_tier() == Tier::Shadow && check_range(0, COUNT),
+               "large heaps use the shadow");
+
+        // a quarter of the threshold has to be reached before moving down
+        for (size_t i = 0; i < COUNT - 20000; i++)
+            ok &= store.remove(make_example_chunk(i));
+        tap.ok(ok && store.current_tier() == Tier::Shadow, "moving down has hysteresis");
+
+        for (size_t i = COUNT - 20000; i < COUNT - 1000; i++)
+            ok &= store.remove(make_example_chunk(i));
+        tap.ok(ok && store.current_tier() == Tier::Cached && check_range(COUNT - 1000, COUNT),
+               "shrinking heaps move back to the cached hash table");
+
+        for (size_t i = COUNT - 1000; i < COUNT - 5; i++)
+            ok &= store.remove(make_example_chunk(i));
+        tap.ok(ok && store.current_tier() == Tier::Vector && check_range(COUNT - 5, COUNT),
+               "and back to the vector");
+
+        store.clear();
+        store.reserve(1000);
+        store.put(make_example_chunk(0));
+        store.remove(make_example_chunk(0));
+        tap.ok(store.current_tier() == Tier::Cached, "reserve() selects a minimum tier");
+    });
+}
+
+void test_Pool_allocator(TAP& tap) {
+    tap.subtest("PoolAllocator reuses nodes of node-based stores", 3, [](TAP& tap) {
+        PoolAllocator<std::pair<void*, MALLOC_META>> alloc;
+        auto first = alloc.allocate(1);
+        alloc.deallocate(first, 1);
+        tap.ok_eq((void*)alloc.allocate(1), (void*)first, "a freed node is handed out again");
+        alloc.deallocate(first, 1);
+
+        MapMetaStore<>::with_allocator<PoolAllocator> store;
+        auto make_example_chunk = [](size_t i) -> MALLOC_META {
+            return { (void*)(0x555555560000 + 32 * i), 32 | PREV_INUSE };
+        };
+
+        bool ok = true;
+        for (size_t i = 0; i < 100000; i++)
+            ok &= store.put(make_example_chunk(i));
+        for (size_t i = 0; i < 100000; i++)
+            ok &= store.get(make_example_chunk(i).ptr) == make_example_chunk(i);
+        tap.ok(ok, "entries spanning several slabs are retrievable");
+
+        for (size_t i = 0; i < 100000; i++)
+            ok &= store.remove(make_example_chunk(i));
+        tap.ok(ok && store.size() == 0u, "entries are removable");
+    });
+}
+
+void test_Sharded_concurrent(TAP& tap) {
+    tap.subtest("ShardedMetaStore can be used from multiple threads", 2, [](TAP& tap) {
+        constexpr size_t THREADS = 8;
+        constexpr size_t CHUNKS = 2000;
+        ShardedMetaStore<> store;
+
+        auto make_example_chunk = [](size_t t, size_t i) -> MALLOC_META {
+            return { (void*)(((t + 1) << 24) + 16 * (i + 1)), 32 + i };
+        };
+
+        std::vector<size_t> errors(THREADS);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < THREADS; t++) {
+            threads.emplace_back([&, t] {
+                for (size_t i = 0; i < CHUNKS; i++)
+                    errors[t] += !store.put(make_example_chunk(t, i));
+                for (size_t i = 0; i < CHUNKS; i += 2)
+                    errors[t] += !store.remove(make_example_chunk(t, i));
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+
+        size_t total_errors = 0;
+        for (auto e : errors)
+            total_errors += e;
+        tap.ok_eq(total_errors, 0u, "no operation failed");
+        tap.ok_eq(store.size(), THREADS * CHUNKS / 2, "half of the chunks remain");
+    });
+}
+
+void test_ThreadLocal_remote_free(TAP& tap) {
+    tap.subtest("ThreadLocalMetaStore checks remote frees, or hands them to a busy owner", 12, [](TAP& tap) {
+        constexpr size_t CHUNKS = 1000;
+        ThreadLocalMetaStore<> store;
+        static size_t invalid_frees;
+        invalid_frees = 0;
+        store.set_invalid_free_handler([](MALLOC_META) { invalid_frees++; });
+
+        auto make_example_chunk = [](size_t i) -> MALLOC_META {
+            return { (void*)(0x100000 + 16 * i), 32 + i };
+        };
+
+        size_t put_errors = 0;
+        std::thread owner{ [&] {
+            for (size_t i = 0; i < CHUNKS; i++)
+                put_errors += !store.put(make_example_chunk(i));
+        } };
+        owner.join();
+        tap.ok_eq(put_errors, 0u, "owner thread stored all chunks");
+
+        bool found_all = true;
+        size_t remove_errors = 0;
+        for (size_t i = 0; i < CHUNKS; i += 2) {
+            auto expected = make_example_chunk(i);
+            found_all &= store.get(expected.ptr) == expected;
+            remove_errors += !store.remove(expected);
+        }
+        tap.ok(found_all, "other thread can look up the chunks");
+        tap.ok_eq(remove_errors, 0u, "other thread can free the chunks");
+        tap.ok(store.size() == CHUNKS / 2 && invalid_frees == 0, "the frees were applied");
+
+        // while the owner's lock is free, invalid frees fail right away
+        auto victim = make_example_chunk(1);
+        tap.ok(!store.remove({ victim.ptr, 12345 }), "remote remove(manipulated chunk) fails right away");
+        tap.ok_eq(store.get(victim.ptr), victim, "the manipulated free left the chunk stored");
+
+        // a third thread frees a chunk, and this thread frees it again
+        auto twice = make_example_chunk(3);
+        std::thread{ [&] { store.remove(twice); } }.join();
+        tap.ok(!store.remove(twice) && invalid_frees == 0, "the double free fails right away");
+
+        // the fused free path of the facade
+        auto taken = make_example_chunk(5);
+        tap.ok(store.take_if_matches(taken.ptr, taken) == taken && store.get(taken.ptr) == MALLOC_META{},
+               "remote take_if_matches(chunk) removes the chunk");
+
+        MALLOC_META unowned{ (void*)0x7f0000000010, 32 | NON_MAIN_ARENA };
+        tap.ok_eq(store.take_if_matches(unowned.ptr, unowned), MALLOC_META{},
+                  "take_if_matches(chunk of a region nobody stored) fails right away");
+
+        // while the owner's lock is held, the free is queued and only reported when drained
+        store.lock_all();
+        bool queued = store.remove({ victim.ptr, 12345 });
+        store.unlock_all();
+        tap.ok(queued && invalid_frees == 0, "remote remove(manipulated chunk) is queued for a busy owner");
+        store.size();
+        tap.ok_eq(invalid_frees, 1u, "the manipulated chunk is reported when drained");
+
+        // a live owner applies the queued frees on its next call
+        std::atomic<int> phase{ 0 };
+        auto first = make_example_chunk(CHUNKS), second = make_example_chunk(CHUNKS + 1);
+        MALLOC_META seen{};
+        std::thread live{ [&] {
+            store.put(first);
+            phase = 1;
+            while (phase != 2)
+                std::this_thread::yield();
+            store.put(second);
+            seen = store.get(first.ptr);
+        } };
+        while (phase != 1)
+            std::this_thread::yield();
+        store.remove(first);
+        phase = 2;
+        live.join();
+        tap.ok(seen == MALLOC_META{} && invalid_frees == 1, "the owner has no free left to apply");
+    });
+}
+
+void test_ThreadLocal_instances(TAP& tap) {
+    tap.subtest("ThreadLocalMetaStore keeps the threads of each instance apart", 3, [](TAP& tap) {
+        using Store = ThreadLocalMetaStore<>;
+        MALLOC_META chunk{ (void*)0x100000, 32 };
+
+        Store first, second;
+        bool alternating_ok = true;
+        for (size_t i = 0; i < 100; i++) {
+            MALLOC_META other{ (void*)(0x200000 + 16 * i), 32 };
+            alternating_ok &= first.put(other) && second.put(other);
+            alternating_ok &= first.remove(other) && second.get(other.ptr) == other;
+        }
+        tap.ok(alternating_ok && first.size() == 0 && second.size() == 100, "two stores used alternately");
+
+        // a thread that used a destroyed store uses a new store at the same address
+        alignas(Store) static unsigned char memory[sizeof(Store)];
+        auto store = new (memory) Store;
+        std::atomic<int> phase{ 0 };
+        bool put_ok = false;
+        std::thread user{ [&] {
+            store->put(chunk);
+            phase = 1;
+            while (phase != 2)
+                std::this_thread::yield();
+            put_ok = store->put(chunk);
+        } };
+        while (phase != 1)
+            std::this_thread::yield();
+        store->~Store();
+        store = new (memory) Store;
+        phase = 2;
+        user.join();
+        tap.ok(put_ok && store->size() == 1, "the thread registers with the new store");
+        tap.ok_eq(store->get(chunk.ptr), chunk, "the new store holds the chunk");
+        store->~Store();
+    });
+}
+
+/// Whether `op` waits for `unlock` in another thread, after `lock` was called.
+template <class Lock, class Op, class Unlock>
+bool waits_for_unlock(Lock lock, Op op, Unlock unlock) {
+    lock();
+    std::atomic<bool> done{ false };
+    std::thread other{ [&] {
+        op();
+        done = true;
+    } };
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    bool waited = !done;
+    unlock();
+    other.join();
+    return waited && done;
+}
+
+void test_Store_lock_all(TAP& tap) {
+    tap.subtest("lock_all() holds the locks of thread-safe stores and pools", 3, [](TAP& tap) {
+        MALLOC_META chunk{ (void*)0x100000, 32 };
+
+        ShardedMetaStore<> sharded;
+        tap.ok(waits_for_unlock([&] { sharded.lock_all(); }, [&] { sharded.put(chunk); },
+                                [&] { sharded.unlock_all(); }) &&
+                   sharded.get(chunk.ptr) == chunk,
+               "ShardedMetaStore");
+
+        ThreadLocalMetaStore<> per_thread;
+        per_thread.put({ (void*)0x200000, 32 });
+        tap.ok(waits_for_unlock([&] { per_thread.lock_all(); },
+                                [&] { per_thread.get(chunk.ptr); },
+                                [&] { per_thread.unlock_all(); }),
+               "ThreadLocalMetaStore");
+
+        PoolAllocator<std::pair<void*, MALLOC_META>> alloc;
+        alloc.deallocate(alloc.allocate(1), 1);
+        details::PoolLock* locked = nullptr;
+        std::pair<void*, MALLOC_META>* node = nullptr;
+        tap.ok(waits_for_unlock([&] { locked = details::lock_pools(); },
+                                [&] { node = alloc.allocate(1); },
+                                [&] { details::unlock_pools(locked); }),
+               "details::lock_pools()");
+        alloc.deallocate(node, 1);
+    });
+}
+
+void test_Swiss_rehash(TAP& tap) {
+    tap.subtest("SwissMetaStore grows and reuses tombstones", 5, [](TAP& tap) {
+        SwissMetaStore<> store;
+        tap.ok_eq(store.capacity(), 128u, "initial capacity is 128");
+
+        auto make_example_chunk = [](size_t i) -> MALLOC_META {
+            return { (void*)(32 + 16 * i), 13 + i };
+        };
+
+        bool put_ok = true;
+        for (size_t i = 0; i < 1000; i++)
+            put_ok &= store.put(make_example_chunk(i));
+        tap.ok(put_ok && store.size() == 1000u, "added 1000 elements");
+        tap.ok(store.capacity() >= 1000u * 8 / 7, "adding so many elements caused a rehash");
+
+        // churn through many more keys than the capacity,
+        // which must not exhaust the table with tombstones
+        bool churn_ok = true;
+        for (size_t i = 1000; i < 20000; i++) {
+            churn_ok &= store.put(make_example_chunk(i));
+            churn_ok &= store.remove(make_example_chunk(i - 1000));
+        }
+        tap.ok(churn_ok && store.size() == 1000u, "churn keeps the size constant");
+
+        bool get_ok = true;
+        for (size_t i = 19000; i < 20000; i++)
+            get_ok &= store.get(make_example_chunk(i).ptr) == make_example_chunk(i);
+        tap.ok(get_ok, "retrieving remaining chunks");
+    });
+}
+
+void test_Store_statistics(TAP& tap) {
+    tap.subtest("CachedMetaStore reports statistics", 6, [](TAP& tap) {
+        CachedMetaStore<> store;
+        auto make_example_chunk = [](size_t i) -> MALLOC_META {
+            return { (void*)(0x555555550000 + 48 * i), 48 };
+        };
+
+        for (size_t i = 0; i < 1000; i++)
+            store.put(make_example_chunk(i));
+        for (size_t i = 0; i < 1000; i++)
+            store.get(make_example_chunk(i).ptr);
+        for (size_t i = 0; i < 10; i++)
+            store.get((void*)(0x16 + 32 * i));
+
+        auto stats = store.statistics();
+        tap.ok_eq(stats.entries, 1000u, "entries");
+        tap.ok(stats.capacity == store.capacity() && stats.fallback_entries <= stats.entries,
+               "capacity and fallback entries");
+
+#ifdef SHADOWHEAP_STORE_STATS
+        auto sum = [](size_t const* histogram) {
+            size_t total = 0;
+            for (size_t i = 0; i < StoreStats::HISTOGRAM_SIZE; i++)
+                total += histogram[i];
+            return total;
+        };
+        tap.ok(stats.puts == 1000u && stats.gets == 1010u, "puts and gets are counted");
+        tap.ok(stats.rehashes > 0 && sum(stats.bin_fill) == 1000u, "rehashes and bin fill");
+        tap.ok_eq(sum(stats.probe_lengths), 1010u, "every lookup has a probe length");
+        tap.ok(stats.fallback_lookups >= 10u && stats.fallback_hits == stats.fallback_lookups - 10,
+               "only the garbage lookups miss the fallback store");
+#else
+        for (auto name : { "puts and gets", "rehashes and bin fill", "probe lengths", "fallback" })
+            tap.pass(name);
+#endif
+    });
+
+    tap.subtest("VectorMetaStore counts a put only as a put", 2, [](TAP& tap) {
+        VectorMetaStore<> store;
+        for (size_t i = 0; i < 100; i++)
+            store.put({ (void*)(0x555555550000 + 48 * i), 48 });
+        store.put({ (void*)0x555555550000, 48 });
+        for (size_t i = 0; i < 50; i++)
+            store.get((void*)(0x555555550000 + 48 * i));
+
+        auto stats = store.statistics();
+#ifdef SHADOWHEAP_STORE_STATS
+        size_t probes = 0;
+        for (auto count : stats.probe_lengths)
+            probes += count;
+        tap.ok(stats.puts == 101u && stats.gets == 50u, "puts and gets are counted");
+        tap.ok_eq(probes, 50u, "only the gets have a probe length");
+#else
+        tap.ok_eq(stats.entries, 100u, "puts and gets");
+        tap.pass("probe lengths");
+#endif
+    });
+
+    tap.subtest("Only stores with bins record the histograms", 3, [](TAP& tap) {
+        auto histograms = [](IMetaStore& store) {
+            MALLOC_META chunk{ (void*)0x555555560010, 0x20 | PREV_INUSE };
+            store.put(chunk);
+            store.get(chunk.ptr);
+            store.get((void*)0x555555560030);
+            auto stats = store.statistics();
+            size_t probes = 0, fills = 0;
+            for (size_t i = 0; i < StoreStats::HISTOGRAM_SIZE; i++) {
+                probes += stats.probe_lengths[i];
+                fills += stats.bin_fill[i];
+            }
+            bool recorded = stats.records_probe_lengths && stats.records_bin_fill;
+            // without SHADOWHEAP_STORE_STATS the histograms stay empty
+            return recorded && (!StoreStatsCounter::enabled || (probes == 2 && fills == 1));
+        };
+
+        CompactMetaStore<> compact;
+        ShadowMetaStore<> shadow;
+        MapMetaStore<> map;
+        tap.ok(histograms(compact), "CompactMetaStore records probe lengths and bin fill");
+        tap.ok(histograms(shadow), "ShadowMetaStore records probe lengths and bin fill");
+        auto stats = map.statistics();
+        tap.ok(!stats.records_probe_lengths && !stats.records_bin_fill, "MapMetaStore records neither");
+    });
+}
+
+/// Time a put/get/remove workload. Returns false if any operation failed.
+template <class Store>
+bool benchmark_store(TAP& tap, const char* name, size_t count) {
+    Store store;
+    auto make_example_chunk = [](size_t i) -> MALLOC_META {
+        // spread the chunks like a heap with mixed chunk sizes
+        return { (void*)(0x555555550000 + 48 * i), 48 };
+    };
+
+    bool ok = true;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++)
+        ok &= store.put(make_example_chunk(i));
+    for (size_t i = 0; i < count; i++)
+        ok &= store.get(make_example_chunk(i).ptr) == make_example_chunk(i);
+    for (size_t i = 0; i < count; i++)
+        ok &= store.remove(make_example_chunk(i));
+    auto end = std::chrono::steady_clock::now();
+
+    tap.note() << name << ": " << std::chrono::duration<double, std::milli>(end - start).count()
+               << " ms for " << count << " chunks" << std::endl;
+    return ok && store.size() == 0;
+}
+
+void test_Swiss_benchmark(TAP& tap) {
+    tap.subtest("SwissMetaStore benchmark against CachedMetaStore<HashMetaStore>", 2, [](TAP& tap) {
+        constexpr size_t COUNT = 200000;
+        tap.ok(benchmark_store<CachedMetaStore<HashMetaStore>>(tap, "CachedMetaStore<HashMetaStore>", COUNT),
+               "CachedMetaStore<HashMetaStore> workload");
+        tap.ok(benchmark_store<SwissMetaStore<>>(tap, "SwissMetaStore", COUNT),
+               "SwissMetaStore workload");
     });
 }
 
 int main(int argc, char** argv) {
-    TAP tap{ 6 };
+    TAP tap{ 38 };
 
     tap.subtest("VectorMetaStore", SUBTESTS, [](TAP& tap) {
         VectorMetaStore<> store;
@@ -129,13 +835,88 @@ int main(int argc, char** argv) {
         test_Store(tap, store);
     });
 
+    tap.subtest("MapMetaStore with PoolAllocator", SUBTESTS, [](TAP& tap) {
+        MapMetaStore<>::with_allocator<PoolAllocator> store;
+        test_Store(tap, store);
+    });
+
+    tap.subtest("HashMetaStore with PoolAllocator", SUBTESTS, [](TAP& tap) {
+        HashMetaStore<>::with_allocator<PoolAllocator> store;
+        test_Store(tap, store);
+    });
+
     tap.subtest("CachedMetaStore", SUBTESTS, [](TAP& tap) {
         CachedMetaStore<MapMetaStore> store;
         test_Store(tap, store);
     });
 
+    tap.subtest("ShardedMetaStore", SUBTESTS, [](TAP& tap) {
+        ShardedMetaStore<> store;
+        test_Store(tap, store);
+    });
+
+    tap.subtest("ThreadLocalMetaStore", SUBTESTS, [](TAP& tap) {
+        ThreadLocalMetaStore<> store;
+        test_Store(tap, store);
+    });
+
+    tap.subtest("CachedMetaStore with incremental rehash", SUBTESTS, [](TAP& tap) {
+        CachedMetaStore<MapMetaStore, std::allocator<MALLOC_META>, true> store;
+        test_Store(tap, store);
+    });
+
+    tap.subtest("SwissMetaStore", SUBTESTS, [](TAP& tap) {
+        SwissMetaStore<> store;
+        test_Store(tap, store);
+    });
+
+    tap.subtest("CompactMetaStore", SUBTESTS, [](TAP& tap) {
+        CompactMetaStore<> store;
+        test_Store(tap, store);
+    });
+
+    tap.subtest("ShadowMetaStore", SUBTESTS, [](TAP& tap) {
+        ShadowMetaStore<> store;
+        test_Store(tap, store);
+    });
+
+    tap.subtest("AdaptiveMetaStore", SUBTESTS, [](TAP& tap) {
+        AdaptiveMetaStore<> store;
+        test_Store(tap, store);
+    });
+
+    tap.subtest("RuntimeMetaStore", 10, [](TAP& tap) {
+        RuntimeMetaStore<> store;
+        tap.ok(!store.select("nonexistent"), "select(unknown store) fails");
+        for (auto name : { "cached", "incremental", "hash", "map", "vector", "swiss", "compact",
+                           "shadow", "adaptive" }) {
+            tap.subtest(name, SUBTESTS + 1, [&](TAP& tap) {
+                tap.ok(store.select(name) && store.selected_store() == std::string(name),
+                       "select()");
+                test_Store(tap, store);
+            });
+        }
+    });
+
     test_Cached_reserve(tap);
     test_Cached_rehash(tap);
+    test_Cached_incremental_rehash(tap);
+    test_Cached_cuckoo(tap);
+    test_Cached_shrink(tap);
+    test_Adaptive_tiers(tap);
+    test_Compact_packing(tap);
+    test_Compact_null_key(tap);
+    test_Compact_alignment(tap);
+    test_Shadow_direct_mapping(tap);
+    test_Mmap_allocator(tap);
+    test_Pool_allocator(tap);
+    test_Sharded_concurrent(tap);
+    test_ThreadLocal_remote_free(tap);
+    test_ThreadLocal_instances(tap);
+    test_Store_lock_all(tap);
+    test_Swiss_rehash(tap);
+    test_Swiss_benchmark(tap);
+    test_Store_statistics(tap);
 
     return !tap.print_result();
 }
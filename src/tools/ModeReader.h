@@ -40,6 +40,22 @@ static constexpr bool use_tca_check =
 #endif
     ;
 
+static constexpr bool use_fbn_check =
+#ifdef FBN_CHECK
+    true
+#else
+    false
+#endif
+    ;
+
+static constexpr bool use_bin_check =
+#ifdef BIN_CHECK
+    true
+#else
+    false
+#endif
+    ;
+
 static constexpr bool use_leak_check =
 #ifdef LEAK_CHECK
     true
@@ -48,14 +64,35 @@ static constexpr bool use_leak_check =
 #endif
     ;
 
+/// The mitigations as bits, e.g. to select hooks that are specialized for them.
+enum Mitigation : unsigned {
+    MITIGATION_PTR = 1u << 0,
+    MITIGATION_TOP = 1u << 1,
+    MITIGATION_USB = 1u << 2,
+    MITIGATION_TCA = 1u << 3,
+    MITIGATION_LEAK = 1u << 4,
+    MITIGATION_FBN = 1u << 5,
+    MITIGATION_BIN = 1u << 6,
+};
+
+/// Look up a variable in an environment like `environ`, as getenv() does.
+inline const char* getenv_in(char const* const* envp, const char* name) {
+    auto length = std::strlen(name);
+    for (; *envp; ++envp) {
+        if (0 == std::strncmp(*envp, name, length) && (*envp)[length] == '=')
+            return *envp + length + 1;
+    }
+    return nullptr;
+}
+
 /// Read an environment variable, possibly returning some error.
 /// If the variable doesn't exist, the out-parameter remains unmodified.
 template <class T>
-inline const char* getenv_parsed(const char* name, T& value);
+inline const char* getenv_parsed(char const* const* envp, const char* name, T& value);
 
 template <>
-inline const char* getenv_parsed<bool>(const char* name, bool& value) {
-    auto* str = getenv(name);
+inline const char* getenv_parsed<bool>(char const* const* envp, const char* name, bool& value) {
+    auto* str = getenv_in(envp, name);
 
     // ignore empty values
     if (!str || !*str) return nullptr;
@@ -74,8 +111,9 @@ inline const char* getenv_parsed<bool>(const char* name, bool& value) {
 }
 
 template <>
-inline const char* getenv_parsed<unsigned long>(const char* name, unsigned long& value) {
-    auto str = getenv(name);
+inline const char* getenv_parsed<unsigned long>(
+    char const* const* envp, const char* name, unsigned long& value) {
+    auto str = getenv_in(envp, name);
 
     // ignore empty values
     if (!str || !*str) return nullptr;
@@ -108,50 +146,99 @@ public:
     bool topMode = use_top_check;
     bool leakMode = use_leak_check;
     bool tcaMode = use_tca_check;
+    bool fbnMode = use_fbn_check;
+    bool binMode = use_bin_check;
 
     size_t initialStoreSize = 0;
 
+    /// The top chunk, unsorted bin and tcache are only checked before 1 in `sampleRate` operations,
+    /// chosen at random. 1 checks all operations.
+    unsigned long sampleRate = 1;
+
+    /// the store implementation requested via SHADOWHEAP_STORE, or NULL
+    const char* storeName = nullptr;
+
     ModeReader() {
     }
 
     ~ModeReader() {
     }
 
+    /// Problem of read_environment() for a variable that starts with SHADOWHEAP_ but is unknown.
+    static constexpr const char* UNRECOGNIZED_VARIABLE = "unrecognized environment variable";
+
     void ensure_initialized() {
         // only perform initialization once
         if (this->isInitialized) return;
 
+        extern char** environ;
+        const char* variable = nullptr;
+        if (auto problem = read_environment(environ, variable)) {
+            if (problem == UNRECOGNIZED_VARIABLE)
+                warn("ShadowHeap: ERROR: %s: %s", problem, variable);
+            else
+                warn("ShadowHeap: ERROR: variable %s: %s", variable, problem);
+            std::exit(1);
+        }
+
+        this->isInitialized = true;
+    }
 
-        auto disable_via_env = [](auto name) {
+    /// Read the modes from the environment `envp`, without reporting anything.
+    /// This also works before libc is initialized, see malloc_hooks.cxx.
+    /// Returns the problem with the offending `variable`, or NULL.
+    const char* read_environment(char const* const* envp, const char*& variable) {
+        auto disable_via_env = [envp, &variable](const char* name, bool& mode) -> const char* {
             auto disable = false;
-            auto problem = getenv_parsed(name, disable);
+            auto problem = getenv_parsed(envp, name, disable);
             if (problem) {
-                warn("ShadowHeap: ERROR: variable %s: %s", name, problem);
-                std::exit(1);
+                variable = name;
+                return problem;
             }
-            return disable;
+            if (disable) mode = false;
+            return nullptr;
         };
 
-        if (ptrMode && disable_via_env("SHADOWHEAP_DISABLE_PTRCHECKS"))
-            ptrMode = false;
+        const char* problem = nullptr;
+        if (ptrMode && (problem = disable_via_env("SHADOWHEAP_DISABLE_PTRCHECKS", ptrMode)))
+            return problem;
 
-        if (usbMode && disable_via_env("SHADOWHEAP_DISABLE_USBCHECKS"))
-            usbMode = false;
+        if (usbMode && (problem = disable_via_env("SHADOWHEAP_DISABLE_USBCHECKS", usbMode)))
+            return problem;
 
-        if (topMode && disable_via_env("SHADOWHEAP_DISABLE_TOPCHECKS"))
-            topMode = false;
+        if (topMode && (problem = disable_via_env("SHADOWHEAP_DISABLE_TOPCHECKS", topMode)))
+            return problem;
 
-        if (leakMode && disable_via_env("SHADOWHEAP_DISABLE_LEAKCHECKS"))
-            leakMode = false;
+        if (leakMode && (problem = disable_via_env("SHADOWHEAP_DISABLE_LEAKCHECKS", leakMode)))
+            return problem;
 
-        if (tcaMode && disable_via_env("SHADOWHEAP_DISABLE_TCACHECKS"))
-            tcaMode = false;
+        if (tcaMode && (problem = disable_via_env("SHADOWHEAP_DISABLE_TCACHECKS", tcaMode)))
+            return problem;
 
-        if (auto problem = getenv_parsed("SHADOWHEAP_SIZE_INITIAL", this->initialStoreSize)) {
-            warn("ShadowHeap: ERROR: variable SHADOWHEAP_SIZE_INITIAL: %s", problem);
-            std::exit(1);
+        if (fbnMode && (problem = disable_via_env("SHADOWHEAP_DISABLE_FBNCHECKS", fbnMode)))
+            return problem;
+
+        if (binMode && (problem = disable_via_env("SHADOWHEAP_DISABLE_BINCHECKS", binMode)))
+            return problem;
+
+        if ((problem = getenv_parsed(envp, "SHADOWHEAP_SIZE_INITIAL", this->initialStoreSize))) {
+            variable = "SHADOWHEAP_SIZE_INITIAL";
+            return problem;
         }
 
+        if ((problem = getenv_parsed(envp, "SHADOWHEAP_SAMPLE_RATE", this->sampleRate))) {
+            variable = "SHADOWHEAP_SAMPLE_RATE";
+            return problem;
+        }
+        if (this->sampleRate == 0) {
+            variable = "SHADOWHEAP_SAMPLE_RATE";
+            return "value must be at least 1";
+        }
+
+        // the name is checked by the store, see ShadowHeapData
+        auto store = getenv_in(envp, "SHADOWHEAP_STORE");
+        if (store && *store) this->storeName = store;
+
         auto consume = [](const char* p, const char* prefix) -> const char* {
             while (*p && *prefix) {
                 if (*p == *prefix) {
@@ -174,7 +261,10 @@ public:
                        consume(s, "DISABLE_USBCHECKS=") ||
                        consume(s, "DISABLE_TOPCHECKS=") ||
                        consume(s, "DISABLE_TCACHECKS=") ||
-                       consume(s, "DISABLE_LEAKCHECKS=") || consume(s, "SIZE_INITIAL=");
+                       consume(s, "DISABLE_FBNCHECKS=") ||
+                       consume(s, "DISABLE_BINCHECKS=") ||
+                       consume(s, "DISABLE_LEAKCHECKS=") || consume(s, "SIZE_INITIAL=") ||
+                       consume(s, "SAMPLE_RATE=") || consume(s, "STORE=");
             } else {
                 // other variables are allowed
                 return true;
@@ -183,14 +273,27 @@ public:
 
         // since we only use POSIX platforms, we can check for illegal environment variables:
         // any variable other than the above that starts with "SHADOWHEAP"
-        extern char** environ;
-        for (char const* const* envp = environ; *envp; ++envp) {
-            if (!is_allowed_env_var(*envp)) {
-                warn("ShadowHeap: ERROR: unrecognized environment variable: %s", *envp);
-                std::exit(1);
+        for (char const* const* kv = envp; *kv; ++kv) {
+            if (!is_allowed_env_var(*kv)) {
+                variable = *kv;
+                return UNRECOGNIZED_VARIABLE;
             }
         }
 
-        this->isInitialized = true;
+        return nullptr;
+    }
+
+    /// The enabled mitigations, see Mitigation.
+    /// The tcache checks need the leak, as in ShadowHeapFacade::ensure_initialized().
+    unsigned mitigations() const noexcept {
+        unsigned enabled = 0;
+        if (ptrMode) enabled |= MITIGATION_PTR;
+        if (topMode) enabled |= MITIGATION_TOP;
+        if (usbMode) enabled |= MITIGATION_USB;
+        if (tcaMode && leakMode) enabled |= MITIGATION_TCA;
+        if (leakMode) enabled |= MITIGATION_LEAK;
+        if (fbnMode) enabled |= MITIGATION_FBN;
+        if (binMode) enabled |= MITIGATION_BIN;
+        return enabled;
     }
 };
@@ -15,62 +15,71 @@ public:
     }
 
     ~ShadowHeapWrapper() {
+        facade.dump_store_statistics();
     }
 
-    void free(void* ptr) __attribute__((flatten)) {
+    template <class Policy = RuntimeMitigations>
+    __attribute__((flatten)) void free(void* ptr) {
         // free(NULL) is legal
         if (UNLIKELY(ptr == nullptr)) return;
 #ifdef SHADOW
-        facade.free_pre(ptr);
+        facade.free_pre<Policy>(ptr);
         info.call_free_raw(ptr);
-        facade.free_post(ptr);
+        facade.free_post<Policy>(ptr);
+        facade.end_operation();
 #else
         info.call_free_raw(ptr);
 #endif
     }
 
-    void* malloc(size_t len) __attribute__((flatten)) {
+    template <class Policy = RuntimeMitigations>
+    __attribute__((flatten)) void* malloc(size_t len) {
         void* ret = NULL;
 #ifdef SHADOW
-        facade.malloc_pre(len);
+        facade.malloc_pre<Policy>(len);
         ret = info.call_malloc_recursive_checked(len);
-        facade.malloc_post(len, ret);
+        facade.malloc_post<Policy>(len, ret);
+        facade.end_operation();
 #else
         ret = info.call_malloc_recursive_checked(len);
 #endif
         return ret;
     }
 
-    void* calloc(size_t cnt, size_t len) __attribute__((flatten)) {
+    template <class Policy = RuntimeMitigations>
+    __attribute__((flatten)) void* calloc(size_t cnt, size_t len) {
         void* ret = NULL;
 #ifdef SHADOW
-        facade.calloc_pre(cnt, len);
+        facade.calloc_pre<Policy>(cnt, len);
         ret = info.call_calloc_recursive_checked(cnt, len);
-        facade.calloc_post(cnt, len, ret);
+        facade.calloc_post<Policy>(cnt, len, ret);
+        facade.end_operation();
 #else
         ret = info.call_calloc_recursive_checked(cnt, len);
 #endif
         return ret;
     }
 
-    void* realloc(void* ptr, size_t len) __attribute__((flatten)) {
+    template <class Policy = RuntimeMitigations>
+    __attribute__((flatten)) void* realloc(void* ptr, size_t len) {
 
         // realloc() is a complicated function with different modes.
         // * can resize memory (normal use case)
         // * if len == 0, free()s memory
         // * if ptr == NULL, malloc()s memory
         // The simple cases can be delegated right here:
-        if (UNLIKELY(ptr == nullptr)) return malloc(len);
+        if (UNLIKELY(ptr == nullptr)) return malloc<Policy>(len);
         if (UNLIKELY(len == 0)) {
-            free(ptr);
+            free<Policy>(ptr);
             return nullptr;
         }
 
         void* ret = NULL;
 #ifdef SHADOW
-        facade.realloc_pre(ptr, len);
-        ret = malloc_memcpy_free_approach(ptr, len);
-        facade.realloc_post(ptr, len, ret);
+        facade.realloc_pre<Policy>(ptr, len);
+        ret = malloc_memcpy_free_approach<Policy>(ptr, len);
+        facade.realloc_post<Policy>(ptr, len, ret);
+        facade.end_operation();
 #else
         ret = info.call_realloc_raw(ptr, len);
 #endif
@@ -83,6 +92,7 @@ public:
     // This isn't exactly optimal,
     // but as a start let's use a malloc-memcpy-free approach instead.
 
+    template <class Policy = RuntimeMitigations>
     void* malloc_memcpy_free_approach(void* ptr, size_t len) {
         // if (ptr) {
         //     auto header = CHUNK_HEADER::from_memory(ptr);
@@ -101,11 +111,11 @@ public:
         //     }
         //     return ret;
         // } else {
-        //     return malloc(len);
+        //     return malloc<Policy>(len);
         // }
 
         void* ret = info.call_malloc_raw(len);
-        facade.realloc_mallochandler(ret, len);
+        facade.realloc_mallochandler<Policy>(ret, len);
 
         // figure out how much to copy
         auto header = CHUNK_HEADER::from_memory(ptr);
@@ -121,7 +131,7 @@ public:
         // *((volatile char*) ret + (copy_this_much - 1));  // ensure dereferenceability of last ret byte
 
         memcpy(ret, ptr, copy_this_much);
-        facade.realloc_freehandler(ptr);
+        facade.realloc_freehandler<Policy>(ptr);
 
         return ret;
     }
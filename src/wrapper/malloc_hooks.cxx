@@ -1,7 +1,157 @@
 #include "ShadowHeapWrapper.h"
 
+#include <atomic>
+#include <utility>
+
 ShadowHeapWrapper wrapper;
 
+#if defined(SHADOW) && defined(SPECIALIZED_HOOKS)
+
+// The exported functions call through a table of hooks, which is bound on the first call
+// by publishing a pointer to it.
+// The binding reads the modes like the facade does and selects the hooks that are specialized
+// for them, see SpecializedMitigations. So the hooks don't check any modes per call.
+//
+// This isn't done with GNU indirect functions, because libc is relocated before this library,
+// and its own references to malloc would be bound before the resolvers can run.
+// Those calls would fall back to hooks that check the modes on every call,
+// and the dynamic linker prints a "Relink" note for them to stderr in every process.
+
+namespace {
+
+template <unsigned Index>
+struct SpecializedHooks {
+    using Policy = SpecializedMitigations<Index>;
+
+    static void* malloc(size_t len) {
+        return wrapper.malloc<Policy>(len);
+    }
+    static void* calloc(size_t cnt, size_t len) {
+        return wrapper.calloc<Policy>(cnt, len);
+    }
+    static void* realloc(void* ptr, size_t len) {
+        return wrapper.realloc<Policy>(ptr, len);
+    }
+    static void free(void* ptr) {
+        wrapper.free<Policy>(ptr);
+    }
+};
+
+/// The hooks that check the modes on every call, for an invalid environment,
+/// so that the facade reports it as before.
+struct GenericHooks {
+    static void* malloc(size_t len) {
+        return wrapper.malloc(len);
+    }
+    static void* calloc(size_t cnt, size_t len) {
+        return wrapper.calloc(cnt, len);
+    }
+    static void* realloc(void* ptr, size_t len) {
+        return wrapper.realloc(ptr, len);
+    }
+    static void free(void* ptr) {
+        wrapper.free(ptr);
+    }
+};
+
+struct HookTable {
+    void* (*malloc)(size_t);
+    void* (*calloc)(size_t, size_t);
+    void* (*realloc)(void*, size_t);
+    void (*free)(void*);
+};
+
+template <class Hooks>
+constexpr HookTable hook_table() {
+    return { Hooks::malloc, Hooks::calloc, Hooks::realloc, Hooks::free };
+}
+
+template <size_t... Index>
+HookTable const& specialized_hooks(unsigned index, std::index_sequence<Index...>) {
+    // equivalent specializations share one instantiation
+    static const HookTable table[] = {
+        hook_table<SpecializedHooks<canonical_specialization(Index)>>()...,
+    };
+    return table[index];
+}
+
+// The first call may come from libc before it is initialized,
+// so the environment is taken from the stack.
+extern "C" __attribute__((weak)) void* __libc_stack_end;
+
+/// The initial stack holds argc, the arguments, NULL, and then the environment.
+char const* const* initial_environment() {
+    auto stack = static_cast<char const* const*>(__libc_stack_end);
+    auto argc = *reinterpret_cast<long const*>(stack);
+    return stack + 1 + argc + 1;
+}
+
+HookTable const* select_hooks() {
+    static constexpr HookTable generic = hook_table<GenericHooks>();
+    if (UNLIKELY(&__libc_stack_end == nullptr || __libc_stack_end == nullptr)) return &generic;
+    auto selected = ShadowHeapFacade::select_specialization(initial_environment());
+    if (UNLIKELY(selected == SPECIALIZATIONS)) return &generic;
+    return &specialized_hooks(selected, std::make_index_sequence<SPECIALIZATIONS>{});
+}
+
+/// Bind the hooks on the first call, then forward it.
+/// Threads that race on the first call select the same hooks.
+struct BindingHooks {
+    static void* malloc(size_t len);
+    static void* calloc(size_t cnt, size_t len);
+    static void* realloc(void* ptr, size_t len);
+    static void free(void* ptr);
+};
+
+constexpr HookTable binding_hooks = hook_table<BindingHooks>();
+
+/// The hooks of the exported functions. The tables are constant, so one atomic pointer
+/// publishes all four hooks at once, and threads that read it while another binds it see either table.
+std::atomic<HookTable const*> hooks{ &binding_hooks };
+
+inline HookTable const& bound_hooks() {
+    return *hooks.load(std::memory_order_acquire);
+}
+
+__attribute__((noinline, cold)) HookTable const& bind_hooks() {
+    auto selected = select_hooks();
+    hooks.store(selected, std::memory_order_release);
+    return *selected;
+}
+
+void* BindingHooks::malloc(size_t len) {
+    return bind_hooks().malloc(len);
+}
+void* BindingHooks::calloc(size_t cnt, size_t len) {
+    return bind_hooks().calloc(cnt, len);
+}
+void* BindingHooks::realloc(void* ptr, size_t len) {
+    return bind_hooks().realloc(ptr, len);
+}
+void BindingHooks::free(void* ptr) {
+    bind_hooks().free(ptr);
+}
+
+}  // namespace
+
+extern "C" void* malloc(size_t len) {
+    return bound_hooks().malloc(len);
+}
+
+extern "C" void* calloc(size_t cnt, size_t len) {
+    return bound_hooks().calloc(cnt, len);
+}
+
+extern "C" void* realloc(void* ptr, size_t len) {
+    return bound_hooks().realloc(ptr, len);
+}
+
+extern "C" void free(void* ptr) {
+    bound_hooks().free(ptr);
+}
+
+#else
+
 extern "C" void* malloc(size_t len) {
     return wrapper.malloc(len);
 }
@@ -17,3 +167,5 @@ extern "C" void* realloc(void* ptr, size_t len) {
 extern "C" void free(void* ptr) {
     wrapper.free(ptr);
 }
+
+#endif